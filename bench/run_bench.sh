@@ -0,0 +1,184 @@
+#!/bin/bash
+#
+# Runs the synthetic palay workloads in workloads/ and writes the wall time,
+# pages per second and peak RSS of each one as JSON.
+#
+# Usage: run_bench.sh [-n runs] [-a args] [-o results.json] [-c baseline.json] [-t percent] [workload...]
+#
+#   -a args       extra arguments for palay, e.g. -a --build-mode to compare
+#                 against a run with build mode
+#   -n runs       run each workload this many times and keep the fastest (default 3)
+#   -o file       write the JSON results to file instead of stdout
+#   -c baseline   compare the results against a saved baseline and fail if any
+#                 workload is slower or uses more memory than the threshold allows
+#   -t percent    regression threshold for -c (default 10)
+#
+# Workloads are named by their file name without .palay, e.g. "large_table".
+
+SCRIPT_NAME=$0
+BENCH_DIR=$(dirname $(readlink -f $0))
+
+red=$'\e[31m'
+green=$'\e[32m'
+normal=$'\e[0m'
+
+PALAY=${PALAY:-$BENCH_DIR/../palay/palay}
+RUNS=3
+PALAY_ARGS=
+OUTPUT=
+BASELINE=
+THRESHOLD=10
+
+while getopts "n:a:o:c:t:" opt; do
+    case $opt in
+        n) RUNS=$OPTARG ;;
+        a) PALAY_ARGS=$OPTARG ;;
+        o) OUTPUT=$OPTARG ;;
+        c) BASELINE=$OPTARG ;;
+        t) THRESHOLD=$OPTARG ;;
+        *) echo "Usage: $SCRIPT_NAME [-n runs] [-a args] [-o results.json] [-c baseline.json] [-t percent] [workload...]" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+WORKLOADS=$*
+
+# The workloads run from their own directory
+[ -n "$OUTPUT" ] && OUTPUT=$(readlink -f $OUTPUT)
+[ -n "$BASELINE" ] && BASELINE=$(readlink -f $BASELINE)
+
+command -v $PALAY >/dev/null 2>&1 || { echo "$SCRIPT_NAME: palay not found. Build it first." >&2; exit 1; }
+command -v pdfinfo >/dev/null 2>&1 || { echo "$SCRIPT_NAME: pdfinfo required. Install by 'sudo apt-get install poppler-utils' or similar" >&2; exit 1; }
+[ -n "$BASELINE" ] && [ ! -f "$BASELINE" ] && { echo "$SCRIPT_NAME: baseline $BASELINE not found" >&2; exit 1; }
+
+# GNU time reports the peak RSS. Without it only the wall time is measured.
+HAVE_GNU_TIME=false
+/usr/bin/time -f "%e %M" true >/dev/null 2>&1 && HAVE_GNU_TIME=true
+
+# point to libpalay.so
+export LD_LIBRARY_PATH=$BENCH_DIR/../libpalay
+
+WORK_DIR=$(mktemp -d)
+trap "rm -rf $WORK_DIR" EXIT
+
+# Runs one workload once and prints "<wall seconds> <peak rss kb>"
+measure() {
+    local script=$1
+    local pdf=$2
+    if $HAVE_GNU_TIME; then
+        /usr/bin/time -f "%e %M" -o $WORK_DIR/time $PALAY $PALAY_ARGS -o $pdf $script >/dev/null || return 1
+        cat $WORK_DIR/time
+    else
+        local start=$(date +%s.%N)
+        $PALAY $PALAY_ARGS -o $pdf $script >/dev/null || return 1
+        local end=$(date +%s.%N)
+        awk -v s=$start -v e=$end 'BEGIN { printf "%.2f null\n", e - s }'
+    fi
+}
+
+# Runs a workload $RUNS times and prints its JSON object
+bench() {
+    local name=$1
+    local script=$BENCH_DIR/workloads/$name.palay
+    local pdf=$WORK_DIR/$name.pdf
+    local best_wall=
+    local best_rss=null
+
+    # Scripts refer to files relative to the workloads directory
+    cd $BENCH_DIR/workloads
+    for run in $(seq $RUNS); do
+        local result
+        result=$(measure $script $pdf) || { echo "$SCRIPT_NAME: $name failed" >&2; return 1; }
+        local wall=${result% *}
+        local rss=${result#* }
+        if [ -z "$best_wall" ] || awk -v a=$wall -v b=$best_wall 'BEGIN { exit !(a < b) }'; then
+            best_wall=$wall
+        fi
+        if [ "$rss" != "null" ] && { [ "$best_rss" == "null" ] || [ $rss -lt $best_rss ]; }; then
+            best_rss=$rss
+        fi
+    done
+
+    local pages=$(pdfinfo $pdf | awk '/^Pages:/ { print $2 }')
+    local pps=$(awk -v p=$pages -v w=$best_wall 'BEGIN { printf "%.2f", w > 0 ? p / w : 0 }')
+    printf '    {"name": "%s", "runs": %d, "wall_seconds": %.3f, "pages": %d, "pages_per_second": %s, "peak_rss_kb": %s}' \
+        $name $RUNS $best_wall $pages $pps $best_rss
+}
+
+# Compares results against the baseline. Both files have one benchmark per
+# line, as written by this script.
+compare() {
+    local results=$1
+    local baseline=$2
+    awk -v threshold=$THRESHOLD -v red="$red" -v green="$green" -v normal="$normal" '
+        function field(line, key,    m) {
+            if (match(line, "\"" key "\": *[^,}]*")) {
+                m = substr(line, RSTART, RLENGTH)
+                sub(/^[^:]*: */, "", m)
+                gsub(/"/, "", m)
+                return m
+            }
+            return ""
+        }
+        function check(name, what, old, new) {
+            if (old == "" || old == "null" || new == "" || new == "null" || old == 0)
+                return
+            change = (new - old) * 100 / old
+            if (change > threshold) {
+                printf "%s%s: %s regressed %.1f%% (%s -> %s)%s\n", red, name, what, change, old, new, normal
+                failed = 1
+            } else {
+                printf "%s: %s %+.1f%% (%s -> %s)\n", name, what, change, old, new
+            }
+        }
+        /"name"/ {
+            name = field($0, "name")
+            if (FILENAME == ARGV[1]) {
+                baseWall[name] = field($0, "wall_seconds")
+                baseRss[name] = field($0, "peak_rss_kb")
+            } else if (name in baseWall) {
+                check(name, "wall time", baseWall[name], field($0, "wall_seconds"))
+                check(name, "peak RSS", baseRss[name], field($0, "peak_rss_kb"))
+            } else {
+                printf "%s: not in baseline\n", name
+            }
+        }
+        END {
+            if (failed) {
+                printf "%sOne or more benchmarks regressed by more than %s%%!%s\n", red, threshold, normal
+                exit 1
+            }
+            printf "%sNo regressions.%s\n", green, normal
+        }' $baseline $results >&2
+}
+
+[ "$WORKLOADS" == "" ] && WORKLOADS=$(cd $BENCH_DIR/workloads && ls *.palay | sed 's/\.palay$//' | sort)
+
+RESULTS=$WORK_DIR/results.json
+{
+    echo "{"
+    echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+    echo "  \"host\": \"$(uname -n)\","
+    echo "  \"palay_args\": \"$PALAY_ARGS\","
+    echo "  \"benchmarks\": ["
+    first=true
+    for NAME in $WORKLOADS; do
+        echo "Running $NAME..." >&2
+        $first || echo ","
+        first=false
+        bench $NAME || exit 1
+    done
+    echo
+    echo "  ]"
+    echo "}"
+} > $RESULTS || exit 1
+
+if [ -n "$OUTPUT" ]; then
+    cp $RESULTS $OUTPUT
+else
+    cat $RESULTS
+fi
+
+if [ -n "$BASELINE" ]; then
+    compare $RESULTS $BASELINE || exit 1
+fi
+exit 0
@@ -0,0 +1,91 @@
+#!/bin/bash
+#
+# Measures how layout scales with threads on scaling/text_report.palay,
+# a text report of about 5,000 pages in 100 sections. Prints the wall time,
+# pages per second and speedup over one thread for each thread count as
+# JSON.
+#
+# Usage: run_scaling.sh [-n runs] [-o results.json] [threads...]
+#
+#   -n runs       run each thread count this many times and keep the fastest (default 3)
+#   -o file       write the JSON results to file instead of stdout
+#
+# The default thread counts are 1, 2, 4 and 8.
+
+SCRIPT_NAME=$0
+BENCH_DIR=$(dirname $(readlink -f $0))
+
+PALAY=${PALAY:-$BENCH_DIR/../palay/palay}
+RUNS=3
+OUTPUT=
+
+while getopts "n:o:" opt; do
+    case $opt in
+        n) RUNS=$OPTARG ;;
+        o) OUTPUT=$OPTARG ;;
+        *) echo "Usage: $SCRIPT_NAME [-n runs] [-o results.json] [threads...]" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+THREADS=${*:-1 2 4 8}
+
+[ -n "$OUTPUT" ] && OUTPUT=$(readlink -f $OUTPUT)
+
+command -v $PALAY >/dev/null 2>&1 || { echo "$SCRIPT_NAME: palay not found. Build it first." >&2; exit 1; }
+command -v pdfinfo >/dev/null 2>&1 || { echo "$SCRIPT_NAME: pdfinfo required. Install by 'sudo apt-get install poppler-utils' or similar" >&2; exit 1; }
+
+# point to libpalay.so
+export LD_LIBRARY_PATH=$BENCH_DIR/../libpalay
+
+WORK_DIR=$(mktemp -d)
+trap "rm -rf $WORK_DIR" EXIT
+
+SCRIPT=$BENCH_DIR/scaling/text_report.palay
+PDF=$WORK_DIR/text_report.pdf
+
+# Prints the fastest wall time of $RUNS runs with $1 threads
+fastest() {
+    local best=
+    for run in $(seq $RUNS); do
+        local start=$(date +%s.%N)
+        $PALAY -j $1 -o $PDF $SCRIPT >/dev/null || return 1
+        local end=$(date +%s.%N)
+        local wall=$(awk -v s=$start -v e=$end 'BEGIN { printf "%.3f", e - s }')
+        if [ -z "$best" ] || awk -v a=$wall -v b=$best 'BEGIN { exit !(a < b) }'; then
+            best=$wall
+        fi
+    done
+    echo $best
+}
+
+RESULTS=$WORK_DIR/results.json
+{
+    echo "{"
+    echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+    echo "  \"host\": \"$(uname -n)\","
+    echo "  \"cores\": $(nproc),"
+    echo "  \"scaling\": ["
+    first=true
+    base=
+    for N in $THREADS; do
+        echo "Running with $N thread(s)..." >&2
+        wall=$(fastest $N) || { echo "$SCRIPT_NAME: palay failed with $N threads" >&2; exit 1; }
+        [ -z "$base" ] && base=$wall
+        pages=$(pdfinfo $PDF | awk '/^Pages:/ { print $2 }')
+        $first || echo ","
+        first=false
+        awk -v n=$N -v w=$wall -v p=$pages -v b=$base -v r=$RUNS 'BEGIN {
+            printf "    {\"threads\": %d, \"runs\": %d, \"wall_seconds\": %.3f, \"pages\": %d, \"pages_per_second\": %.2f, \"speedup\": %.2f}",
+                n, r, w, p, w > 0 ? p / w : 0, w > 0 ? b / w : 0 }'
+    done
+    echo
+    echo "  ]"
+    echo "}"
+} > $RESULTS || exit 1
+
+if [ -n "$OUTPUT" ]; then
+    cp $RESULTS $OUTPUT
+else
+    cat $RESULTS
+fi
+exit 0
@@ -43,6 +43,20 @@ QTextDocument *AbsoluteBlock::document()
     return document_;
 }
 
+Qt::Corner AbsoluteBlock::corner() const
+{
+    return corner_;
+}
+
+/*!
+    Returns the position of the corner() the block is anchored by, as
+    passed to the constructor.
+ */
+QPointF AbsoluteBlock::position() const
+{
+    return position_;
+}
+
 QPointF AbsoluteBlock::absolutePosition()
 {
     qreal width = document_->idealWidth();
@@ -32,6 +32,9 @@ public:
 
     QTextDocument *document();
 
+    Qt::Corner corner() const;
+    QPointF position() const;
+
     QPointF absolutePosition();
 
     QRectF bounds();
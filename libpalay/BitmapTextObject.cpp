@@ -15,11 +15,92 @@
  */
 
 #include "BitmapTextObject.h"
+#include "ImagePreprocessor.h"
+#include "PdfWriter.h"
+#include "Trace.h"
 #include <QPainter>
+#include <QCache>
+#include <QBuffer>
+#include <QImageReader>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QtConcurrentRun>
+#include <qmath.h>
 
 Q_GUI_EXPORT extern int qt_defaultDpiX();
 Q_GUI_EXPORT extern int qt_defaultDpiY();
 
+// Resolution of the proxy images drawn in draft mode
+static const int draftDpi = 72;
+
+// Size of the cache of resampled images shared by all bitmaps
+static const int resampledCacheKb = 64 * 1024;
+
+// Resampled images by source, size and transformation mode. Pages can be
+// painted in the thread pool, so it is only used with the mutex locked.
+static QCache<QString, QImage> resampledImages(resampledCacheKb);
+static QMutex resampledImagesMutex;
+
+// Memory that images decoded ahead of drawing can use between them.
+// Past it images are decoded when they are drawn instead.
+static const qint64 prefetchBudget = 64 * 1024 * 1024;
+static qint64 prefetchBytes = 0;
+static QMutex prefetchMutex;
+
+static bool reservePrefetch(qint64 bytes)
+{
+    QMutexLocker locker(&prefetchMutex);
+    if (prefetchBytes + bytes > prefetchBudget)
+        return false;
+    prefetchBytes += bytes;
+    return true;
+}
+
+static void releasePrefetch(qint64 bytes)
+{
+    QMutexLocker locker(&prefetchMutex);
+    prefetchBytes -= bytes;
+}
+
+// Size of the cache of image files shared by all bitmaps
+static const int imageFileCacheKb = 64 * 1024;
+
+// What is known about an image file: its header and the decoded image
+// once it has been decoded.
+struct ImageFile {
+    QSize size;
+    QByteArray encodedFormat;
+    bool canRead;
+    QImage image;
+};
+
+// Image files by name and modification time, so the same file placed in
+// many documents, like a logo in a merge, is only read and decoded once.
+// Images are decoded and drawn in the thread pool, so entries are copied
+// in and out with the mutex locked.
+static QCache<QString, ImageFile> imageFiles(imageFileCacheKb);
+static QMutex imageFilesMutex;
+
+static bool findImageFile(const QString &key, ImageFile *file)
+{
+    QMutexLocker locker(&imageFilesMutex);
+    const ImageFile *cached = key.isEmpty() ? 0 : imageFiles.object(key);
+    if (!cached)
+        return false;
+    *file = *cached;
+    return true;
+}
+
+static void cacheImageFile(const QString &key, const ImageFile &file)
+{
+    const int costKb = file.image.byteCount() / 1024 + 1;
+    QMutexLocker locker(&imageFilesMutex);
+    imageFiles.insert(key, new ImageFile(file), costKb);
+}
+
 /*!
     \class BitmapTextObject
     \brief The BitmapTextObject class is used to insert a bitmap image as a custom object in a QTextDocument without converting to a QPixmap first.
@@ -31,25 +112,286 @@ Q_GUI_EXPORT extern int qt_defaultDpiY();
 
 BitmapTextObject::BitmapTextObject(const QImage &image, float width, float height, QObject *parent) :
     QObject(parent),
-    size_(width, height),
-    image_(image)
+    imageSize_(image.size()),
+    image_(image),
+    decodePending_(false),
+    prefetchCost_(0),
+    decodeMode_(Qt::SmoothTransformation),
+    draft_(false),
+    maxDpi_(0),
+    drawn_(false),
+    continuesOnNextPage_(false)
+{
+    initSize(width, height);
+}
+
+/*!
+    Constructs a bitmap from the image file \a filename. Only the header is read
+    to get the image size, the image is decoded when it is first drawn.
+    Files in formats that PDF supports natively (see isNativePdfFormat()) are
+    read again when they are drawn so they can be embedded without decoding
+    and re-encoding. Use isValid() to check if the file could be read.
+ */
+BitmapTextObject::BitmapTextObject(const QString &filename, float width, float height, QObject *parent) :
+    QObject(parent),
+    decodePending_(false),
+    prefetchCost_(0),
+    decodeMode_(Qt::SmoothTransformation),
+    draft_(false),
+    maxDpi_(0),
+    drawn_(false),
+    continuesOnNextPage_(false)
+{
+    fileKey_ = QString("%1@%2").arg(filename).arg(QFileInfo(filename).lastModified().toMSecsSinceEpoch());
+    ImageFile cached;
+    if (findImageFile(fileKey_, &cached)) {
+        imageSize_ = cached.size;
+        encodedFormat_ = cached.encodedFormat;
+        if (cached.canRead)
+            filename_ = filename;
+        image_ = cached.image;
+        initSize(width, height);
+        return;
+    }
+
+    QImageReader reader(filename);
+    imageSize_ = reader.size();
+    if (isNativePdfFormat(reader.format())) {
+        // The contents are read when the image is embedded, see encodedData()
+        if (QFileInfo(filename).isReadable()) {
+            filename_ = filename;
+            encodedFormat_ = reader.format();
+        } else {
+            imageSize_ = QSize();
+        }
+    } else if (reader.canRead()) {
+        filename_ = filename;
+        if (!imageSize_.isValid()) {
+            // Not all image formats have the size in the header
+            image_ = reader.read();
+            imageSize_ = image_.size();
+        }
+    }
+    initSize(width, height);
+
+    if (isValid()) {
+        ImageFile file;
+        file.size = imageSize_;
+        file.encodedFormat = encodedFormat_;
+        file.canRead = !filename_.isEmpty();
+        file.image = image_;
+        cacheImageFile(fileKey_, file);
+    }
+}
+
+/*!
+    Constructs a bitmap from the still encoded contents of an image file. Only
+    the header is read to get the image size, the image is decoded when it is
+    drawn.
+ */
+BitmapTextObject::BitmapTextObject(const QByteArray &encodedData, const QByteArray &format, float width, float height, QObject *parent) :
+    QObject(parent),
+    decodePending_(false),
+    prefetchCost_(0),
+    decodeMode_(Qt::SmoothTransformation),
+    encodedData_(encodedData),
+    encodedFormat_(format),
+    draft_(false),
+    maxDpi_(0),
+    drawn_(false),
+    continuesOnNextPage_(false)
 {
+    QBuffer buffer(&encodedData_);
+    QImageReader reader(&buffer, encodedFormat_);
+    imageSize_ = reader.size();
+    initSize(width, height);
+}
+
+BitmapTextObject::~BitmapTextObject()
+{
+    // The decode running in the thread pool uses this object
+    if (decodePending_)
+        decodeResult_.waitForFinished();
+    if (prefetchCost_ > 0)
+        releasePrefetch(prefetchCost_);
+}
+
+void BitmapTextObject::initSize(float width, float height)
+{
+    size_ = QSizeF(width, height);
     if (width <= 0 && height <= 0) {
         // no height or width use default size
-        size_.setWidth(image.width());
-        size_.setHeight(image.height());
+        size_.setWidth(imageSize_.width());
+        size_.setHeight(imageSize_.height());
     } else if (width <= 0) {
         // use height and aspect ratio to compute width
-        size_.setWidth(height * image.width() / image.height());
+        size_.setWidth(height * imageSize_.width() / imageSize_.height());
     } else if (height <= 0) {
         // use width and aspect ratio to compute height
-        size_.setHeight(width * image.height() / image.width());
+        size_.setHeight(width * imageSize_.height() / imageSize_.width());
     }
 }
 
+/*!
+    Returns true if images in \a format can be embedded in a PDF as is: JPEG
+    using the DCTDecode filter and JPEG 2000 using the JPXDecode filter.
+ */
+bool BitmapTextObject::isNativePdfFormat(const QByteArray &format)
+{
+    return format == "jpeg" || format == "jpg" || format == "jp2";
+}
+
 bool BitmapTextObject::isValid() const
 {
-    return !image_.isNull();
+    return imageSize_.isValid() && (canDecode() || !image_.isNull());
+}
+
+/*!
+    Returns the size that the image is placed at in points. Without a width
+    or height it is placed at one point per pixel.
+ */
+QSizeF BitmapTextObject::size() const
+{
+    return size_;
+}
+
+/*!
+    Starts decoding the image in the global thread pool so that it is ready
+    by the time it is drawn. The image is decoded at the resolution it will
+    be drawn at given its size and setDraft() or setMaxDpi(). If those have
+    changed since the last call, the image decoded then is dropped and the
+    image is decoded again. Does nothing if the image is already decoded or
+    the images being decoded ahead already use their share of memory, in
+    which case the image is decoded when it is drawn.
+ */
+void BitmapTextObject::startDecode()
+{
+    const QSize size = prefetchSize();
+    const Qt::TransformationMode mode = draft_ ? Qt::FastTransformation : Qt::SmoothTransformation;
+    if ((decodePending_ || !prefetched_.isNull()) && (size != decodeSize_ || mode != decodeMode_)) {
+        // A full resolution image stays as it can be drawn at any size
+        if (!prefetched().isNull()) {
+            prefetched_ = QImage();
+            releasePrefetch(prefetchCost_);
+            prefetchCost_ = 0;
+        }
+    }
+
+    if (!image_.isNull() || !prefetched_.isNull() || decodePending_ || !canDecode())
+        return;
+    ImageFile cached;
+    if (findImageFile(fileKey_, &cached) && !cached.image.isNull()) {
+        image_ = cached.image;
+        return;
+    }
+
+    const qint64 cost = qint64(size.width()) * size.height() * 4;
+    if (!reservePrefetch(cost))
+        return;
+    prefetchCost_ = cost;
+    decodeSize_ = size;
+    decodeMode_ = mode;
+    decodeResult_ = QtConcurrent::run(this, &BitmapTextObject::decode, size == imageSize_ ? QSize() : size, mode);
+    decodePending_ = true;
+}
+
+/*!
+    Returns the pixel size the image is decoded at by startDecode(): the
+    size it is placed at in the maximum resolution if that is smaller than
+    the image, otherwise the full image.
+ */
+QSize BitmapTextObject::prefetchSize() const
+{
+    int dpi = draft_ ? draftDpi : maxDpi_;
+    if (dpi <= 0)
+        return imageSize_;
+    QSize size(qCeil(size_.width() * dpi / 72), qCeil(size_.height() * dpi / 72));
+    if (size.isEmpty() || size.width() >= imageSize_.width() || size.height() >= imageSize_.height())
+        return imageSize_;
+    return size;
+}
+
+/*!
+    Waits for the decode started by startDecode() and returns the image if
+    it was decoded below full resolution. A full resolution image becomes
+    the image returned by image().
+ */
+QImage BitmapTextObject::prefetched() const
+{
+    if (decodePending_) {
+        QImage decoded = decodeResult_.result();
+        decodeResult_ = QFuture<QImage>();
+        decodePending_ = false;
+        if (decoded.size() == imageSize_)
+            image_ = decoded;
+        else
+            prefetched_ = decoded;
+    }
+    return prefetched_;
+}
+
+/*!
+    Returns true if the image can be decoded again after it has
+    been released.
+ */
+bool BitmapTextObject::canDecode() const
+{
+    return !encodedData_.isEmpty() || !filename_.isEmpty();
+}
+
+/*!
+    Returns the original contents of the image file if it is in a format
+    PDF supports natively, otherwise an empty array. Files are read the
+    first time this is called and released again in pageFinished().
+ */
+QByteArray BitmapTextObject::encodedData() const
+{
+    if (!isNativePdfFormat(encodedFormat_))
+        return QByteArray();
+    if (encodedData_.isEmpty() && !filename_.isEmpty()) {
+        PALAY_TRACE_SCOPE("image", "read");
+        QFile file(filename_);
+        if (file.open(QFile::ReadOnly))
+            encodedData_ = file.readAll();
+    }
+    return encodedData_;
+}
+
+QByteArray BitmapTextObject::encodedFormat() const
+{
+    return encodedFormat_;
+}
+
+/*!
+    Returns true if drawing into \a rect does not need the image to be
+    resampled so a paint device that supports it can embed encodedData()
+    directly.
+ */
+bool BitmapTextObject::canEmbedEncoded(const QRectF &rect) const
+{
+    if (!isNativePdfFormat(encodedFormat_) || !canDecode())
+        return false;
+    QSize size = targetSize(rect);
+    return !size.isValid() || size.width() >= imageSize_.width() || size.height() >= imageSize_.height();
+}
+
+/*!
+    In draft mode the image is drawn from a low resolution proxy
+    instead of the full image.
+ */
+void BitmapTextObject::setDraft(bool draft)
+{
+    draft_ = draft;
+}
+
+/*!
+    Images with a higher resolution than \a dpi at the size they are drawn
+    are downsampled to \a dpi before drawing. Zero or less draws the
+    image at its full resolution.
+ */
+void BitmapTextObject::setMaxDpi(int dpi)
+{
+    maxDpi_ = dpi;
 }
 
 QSizeF BitmapTextObject::intrinsicSize(QTextDocument *doc, int posInDocument, const QTextFormat &format)
@@ -76,5 +418,150 @@ void BitmapTextObject::drawObject(QPainter *painter, const QRectF &rect, QTextDo
     Q_UNUSED(doc);
     Q_UNUSED(format);
 
-    painter->drawImage(rect, image_);
+    // PdfWriter embeds JPEGs without decoding them
+    PdfWriter *writer = painter->paintEngine()->type() == PdfWriter::EngineType ?
+                static_cast<PdfWriter*>(painter->device()) : 0;
+    if (!writer || !canEmbedEncoded(rect) || !writer->drawEncodedImage(painter, rect, encodedData(), encodedFormat_))
+        painter->drawImage(rect, imageForRect(rect));
+
+    // Remember if part of the image falls on the next page so it isn't
+    // released in pageFinished() before that page is painted.
+    drawn_ = true;
+    continuesOnNextPage_ = painter->transform().mapRect(rect).bottom() > painter->device()->height();
+}
+
+/*!
+    Called after each page is painted. Releases the decoded image if it was
+    drawn on the page and doesn't continue on the next page so that only the
+    images for the current page are held in memory. The image is decoded again
+    if it is drawn after being released.
+ */
+void BitmapTextObject::pageFinished()
+{
+    if (drawn_ && !continuesOnNextPage_ && canDecode()) {
+        image_ = QImage();
+        prefetched_ = QImage();
+        if (!filename_.isEmpty())
+            encodedData_.clear();
+        if (prefetchCost_ > 0) {
+            releasePrefetch(prefetchCost_);
+            prefetchCost_ = 0;
+        }
+    }
+    drawn_ = false;
+}
+
+/*!
+    Returns the pixel size the image should be drawn at into \a rect given the
+    maximum resolution or an invalid size if there is no maximum.
+ */
+QSize BitmapTextObject::targetSize(const QRectF &rect) const
+{
+    int dpi = draft_ ? draftDpi : maxDpi_;
+    if (dpi <= 0)
+        return QSize();
+
+    // rect is in document units (qt_defaultDpi dots per inch)
+    return QSize(qCeil(rect.width() * dpi / qt_defaultDpiX()),
+                 qCeil(rect.height() * dpi / qt_defaultDpiY()));
+}
+
+/*!
+    Returns the full resolution image, decoding it if necessary.
+ */
+QImage BitmapTextObject::image() const
+{
+    prefetched();
+    if (image_.isNull()) {
+        // Released after an earlier page or decoded by another bitmap of the same file
+        ImageFile cached;
+        if (findImageFile(fileKey_, &cached) && !cached.image.isNull()) {
+            image_ = cached.image;
+            return image_;
+        }
+        image_ = decode(QSize(), Qt::SmoothTransformation);
+    }
+    ImageFile cached;
+    if (!image_.isNull() && findImageFile(fileKey_, &cached) && cached.image.isNull()) {
+        cached.image = image_;
+        cacheImageFile(fileKey_, cached);
+    }
+    return image_;
+}
+
+/*!
+    Decodes the image from the file or encoded data. If \a scaledSize is valid
+    the decoder scales the image while decoding, which for JPEG happens in the
+    DCT domain and is much cheaper than decoding the full image.
+ */
+QImage BitmapTextObject::decode(const QSize &scaledSize, Qt::TransformationMode mode) const
+{
+    PALAY_TRACE_SCOPE("image", "decode");
+    // Files are decoded from the file, as their contents may be read and
+    // released by encodedData() while this runs in the thread pool
+    QBuffer buffer;
+    QImageReader reader;
+    if (!filename_.isEmpty()) {
+        reader.setFileName(filename_);
+    } else if (!encodedData_.isEmpty()) {
+        buffer.setData(encodedData_);
+        reader.setDevice(&buffer);
+        reader.setFormat(encodedFormat_);
+    } else {
+        return QImage();
+    }
+
+    if (scaledSize.isValid()) {
+        reader.setScaledSize(scaledSize);
+        if (mode == Qt::FastTransformation)
+            reader.setQuality(0);
+    }
+    return ImagePreprocessor::prepare(reader.read());
+}
+
+/*!
+    Returns the image resampled to the resolution it should be embedded at when
+    drawn into \a rect. Images are only ever downsampled. Resampled images are
+    cached by source image and target size so an image placed many times at the
+    same size is only resampled once.
+ */
+QImage BitmapTextObject::imageForRect(const QRectF &rect) const
+{
+    QSize size = targetSize(rect);
+    if (!size.isValid() || size.isEmpty() || size.width() >= imageSize_.width() || size.height() >= imageSize_.height())
+        return image();
+
+    // The layout rounds the placed size, so the image decoded ahead from
+    // it can be a pixel out
+    QImage decoded = prefetched();
+    if (!decoded.isNull() && qAbs(decoded.width() - size.width()) <= 1 && qAbs(decoded.height() - size.height()) <= 1)
+        return decoded;
+
+    Qt::TransformationMode mode = draft_ ? Qt::FastTransformation : Qt::SmoothTransformation;
+    QString source;
+    if (!filename_.isEmpty())
+        source = filename_;
+    else if (!encodedData_.isEmpty())
+        source = QString("%1:%2").arg(qHash(encodedData_)).arg(encodedData_.size());
+    else
+        source = QString::number(image_.cacheKey());
+    QString key = QString("%1/%2x%3/%4").arg(source).arg(size.width()).arg(size.height()).arg(mode);
+
+    {
+        QMutexLocker locker(&resampledImagesMutex);
+        if (QImage *cached = resampledImages.object(key))
+            return *cached;
+    }
+
+    // Avoid decoding the full image if it isn't already in memory
+    QImage resampled;
+    if (image_.isNull())
+        resampled = decode(size, mode);
+    if (resampled.isNull()) {
+        // Smooth scaling uses Qt's SIMD optimized image scaler.
+        resampled = image().scaled(size, Qt::IgnoreAspectRatio, mode);
+    }
+    QMutexLocker locker(&resampledImagesMutex);
+    resampledImages.insert(key, new QImage(resampled), resampled.byteCount() / 1024);
+    return resampled;
 }
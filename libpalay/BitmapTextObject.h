@@ -20,6 +20,7 @@
 #include <QObject>
 #include <QTextObjectInterface>
 #include <QImage>
+#include <QFuture>
 
 class BitmapTextObject : public QObject, public QTextObjectInterface
 {
@@ -28,8 +29,24 @@ class BitmapTextObject : public QObject, public QTextObjectInterface
 
 public:
     explicit BitmapTextObject(const QImage &image, float width = -1, float height = -1, QObject *parent = 0);
+    explicit BitmapTextObject(const QString &filename, float width = -1, float height = -1, QObject *parent = 0);
+    explicit BitmapTextObject(const QByteArray &encodedData, const QByteArray &format, float width = -1, float height = -1, QObject *parent = 0);
+    ~BitmapTextObject();
+
+    static bool isNativePdfFormat(const QByteArray &format);
 
     bool isValid() const;
+    QSizeF size() const;
+
+    void startDecode();
+
+    QByteArray encodedData() const;
+    QByteArray encodedFormat() const;
+    bool canEmbedEncoded(const QRectF &rect) const;
+
+    void setDraft(bool draft);
+    void setMaxDpi(int dpi);
+    void pageFinished();
 
     QSizeF intrinsicSize(QTextDocument *doc, int posInDocument,
                          const QTextFormat &format);
@@ -38,8 +55,32 @@ public:
                     int posInDocument, const QTextFormat &format);
 
 private:
+    void initSize(float width, float height);
+    bool canDecode() const;
+    QSize targetSize(const QRectF &rect) const;
+    QSize prefetchSize() const;
+    QImage prefetched() const;
+    QImage image() const;
+    QImage decode(const QSize &scaledSize, Qt::TransformationMode mode) const;
+    QImage imageForRect(const QRectF &rect) const;
+
     QSizeF size_;
-    QImage image_;
+    QSize imageSize_;
+    mutable QImage image_;
+    mutable QFuture<QImage> decodeResult_;
+    mutable bool decodePending_;
+    mutable QImage prefetched_;    // decoded ahead below full resolution
+    qint64 prefetchCost_;          // bytes of the budget for decoding ahead
+    QSize decodeSize_;             // what startDecode() last decoded at
+    Qt::TransformationMode decodeMode_;
+    mutable QByteArray encodedData_;   // read from the file while it is drawn
+    QByteArray encodedFormat_;
+    QString filename_;
+    QString fileKey_;   // key in the shared cache of image files
+    bool draft_;
+    int maxDpi_;
+    bool drawn_;
+    bool continuesOnNextPage_;
 };
 
 
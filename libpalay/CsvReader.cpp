@@ -0,0 +1,160 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "CsvReader.h"
+#include <string.h>
+
+/*!
+    \class CsvReader
+    \brief The CsvReader class reads rows from a memory mapped CSV or TSV file.
+
+    The file is mapped rather than read so that files of several gigabytes
+    don't have to fit in memory, and unquoted fields (and quoted fields
+    without doubled quotes) are returned as QByteArray::fromRawData()
+    slices of the mapping instead of copies. The slices are only valid
+    while the reader is open.
+
+    Fields follow RFC 4180: a field may be quoted with double quotes, and a
+    quoted field may contain the delimiter, line breaks and doubled quotes.
+    Rows end with \c \\n or \c \\r\\n. Empty lines are skipped and a UTF-8
+    byte order mark at the start of the file is ignored.
+ */
+
+CsvReader::CsvReader(char delimiter) :
+    delimiter_(delimiter),
+    begin_(0),
+    pos_(0),
+    end_(0)
+{
+}
+
+bool CsvReader::open(const QString &filename)
+{
+    file_.setFileName(filename);
+    if (!file_.open(QFile::ReadOnly)) {
+        errorString_ = QString("Failed to open %1: %2").arg(filename).arg(file_.errorString());
+        return false;
+    }
+
+    // Mapping an empty file fails, but there is nothing to read anyway
+    if (file_.size() > 0) {
+        begin_ = reinterpret_cast<const char *>(file_.map(0, file_.size()));
+        if (!begin_) {
+            errorString_ = QString("Failed to map %1: %2").arg(filename).arg(file_.errorString());
+            return false;
+        }
+        end_ = begin_ + file_.size();
+        if (end_ - begin_ >= 3 && memcmp(begin_, "\xef\xbb\xbf", 3) == 0)
+            begin_ += 3;
+    }
+    pos_ = begin_;
+    return true;
+}
+
+QString CsvReader::errorString() const
+{
+    return errorString_;
+}
+
+/*!
+    Reads the next row into \a fields and returns the number of fields in
+    it, or -1 at the end of the file. If \a fields is null the row is
+    skipped, which is how rows are counted without building the fields.
+ */
+int CsvReader::readRow(QList<QByteArray> *fields)
+{
+    // Skip empty lines
+    while (pos_ < end_ && (*pos_ == '\n' || *pos_ == '\r'))
+        ++pos_;
+    if (pos_ >= end_)
+        return -1;
+
+    if (fields)
+        fields->clear();
+    int count = 0;
+    bool endOfRow = false;
+    while (!endOfRow) {
+        QByteArray field = readField(&endOfRow);
+        if (fields)
+            fields->append(field);
+        ++count;
+    }
+    return count;
+}
+
+/*!
+    Goes back to the first row.
+ */
+void CsvReader::rewind()
+{
+    pos_ = begin_;
+}
+
+QByteArray CsvReader::readField(bool *endOfRow)
+{
+    QByteArray field;
+    if (pos_ < end_ && *pos_ == '"') {
+        const char *start = ++pos_;
+        bool copied = false;
+        while (pos_ < end_) {
+            if (*pos_ != '"') {
+                ++pos_;
+                continue;
+            }
+            if (pos_ + 1 < end_ && pos_[1] == '"') {
+                // Doubled quote - the field has to be copied to remove it
+                if (!copied) {
+                    field = QByteArray(start, pos_ - start);
+                    copied = true;
+                } else {
+                    field.append(start, pos_ - start);
+                }
+                field.append('"');
+                pos_ += 2;
+                start = pos_;
+                continue;
+            }
+            break;
+        }
+        if (copied)
+            field.append(start, pos_ - start);
+        else
+            field = QByteArray::fromRawData(start, pos_ - start);
+        if (pos_ < end_)
+            ++pos_;  // closing quote
+        // Anything between the closing quote and the delimiter is dropped
+        while (pos_ < end_ && *pos_ != delimiter_ && *pos_ != '\n' && *pos_ != '\r')
+            ++pos_;
+    } else {
+        const char *start = pos_;
+        while (pos_ < end_ && *pos_ != delimiter_ && *pos_ != '\n' && *pos_ != '\r')
+            ++pos_;
+        field = QByteArray::fromRawData(start, pos_ - start);
+    }
+
+    if (pos_ < end_ && *pos_ == delimiter_) {
+        ++pos_;
+        *endOfRow = false;
+    } else {
+        if (pos_ < end_ && *pos_ == '\r')
+            ++pos_;
+        if (pos_ < end_ && *pos_ == '\n')
+            ++pos_;
+        *endOfRow = true;
+    }
+    return field;
+}
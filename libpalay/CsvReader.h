@@ -0,0 +1,47 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef CSVREADER_H
+#define CSVREADER_H
+
+#include <QFile>
+#include <QByteArray>
+#include <QList>
+
+class CsvReader
+{
+public:
+    explicit CsvReader(char delimiter = ',');
+
+    bool open(const QString &filename);
+    QString errorString() const;
+
+    int readRow(QList<QByteArray> *fields);
+    void rewind();
+
+private:
+    QByteArray readField(bool *endOfRow);
+
+    QFile file_;
+    char delimiter_;
+    const char *begin_;
+    const char *pos_;
+    const char *end_;
+    QString errorString_;
+};
+
+#endif // CSVREADER_H
@@ -0,0 +1,194 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "DocumentSerializer.h"
+#include <QTextDocument>
+#include <QTextFrame>
+#include <QTextTable>
+#include <QTextCursor>
+#include <QTextBlock>
+
+/*!
+    \class DocumentSerializer
+    \brief The DocumentSerializer class writes the contents of a QTextDocument to a QDataStream and reads them back.
+
+    The document is written as a tree of frames, tables and blocks. Each
+    block has its formats and its fragments of text with their character
+    formats, so a document read back lays out the same as the original.
+    Formats are written with the QTextFormat stream operators.
+
+    Custom objects (QTextFormat::UserObject and above) are skipped. Their
+    handlers belong to the document that registered them, so whoever owns
+    the handlers has to save and insert them again.
+ */
+
+namespace {
+
+    enum Item {
+        BlockItem,
+        TableItem,
+        FrameItem,
+        EndItem     // end of the frame or cell
+    };
+
+    void writeFrame(QDataStream &out, QTextFrame::iterator it)
+    {
+        for (; !it.atEnd(); ++it) {
+            if (QTextTable *table = qobject_cast<QTextTable*>(it.currentFrame())) {
+                out << quint8(TableItem) << table->format() << qint32(table->rows()) << qint32(table->columns());
+                for (int row = 0; row < table->rows(); ++row) {
+                    for (int column = 0; column < table->columns(); ++column) {
+                        // Cells covered by a merged cell are written with it
+                        QTextTableCell cell = table->cellAt(row, column);
+                        if (cell.row() != row || cell.column() != column)
+                            continue;
+                        out << qint32(cell.rowSpan()) << qint32(cell.columnSpan()) << cell.format();
+                        writeFrame(out, cell.begin());
+                    }
+                }
+            } else if (QTextFrame *frame = it.currentFrame()) {
+                out << quint8(FrameItem) << frame->frameFormat();
+                writeFrame(out, frame->begin());
+            } else {
+                QTextBlock block = it.currentBlock();
+                QList<QTextFragment> fragments;
+                for (QTextBlock::iterator i = block.begin(); !i.atEnd(); ++i) {
+                    if (i.fragment().isValid() && i.fragment().charFormat().objectType() < QTextFormat::UserObject)
+                        fragments << i.fragment();
+                }
+                out << quint8(BlockItem) << block.blockFormat() << block.charFormat() << qint32(fragments.size());
+                foreach (const QTextFragment &fragment, fragments)
+                    out << fragment.text() << fragment.charFormat();
+            }
+        }
+        out << quint8(EndItem);
+    }
+
+    // The cursor is in the first block of the frame, which every frame has
+    bool readFrame(QDataStream &in, QTextCursor &cursor)
+    {
+        bool firstBlock = true;
+        forever {
+            quint8 item;
+            in >> item;
+            if (in.status() != QDataStream::Ok)
+                return false;
+
+            switch (item) {
+            case EndItem:
+                return true;
+
+            case BlockItem: {
+                QTextBlockFormat blockFormat;
+                QTextCharFormat blockCharFormat;
+                qint32 fragmentCount;
+                in >> blockFormat >> blockCharFormat >> fragmentCount;
+                if (firstBlock) {
+                    cursor.setBlockFormat(blockFormat);
+                    cursor.setBlockCharFormat(blockCharFormat);
+                } else {
+                    cursor.insertBlock(blockFormat, blockCharFormat);
+                }
+                firstBlock = false;
+                for (qint32 i = 0; i < fragmentCount && in.status() == QDataStream::Ok; ++i) {
+                    QString text;
+                    QTextCharFormat format;
+                    in >> text >> format;
+                    cursor.insertText(text, format);
+                }
+                break;
+            }
+
+            case TableItem: {
+                QTextTableFormat format;
+                qint32 rows;
+                qint32 columns;
+                in >> format >> rows >> columns;
+                if (in.status() != QDataStream::Ok || rows < 1 || columns < 1)
+                    return false;
+                QTextTable *table = cursor.insertTable(rows, columns, format);
+                for (int row = 0; row < rows; ++row) {
+                    for (int column = 0; column < columns; ++column) {
+                        QTextTableCell cell = table->cellAt(row, column);
+                        if (cell.row() != row || cell.column() != column)
+                            continue;
+                        qint32 rowSpan;
+                        qint32 columnSpan;
+                        QTextCharFormat cellFormat;
+                        in >> rowSpan >> columnSpan >> cellFormat;
+                        if (rowSpan > 1 || columnSpan > 1) {
+                            table->mergeCells(row, column, rowSpan, columnSpan);
+                            cell = table->cellAt(row, column);
+                        }
+                        cell.setFormat(cellFormat);
+                        QTextCursor cellCursor = cell.firstCursorPosition();
+                        if (!readFrame(in, cellCursor))
+                            return false;
+                    }
+                }
+                // Every frame is followed by a block in its parent
+                cursor.setPosition(table->lastPosition() + 1);
+                firstBlock = true;
+                break;
+            }
+
+            case FrameItem: {
+                QTextFrameFormat format;
+                in >> format;
+                QTextFrame *frame = cursor.insertFrame(format);
+                if (!readFrame(in, cursor))
+                    return false;
+                cursor.setPosition(frame->lastPosition() + 1);
+                firstBlock = true;
+                break;
+            }
+
+            default:
+                return false;
+            }
+        }
+    }
+
+}
+
+/*!
+    Writes the root frame format, the default font and the contents of
+    \a document to \a out.
+ */
+void DocumentSerializer::write(QDataStream &out, QTextDocument *document)
+{
+    out << document->defaultFont() << document->rootFrame()->frameFormat();
+    writeFrame(out, document->rootFrame()->begin());
+}
+
+/*!
+    Reads a document written by write() into \a document, which should
+    be empty. Returns false if the stream is truncated or corrupt.
+ */
+bool DocumentSerializer::read(QDataStream &in, QTextDocument *document)
+{
+    QFont defaultFont;
+    QTextFrameFormat rootFormat;
+    in >> defaultFont >> rootFormat;
+    if (in.status() != QDataStream::Ok)
+        return false;
+    document->setDefaultFont(defaultFont);
+    document->rootFrame()->setFrameFormat(rootFormat);
+
+    QTextCursor cursor(document);
+    return readFrame(in, cursor) && in.status() == QDataStream::Ok;
+}
@@ -0,0 +1,394 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "HtmlImporter.h"
+#include <QTextCursor>
+#include <QColor>
+#include <QBrush>
+#include <QFont>
+
+/*!
+    \class HtmlImporter
+    \brief The HtmlImporter class inserts simple inline HTML straight into a QTextCursor.
+
+    Most html() calls are small fragments like "<b>Total:</b> 10". Running
+    those through QTextCursor::insertHtml() means building a whole
+    QTextDocumentFragment with Qt's HTML and CSS parsers every time. This
+    importer handles the common inline subset in one pass and inserts the
+    formatted runs directly:
+
+        - \c b, \c strong, \c i, \c em, \c u and \c br tags
+        - \c span with a \c style attribute and \c font with \c color and \c face
+        - the CSS properties \c color, \c font-family, \c font-size (in pt),
+          \c font-weight (normal or bold), \c font-style and \c text-decoration
+        - named entities for markup characters and non-breaking spaces and
+          numeric entities, mapping 128 to 159 from Windows-1252 like Qt does
+
+    Whitespace is collapsed the way Qt does inside a paragraph. For anything
+    else, including leading or trailing whitespace, whose handling depends on
+    where the fragment ends up, insert() returns false without touching the
+    document and the caller should fall back to Qt's parser.
+ */
+
+namespace {
+
+    // Windows-1252 characters for numeric entities 128 to 159, which
+    // browsers and Qt treat as Windows-1252 rather than C1 controls.
+    const ushort windows1252[32] = {
+        0x20ac, 0xfffd, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+        0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0xfffd, 0x017d, 0xfffd,
+        0xfffd, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+        0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0xfffd, 0x017e, 0x0178
+    };
+
+    bool isHtmlSpace(QChar c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+    }
+
+    bool isNameChar(QChar c)
+    {
+        return c.isLetterOrNumber() || c == '-';
+    }
+
+}
+
+/*!
+    Inserts \a html at \a cursor. Text outside of any tag has \a baseFormat.
+    Returns false and leaves the document alone if the HTML is not in the
+    subset this importer understands.
+ */
+bool HtmlImporter::insert(QTextCursor &cursor, const QString &html, const QTextCharFormat &baseFormat)
+{
+    HtmlImporter importer(html, baseFormat);
+    if (!importer.parse())
+        return false;
+
+    foreach (const Run &run, importer.runs_)
+        cursor.insertText(run.text, run.format);
+    return true;
+}
+
+HtmlImporter::HtmlImporter(const QString &html, const QTextCharFormat &baseFormat) :
+    html_(html),
+    pos_(0),
+    lastWasSpace_(false),
+    lastWasBreak_(false)
+{
+    formats_.append(baseFormat);
+}
+
+bool HtmlImporter::parse()
+{
+    const int length = html_.length();
+    if (length == 0 || isHtmlSpace(html_.at(0)) || isHtmlSpace(html_.at(length - 1)))
+        return false;
+
+    while (pos_ < length) {
+        const QChar c = html_.at(pos_);
+        if (c == '<') {
+            if (!parseTag())
+                return false;
+        } else if (c == '&') {
+            if (!parseEntity())
+                return false;
+        } else if (c == '>') {
+            return false;
+        } else {
+            int start = pos_;
+            while (pos_ < length && html_.at(pos_) != '<' && html_.at(pos_) != '&' && html_.at(pos_) != '>')
+                ++pos_;
+            if (!appendText(html_.mid(start, pos_ - start)))
+                return false;
+        }
+    }
+
+    // Unclosed tags are fine in HTML but leave them to Qt. So is a
+    // space at the end of the text, which Qt keeps or drops depending
+    // on what follows the fragment.
+    if (!tags_.isEmpty() || lastWasSpace_)
+        return false;
+    return true;
+}
+
+bool HtmlImporter::parseTag()
+{
+    ++pos_; // '<'
+    const int length = html_.length();
+    bool closing = false;
+    if (pos_ < length && html_.at(pos_) == '/') {
+        closing = true;
+        ++pos_;
+    }
+
+    int start = pos_;
+    while (pos_ < length && isNameChar(html_.at(pos_)))
+        ++pos_;
+    const QString tag = html_.mid(start, pos_ - start).toLower();
+    if (tag.isEmpty())
+        return false;   // comments, doctypes and stray '<'
+
+    if (closing) {
+        while (pos_ < length && isHtmlSpace(html_.at(pos_)))
+            ++pos_;
+        if (pos_ >= length || html_.at(pos_) != '>')
+            return false;
+        ++pos_;
+        if (tags_.isEmpty() || tags_.last() != tag)
+            return false;
+        tags_.removeLast();
+        formats_.removeLast();
+        return true;
+    }
+
+    QTextCharFormat format = formats_.last();
+    if (tag == "b" || tag == "strong") {
+        format.setFontWeight(QFont::Bold);
+    } else if (tag == "i" || tag == "em") {
+        format.setFontItalic(true);
+    } else if (tag == "u") {
+        format.setFontUnderline(true);
+    } else if (tag != "br" && tag != "span" && tag != "font") {
+        return false;
+    }
+
+    if (!parseAttributes(tag, format))
+        return false;
+
+    bool selfClosing = false;
+    if (pos_ < length && html_.at(pos_) == '/') {
+        selfClosing = true;
+        ++pos_;
+    }
+    if (pos_ >= length || html_.at(pos_) != '>')
+        return false;
+    ++pos_;
+
+    if (tag == "br") {
+        // Qt drops whitespace around line breaks, leave that to it
+        if (lastWasSpace_)
+            return false;
+        appendChar(QChar::LineSeparator);
+        lastWasBreak_ = true;
+    } else if (!selfClosing) {
+        tags_.append(tag);
+        formats_.append(format);
+    }
+    return true;
+}
+
+bool HtmlImporter::parseAttributes(const QString &tag, QTextCharFormat &format)
+{
+    const int length = html_.length();
+    for (;;) {
+        while (pos_ < length && isHtmlSpace(html_.at(pos_)))
+            ++pos_;
+        if (pos_ >= length)
+            return false;
+        if (html_.at(pos_) == '>' || html_.at(pos_) == '/')
+            return true;
+
+        int start = pos_;
+        while (pos_ < length && isNameChar(html_.at(pos_)))
+            ++pos_;
+        const QString name = html_.mid(start, pos_ - start).toLower();
+        if (name.isEmpty() || pos_ >= length || html_.at(pos_) != '=')
+            return false;
+        ++pos_;
+
+        QString value;
+        if (pos_ < length && (html_.at(pos_) == '"' || html_.at(pos_) == '\'')) {
+            const QChar quote = html_.at(pos_++);
+            start = pos_;
+            while (pos_ < length && html_.at(pos_) != quote)
+                ++pos_;
+            if (pos_ >= length)
+                return false;
+            value = html_.mid(start, pos_ - start);
+            ++pos_;
+        } else {
+            start = pos_;
+            while (pos_ < length && !isHtmlSpace(html_.at(pos_)) && html_.at(pos_) != '>')
+                ++pos_;
+            value = html_.mid(start, pos_ - start);
+        }
+        if (value.contains('&'))
+            return false;
+
+        if (tag == "span" && name == "style") {
+            if (!applyStyle(value, format))
+                return false;
+        } else if (tag == "font" && name == "color") {
+            QColor color(value.trimmed());
+            if (!color.isValid())
+                return false;
+            format.setForeground(QBrush(color));
+        } else if (tag == "font" && name == "face") {
+            format.setFontFamily(value.trimmed());
+        } else {
+            return false;
+        }
+    }
+}
+
+bool HtmlImporter::applyStyle(const QString &style, QTextCharFormat &format)
+{
+    foreach (const QString &declaration, style.split(';', QString::SkipEmptyParts)) {
+        const int colon = declaration.indexOf(':');
+        if (colon < 0) {
+            if (declaration.trimmed().isEmpty())
+                continue;
+            return false;
+        }
+        const QString property = declaration.left(colon).trimmed().toLower();
+        const QString value = declaration.mid(colon + 1).trimmed();
+        const QString lowerValue = value.toLower();
+
+        if (property == "color") {
+            QColor color(value);
+            if (!color.isValid())
+                return false;
+            format.setForeground(QBrush(color));
+        } else if (property == "font-family") {
+            QString family = value;
+            if (family.length() >= 2 && (family.startsWith('"') || family.startsWith('\'')) && family.endsWith(family.at(0)))
+                family = family.mid(1, family.length() - 2);
+            if (family.isEmpty() || family.contains(','))
+                return false;
+            format.setFontFamily(family);
+        } else if (property == "font-size") {
+            if (!lowerValue.endsWith("pt"))
+                return false;
+            bool ok;
+            qreal size = lowerValue.left(lowerValue.length() - 2).trimmed().toDouble(&ok);
+            if (!ok || size <= 0)
+                return false;
+            format.setFontPointSize(size);
+        } else if (property == "font-weight") {
+            if (lowerValue == "bold")
+                format.setFontWeight(QFont::Bold);
+            else if (lowerValue == "normal")
+                format.setFontWeight(QFont::Normal);
+            else
+                return false;
+        } else if (property == "font-style") {
+            if (lowerValue == "italic" || lowerValue == "oblique")
+                format.setFontItalic(true);
+            else if (lowerValue == "normal")
+                format.setFontItalic(false);
+            else
+                return false;
+        } else if (property == "text-decoration") {
+            if (lowerValue == "underline")
+                format.setFontUnderline(true);
+            else if (lowerValue == "none")
+                format.setFontUnderline(false);
+            else
+                return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool HtmlImporter::parseEntity()
+{
+    const int semicolon = html_.indexOf(';', pos_);
+    if (semicolon < 0 || semicolon - pos_ > 10)
+        return false;
+    const QString entity = html_.mid(pos_ + 1, semicolon - pos_ - 1);
+    pos_ = semicolon + 1;
+
+    if (entity.startsWith('#')) {
+        bool ok;
+        uint code;
+        if (entity.length() > 1 && (entity.at(1) == 'x' || entity.at(1) == 'X'))
+            code = entity.mid(2).toUInt(&ok, 16);
+        else
+            code = entity.mid(1).toUInt(&ok, 10);
+        if (!ok || code < 0x20 || code > 0xffff)
+            return false;
+        if (code >= 0x80 && code < 0xa0)
+            code = windows1252[code - 0x80];
+        appendChar(QChar(ushort(code)));
+    } else if (entity == "amp") {
+        appendChar('&');
+    } else if (entity == "lt") {
+        appendChar('<');
+    } else if (entity == "gt") {
+        appendChar('>');
+    } else if (entity == "quot") {
+        appendChar('"');
+    } else if (entity == "apos") {
+        appendChar('\'');
+    } else if (entity == "nbsp") {
+        appendChar(QChar::Nbsp);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*!
+    Appends text with runs of whitespace collapsed to a single space.
+    Returns false for whitespace after a line break.
+ */
+bool HtmlImporter::appendText(const QString &text)
+{
+    QString collapsed;
+    collapsed.reserve(text.length());
+    for (int i = 0; i < text.length(); ++i) {
+        const QChar c = text.at(i);
+        if (isHtmlSpace(c)) {
+            if (!lastWasSpace_)
+                collapsed += ' ';
+            lastWasSpace_ = true;
+        } else {
+            collapsed += c;
+            lastWasSpace_ = false;
+        }
+    }
+    if (collapsed.isEmpty())
+        return true;
+    if (lastWasBreak_ && collapsed.at(0) == ' ')
+        return false;
+    lastWasBreak_ = false;
+
+    if (!runs_.isEmpty() && runs_.last().format == formats_.last()) {
+        runs_.last().text += collapsed;
+    } else {
+        Run run;
+        run.text = collapsed;
+        run.format = formats_.last();
+        runs_.append(run);
+    }
+    return true;
+}
+
+void HtmlImporter::appendChar(QChar c)
+{
+    lastWasBreak_ = false;
+    lastWasSpace_ = false;
+    if (!runs_.isEmpty() && runs_.last().format == formats_.last()) {
+        runs_.last().text += c;
+    } else {
+        Run run;
+        run.text = c;
+        run.format = formats_.last();
+        runs_.append(run);
+    }
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HTMLIMPORTER_H
+#define HTMLIMPORTER_H
+
+#include <QString>
+#include <QTextCharFormat>
+#include <QVector>
+
+class QTextCursor;
+
+class HtmlImporter
+{
+public:
+    static bool insert(QTextCursor &cursor, const QString &html, const QTextCharFormat &baseFormat);
+
+private:
+    struct Run {
+        QString text;
+        QTextCharFormat format;
+    };
+
+    HtmlImporter(const QString &html, const QTextCharFormat &baseFormat);
+
+    bool parse();
+    bool parseTag();
+    bool parseEntity();
+    bool parseAttributes(const QString &tag, QTextCharFormat &format);
+    bool applyStyle(const QString &style, QTextCharFormat &format);
+    bool appendText(const QString &text);
+    void appendChar(QChar c);
+
+    const QString &html_;
+    int pos_;
+    QVector<QTextCharFormat> formats_;
+    QVector<QString> tags_;
+    QVector<Run> runs_;
+    bool lastWasSpace_;
+    bool lastWasBreak_;
+};
+
+#endif // HTMLIMPORTER_H
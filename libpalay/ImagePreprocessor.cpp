@@ -0,0 +1,212 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ImagePreprocessor.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*!
+    \class ImagePreprocessor
+    \brief The ImagePreprocessor class converts decoded images to the smallest format they can be embedded in a PDF with.
+
+    prepare() is run on each image as soon as it is decoded (in the thread pool) so that
+    the work is not done while painting. It scans the pixels to find images that are
+    really opaque and converts them:
+
+        - opaque images with an alpha channel are converted to QImage::Format_RGB32 so
+          no soft mask is written
+        - premultiplied images are converted to QImage::Format_ARGB32 which is what
+          the PDF engine needs
+
+    Grayscale images stay 32 bit. Qt's PDF engine converts every image to 32 bit
+    before writing it and finds gray ones itself, so a smaller format would only be
+    converted back. PdfWriter uses isGray() and the plane functions, which split 32
+    bit images into the separate alpha, gray or RGB sample arrays that PDF image
+    streams use.
+
+    The pixel loops have SSE2 versions, which every x86-64 compiler enables, with
+    scalar code for the rest of each line and for other architectures. They only
+    handle the 32 bit formats QImage::Format_RGB32, QImage::Format_ARGB32 and
+    QImage::Format_ARGB32_Premultiplied whose pixels are 0xAARRGGBB words.
+ */
+
+namespace {
+
+    bool isArgb32(const QImage &image)
+    {
+        return image.format() == QImage::Format_RGB32 ||
+               image.format() == QImage::Format_ARGB32 ||
+               image.format() == QImage::Format_ARGB32_Premultiplied;
+    }
+
+    // Accumulates the AND of all pixels (alpha is 0xff only if every pixel
+    // is opaque) and the OR of the differences between the red, green and
+    // blue channels (zero only if every pixel is gray).
+    void scanLine(const quint32 *pixels, int count, quint32 *allBits, quint32 *colorBits)
+    {
+        int i = 0;
+        quint32 all = *allBits;
+        quint32 color = *colorBits;
+#ifdef __SSE2__
+        __m128i allV = _mm_set1_epi32(-1);
+        __m128i colorV = _mm_setzero_si128();
+        const __m128i channelMask = _mm_set1_epi32(0x0000ffff);
+        for (; i + 4 <= count; i += 4) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pixels + i));
+            allV = _mm_and_si128(allV, v);
+            // (b ^ g) in the low byte, (g ^ r) in the next byte
+            colorV = _mm_or_si128(colorV, _mm_and_si128(_mm_xor_si128(v, _mm_srli_epi32(v, 8)), channelMask));
+        }
+        quint32 allLanes[4];
+        quint32 colorLanes[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(allLanes), allV);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(colorLanes), colorV);
+        all &= allLanes[0] & allLanes[1] & allLanes[2] & allLanes[3];
+        color |= colorLanes[0] | colorLanes[1] | colorLanes[2] | colorLanes[3];
+#endif
+        for (; i < count; ++i) {
+            all &= pixels[i];
+            color |= (pixels[i] ^ (pixels[i] >> 8)) & 0x0000ffff;
+        }
+        *allBits = all;
+        *colorBits = color;
+    }
+
+    // Stores byte (shift / 8) of each pixel
+    template <int shift>
+    void extractChannel(const quint32 *pixels, uchar *out, int count)
+    {
+        int i = 0;
+#ifdef __SSE2__
+        const __m128i mask = _mm_set1_epi32(0xff);
+        for (; i + 16 <= count; i += 16) {
+            const __m128i *p = reinterpret_cast<const __m128i *>(pixels + i);
+            __m128i v0 = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(p), shift), mask);
+            __m128i v1 = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(p + 1), shift), mask);
+            __m128i v2 = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(p + 2), shift), mask);
+            __m128i v3 = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(p + 3), shift), mask);
+            __m128i packed = _mm_packus_epi16(_mm_packs_epi32(v0, v1), _mm_packs_epi32(v2, v3));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), packed);
+        }
+#endif
+        for (; i < count; ++i)
+            out[i] = (pixels[i] >> shift) & 0xff;
+    }
+
+    void extractRgb(const quint32 *pixels, uchar *out, int count)
+    {
+        for (int i = 0; i < count; ++i) {
+            out[3 * i] = (pixels[i] >> 16) & 0xff;
+            out[3 * i + 1] = (pixels[i] >> 8) & 0xff;
+            out[3 * i + 2] = pixels[i] & 0xff;
+        }
+    }
+
+    template <void (*extract)(const quint32 *, uchar *, int)>
+    QByteArray plane(const QImage &image, int bytesPerPixel)
+    {
+        if (!isArgb32(image))
+            return QByteArray();
+        const int width = image.width();
+        QByteArray result(width * image.height() * bytesPerPixel, Qt::Uninitialized);
+        uchar *out = reinterpret_cast<uchar *>(result.data());
+        for (int y = 0; y < image.height(); ++y) {
+            extract(reinterpret_cast<const quint32 *>(image.constScanLine(y)), out, width);
+            out += width * bytesPerPixel;
+        }
+        return result;
+    }
+
+}
+
+/*!
+    Returns \a image converted to the 32 bit format that is cheapest to
+    embed: without an alpha channel if it is opaque. Images that are not
+    32 bit are returned unchanged.
+ */
+QImage ImagePreprocessor::prepare(const QImage &image)
+{
+    if (!isArgb32(image))
+        return image;
+
+    bool opaque;
+    bool gray;
+    scan(image, &opaque, &gray);
+
+    if (opaque && image.hasAlphaChannel())
+        return image.convertToFormat(QImage::Format_RGB32);
+    if (image.format() == QImage::Format_ARGB32_Premultiplied)
+        return image.convertToFormat(QImage::Format_ARGB32);
+    return image;
+}
+
+/*!
+    Returns true if \a image is a 32 bit image whose pixels are all gray,
+    so that grayPlane() holds all of its colors.
+ */
+bool ImagePreprocessor::isGray(const QImage &image)
+{
+    if (!isArgb32(image))
+        return false;
+    bool opaque;
+    bool gray;
+    scan(image, &opaque, &gray);
+    return gray;
+}
+
+/*!
+    Returns the alpha channel of a 32 bit image, one byte per pixel.
+ */
+QByteArray ImagePreprocessor::alphaPlane(const QImage &image)
+{
+    return plane<extractChannel<24> >(image, 1);
+}
+
+/*!
+    Returns the blue channel of a 32 bit image, one byte per pixel.
+    For a gray image this is the gray level.
+ */
+QByteArray ImagePreprocessor::grayPlane(const QImage &image)
+{
+    return plane<extractChannel<0> >(image, 1);
+}
+
+/*!
+    Returns the red, green and blue channels of a 32 bit image,
+    three bytes per pixel.
+ */
+QByteArray ImagePreprocessor::rgbPlane(const QImage &image)
+{
+    return plane<extractRgb>(image, 3);
+}
+
+void ImagePreprocessor::scan(const QImage &image, bool *opaque, bool *gray)
+{
+    quint32 allBits = 0xffffffff;
+    quint32 colorBits = 0;
+    const bool hasAlpha = image.hasAlphaChannel();
+    for (int y = 0; y < image.height(); ++y) {
+        scanLine(reinterpret_cast<const quint32 *>(image.constScanLine(y)), image.width(), &allBits, &colorBits);
+        // Stop as soon as the image is known to be neither opaque nor gray
+        if (colorBits != 0 && (!hasAlpha || (allBits >> 24) != 0xff))
+            break;
+    }
+    // Format_RGB32 is always opaque even if the unused byte isn't 0xff
+    *opaque = !hasAlpha || (allBits >> 24) == 0xff;
+    *gray = colorBits == 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef IMAGEPREPROCESSOR_H
+#define IMAGEPREPROCESSOR_H
+
+#include <QImage>
+#include <QByteArray>
+
+class ImagePreprocessor
+{
+public:
+    static QImage prepare(const QImage &image);
+
+    static bool isGray(const QImage &image);
+
+    static QByteArray alphaPlane(const QImage &image);
+    static QByteArray grayPlane(const QImage &image);
+    static QByteArray rgbPlane(const QImage &image);
+
+private:
+    static void scan(const QImage &image, bool *opaque, bool *gray);
+};
+
+#endif // IMAGEPREPROCESSOR_H
@@ -0,0 +1,296 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "JsonParser.h"
+#include <QVariantMap>
+#include <QVariantList>
+#include <string.h>
+
+/*!
+    \class JsonParser
+    \brief The JsonParser class parses JSON text into QVariants.
+
+    Objects become QVariantMaps, arrays QVariantLists, strings QStrings,
+    numbers doubles and true and false bools. null becomes an invalid
+    QVariant, which is nil in Lua. Qt 4 has no JSON support, so this is
+    used with both Qt 4 and Qt 5. The lists and maps are implicitly shared
+    so handing out parts of the result is cheap.
+ */
+
+namespace {
+
+    // Deeper nesting than this is rejected rather than overflowing the stack
+    const int maxDepth = 512;
+
+}
+
+JsonParser::JsonParser(const QByteArray &json) :
+    begin_(json.constData()),
+    pos_(json.constData()),
+    end_(json.constData() + json.size())
+{
+}
+
+/*!
+    Returns the value in \a json. If it is not valid JSON an invalid
+    QVariant is returned and \a errorString says what is wrong and where.
+ */
+QVariant JsonParser::parse(const QByteArray &json, QString *errorString)
+{
+    JsonParser parser(json);
+    QVariant value;
+    // Skip a UTF-8 byte order mark
+    if (json.startsWith("\xef\xbb\xbf"))
+        parser.pos_ += 3;
+    parser.skipWhitespace();
+    if (!parser.parseValue(&value, 0)) {
+        *errorString = parser.errorString_;
+        return QVariant();
+    }
+    parser.skipWhitespace();
+    if (parser.pos_ != parser.end_) {
+        parser.fail("Unexpected text after the end of the value");
+        *errorString = parser.errorString_;
+        return QVariant();
+    }
+    return value;
+}
+
+bool JsonParser::parseValue(QVariant *value, int depth)
+{
+    if (depth > maxDepth)
+        return fail("Too deeply nested");
+    if (pos_ >= end_)
+        return fail("Unexpected end of input");
+
+    switch (*pos_) {
+    case '{':
+        return parseObject(value, depth + 1);
+    case '[':
+        return parseArray(value, depth + 1);
+    case '"': {
+        QString string;
+        if (!parseString(&string))
+            return false;
+        *value = string;
+        return true;
+    }
+    case 't':
+        return parseLiteral("true", QVariant(true), value);
+    case 'f':
+        return parseLiteral("false", QVariant(false), value);
+    case 'n':
+        return parseLiteral("null", QVariant(), value);
+    default:
+        return parseNumber(value);
+    }
+}
+
+bool JsonParser::parseObject(QVariant *value, int depth)
+{
+    QVariantMap map;
+    ++pos_;  // {
+    skipWhitespace();
+    if (pos_ < end_ && *pos_ == '}') {
+        ++pos_;
+        *value = map;
+        return true;
+    }
+    for (;;) {
+        QString key;
+        if (pos_ >= end_ || *pos_ != '"')
+            return fail("Expected a string for an object key");
+        if (!parseString(&key))
+            return false;
+        skipWhitespace();
+        if (pos_ >= end_ || *pos_ != ':')
+            return fail("Expected ':' after an object key");
+        ++pos_;
+        skipWhitespace();
+        QVariant member;
+        if (!parseValue(&member, depth))
+            return false;
+        map.insert(key, member);
+        skipWhitespace();
+        if (pos_ < end_ && *pos_ == ',') {
+            ++pos_;
+            skipWhitespace();
+        } else if (pos_ < end_ && *pos_ == '}') {
+            ++pos_;
+            *value = map;
+            return true;
+        } else {
+            return fail("Expected ',' or '}' in an object");
+        }
+    }
+}
+
+bool JsonParser::parseArray(QVariant *value, int depth)
+{
+    QVariantList list;
+    ++pos_;  // [
+    skipWhitespace();
+    if (pos_ < end_ && *pos_ == ']') {
+        ++pos_;
+        *value = list;
+        return true;
+    }
+    for (;;) {
+        QVariant element;
+        if (!parseValue(&element, depth))
+            return false;
+        list.append(element);
+        skipWhitespace();
+        if (pos_ < end_ && *pos_ == ',') {
+            ++pos_;
+            skipWhitespace();
+        } else if (pos_ < end_ && *pos_ == ']') {
+            ++pos_;
+            *value = list;
+            return true;
+        } else {
+            return fail("Expected ',' or ']' in an array");
+        }
+    }
+}
+
+bool JsonParser::parseString(QString *string)
+{
+    ++pos_;  // opening quote
+    const char *start = pos_;
+    // Most strings have no escapes and can be converted in one go
+    while (pos_ < end_ && *pos_ != '"' && *pos_ != '\\' && uchar(*pos_) >= 0x20)
+        ++pos_;
+    if (pos_ < end_ && *pos_ == '"') {
+        *string = QString::fromUtf8(start, pos_ - start);
+        ++pos_;
+        return true;
+    }
+
+    QByteArray utf8(start, pos_ - start);
+    QString result;
+    while (pos_ < end_ && *pos_ != '"') {
+        const char c = *pos_;
+        if (uchar(c) < 0x20)
+            return fail("Control character in a string");
+        if (c != '\\') {
+            utf8.append(c);
+            ++pos_;
+            continue;
+        }
+        if (++pos_ >= end_)
+            break;
+        switch (*pos_++) {
+        case '"': utf8.append('"'); break;
+        case '\\': utf8.append('\\'); break;
+        case '/': utf8.append('/'); break;
+        case 'b': utf8.append('\b'); break;
+        case 'f': utf8.append('\f'); break;
+        case 'n': utf8.append('\n'); break;
+        case 'r': utf8.append('\r'); break;
+        case 't': utf8.append('\t'); break;
+        case 'u': {
+            ushort code;
+            if (!parseHex4(&code))
+                return false;
+            result += QString::fromUtf8(utf8);
+            utf8.clear();
+            if (QChar::isHighSurrogate(code) && end_ - pos_ >= 6 && pos_[0] == '\\' && pos_[1] == 'u') {
+                pos_ += 2;
+                ushort low;
+                if (!parseHex4(&low))
+                    return false;
+                result += QChar(code);
+                result += QChar(low);
+            } else {
+                result += QChar(code);
+            }
+            break;
+        }
+        default:
+            return fail("Invalid escape in a string");
+        }
+    }
+    if (pos_ >= end_)
+        return fail("Unterminated string");
+    ++pos_;  // closing quote
+    result += QString::fromUtf8(utf8);
+    *string = result;
+    return true;
+}
+
+bool JsonParser::parseNumber(QVariant *value)
+{
+    const char *start = pos_;
+    if (pos_ < end_ && *pos_ == '-')
+        ++pos_;
+    if (pos_ >= end_ || *pos_ < '0' || *pos_ > '9')
+        return fail("Unexpected character");
+    while (pos_ < end_ && ((*pos_ >= '0' && *pos_ <= '9') || *pos_ == '.' ||
+                           *pos_ == 'e' || *pos_ == 'E' || *pos_ == '+' || *pos_ == '-'))
+        ++pos_;
+    bool ok;
+    const double number = QByteArray::fromRawData(start, pos_ - start).toDouble(&ok);
+    if (!ok) {
+        pos_ = start;
+        return fail("Invalid number");
+    }
+    *value = number;
+    return true;
+}
+
+bool JsonParser::parseLiteral(const char *literal, const QVariant &result, QVariant *value)
+{
+    const int length = strlen(literal);
+    if (end_ - pos_ < length || strncmp(pos_, literal, length) != 0)
+        return fail("Unexpected character");
+    pos_ += length;
+    *value = result;
+    return true;
+}
+
+bool JsonParser::parseHex4(ushort *code)
+{
+    if (end_ - pos_ < 4)
+        return fail("Invalid \\u escape in a string");
+    bool ok;
+    *code = QByteArray::fromRawData(pos_, 4).toUShort(&ok, 16);
+    if (!ok)
+        return fail("Invalid \\u escape in a string");
+    pos_ += 4;
+    return true;
+}
+
+void JsonParser::skipWhitespace()
+{
+    while (pos_ < end_ && (*pos_ == ' ' || *pos_ == '\t' || *pos_ == '\n' || *pos_ == '\r'))
+        ++pos_;
+}
+
+bool JsonParser::fail(const char *error)
+{
+    int line = 1;
+    const char *lineStart = begin_;
+    for (const char *p = begin_; p < pos_ && p < end_; ++p) {
+        if (*p == '\n') {
+            ++line;
+            lineStart = p + 1;
+        }
+    }
+    errorString_ = QString("%1 at line %2 column %3").arg(error).arg(line).arg(pos_ - lineStart + 1);
+    return false;
+}
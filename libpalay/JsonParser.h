@@ -0,0 +1,49 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef JSONPARSER_H
+#define JSONPARSER_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVariant>
+
+class JsonParser
+{
+public:
+    static QVariant parse(const QByteArray &json, QString *errorString);
+
+private:
+    JsonParser(const QByteArray &json);
+
+    bool parseValue(QVariant *value, int depth);
+    bool parseObject(QVariant *value, int depth);
+    bool parseArray(QVariant *value, int depth);
+    bool parseString(QString *string);
+    bool parseNumber(QVariant *value);
+    bool parseLiteral(const char *literal, const QVariant &result, QVariant *value);
+    bool parseHex4(ushort *code);
+    void skipWhitespace();
+    bool fail(const char *error);
+
+    const char *begin_;
+    const char *pos_;
+    const char *end_;
+    QString errorString_;
+};
+
+#endif // JSONPARSER_H
@@ -30,19 +30,42 @@
 #include <AbsoluteBlock.h>
 #include "SvgVectorTextObject.h"
 #include "BitmapTextObject.h"
-
-extern "C"
-{
-    #include <lua.h>
-    #include <lauxlib.h>
-    #include <lualib.h>
-}
+#include "Trace.h"
+#include "HtmlImporter.h"
+#include "CsvReader.h"
+#include "PdfMetadata.h"
+#include "PdfCompressor.h"
+#include "PdfWriter.h"
+#include "DocumentSerializer.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDataStream>
+#include <QTemporaryFile>
+#include <QThread>
+#include <QDir>
+#include <QCryptographicHash>
+#include <QtAlgorithms>
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#elif defined(Q_OS_UNIX)
+#include <dlfcn.h>
+#endif
 
 Q_GUI_EXPORT extern int qt_defaultDpiX();
 Q_GUI_EXPORT extern int qt_defaultDpiY();
 
 namespace {
 
+    // "PSNP" and the version of the snapshot format
+    const quint32 snapshotMagic = 0x50534e50;
+    const quint32 snapshotVersion = 2;
+
+    enum SnapshotObject {
+        SnapshotBitmap,
+        SnapshotSvg
+    };
+
     // Convert from points (1/72 inch), the unit for
     // the palay API, to dots, the unit that the QTextDocument
     // measurements are in.
@@ -67,12 +90,163 @@ namespace {
     }
 
     QRegExp whitespaceOrComma("(\\s*,\\s*)|\\s+");
+    QRegExp htmlTagExp("\\s*<html.*<\\/html>\\s*", Qt::CaseInsensitive);
+
+    // Printer resolution used for draft output instead of QPrinter::HighResolution
+    const int draftResolution = 72;
+
+    // Hash of a format that is the same for equal formats. Values that
+    // QVariant can't convert to a string, like brushes, only add their key.
+    uint formatHash(const QTextFormat &format)
+    {
+        uint hash = format.type();
+        const QMap<int, QVariant> properties = format.properties();
+        for (QMap<int, QVariant>::const_iterator i = properties.constBegin(); i != properties.constEnd(); ++i)
+            hash = hash * 31 + (qHash(i.key()) ^ qHash(i.value().toString()));
+        return hash;
+    }
+
+    // Replaces format with an equal one from formats, or adds it
+    template <class Format>
+    void intern(QMultiHash<uint, Format> &formats, Format &format)
+    {
+        const uint hash = formatHash(format);
+        typename QMultiHash<uint, Format>::const_iterator i = formats.constFind(hash);
+        for (; i != formats.constEnd() && i.key() == hash; ++i) {
+            if (i.value() == format) {
+                format = i.value();
+                return;
+            }
+        }
+        formats.insert(hash, format);
+    }
+
+    // Orders substitution keys so that a key is replaced before any
+    // shorter key that could match part of it
+    bool isLonger(const QString &a, const QString &b)
+    {
+        return a.length() > b.length();
+    }
+
+    bool isNumber(const QVariant &value, qreal *number)
+    {
+        if (value.type() == QVariant::Bool)
+            return false;
+        bool ok;
+        *number = value.toDouble(&ok);
+        return ok;
+    }
+
+    bool isString(const QVariant &value)
+    {
+        return value.type() == QVariant::String || value.type() == QVariant::ByteArray ||
+                value.type() == QVariant::Double || value.type() == QVariant::Int;
+    }
+
+    // If field is a plain decimal number, formats it with decimals
+    // places (or as it is if decimals is negative) and separator
+    // between groups of thousands.
+    bool formatNumber(const QByteArray &field, int decimals, const QString &separator, QString *text)
+    {
+        const QByteArray trimmed = field.trimmed();
+        if (trimmed.isEmpty())
+            return false;
+        // Rule out nan, inf and hex, which toDouble() accepts
+        for (int i = 0; i < trimmed.size(); ++i) {
+            const char c = trimmed.at(i);
+            if (!(c >= '0' && c <= '9') && c != '.' && c != '-' && c != '+' && c != 'e' && c != 'E')
+                return false;
+        }
+        bool ok;
+        const double value = trimmed.toDouble(&ok);
+        if (!ok)
+            return false;
+
+        *text = decimals >= 0 ? QString::number(value, 'f', decimals) : QString::fromLatin1(trimmed);
+        if (!separator.isEmpty() && !text->contains('e', Qt::CaseInsensitive)) {
+            int digitsEnd = text->indexOf('.');
+            if (digitsEnd < 0)
+                digitsEnd = text->size();
+            const int digitsStart = (text->startsWith('-') || text->startsWith('+')) ? 1 : 0;
+            for (int i = digitsEnd - 3; i > digitsStart; i -= 3)
+                text->insert(i, separator);
+        }
+        return true;
+    }
+
+    // Lays out the documents of a section in a thread of its own. The
+    // layout starts timers, so the documents are moved to the thread for
+    // the layout and handed back to the thread that made them after it.
+    // QObjects can't change threads with a parent, so they are given
+    // back their parents in finish().
+    class SectionLayout : public QThread
+    {
+    public:
+        explicit SectionLayout(const QList<QTextDocument*> &documents) :
+            documents_(documents),
+            owner_(QThread::currentThread())
+        {
+            foreach (QTextDocument *document, documents_) {
+                parents_ << document->parent();
+                document->setParent(0);
+                document->moveToThread(this);
+            }
+        }
+
+        void finish()
+        {
+            wait();
+            for (int i = 0; i < documents_.size(); ++i)
+                documents_[i]->setParent(parents_[i]);
+        }
+
+    protected:
+        void run()
+        {
+            PALAY_TRACE_SCOPE("layout", "section");
+            foreach (QTextDocument *document, documents_) {
+                document->pageCount();
+                document->moveToThread(owner_);
+            }
+        }
+
+    private:
+        QList<QTextDocument*> documents_;
+        QList<QObject*> parents_;
+        QThread *owner_;
+    };
+
+    // Number of frames (including tables) nested in frame
+    int countFrames(QTextFrame *frame)
+    {
+        int count = 0;
+        foreach (QTextFrame *child, frame->childFrames())
+            count += 1 + countFrames(child);
+        return count;
+    }
 
 }
+
 PalayDocument::PalayDocument(QObject *parent) :
     QObject(parent),
     doc_(new QTextDocument(this)),
-    printer_(QPrinter::HighResolution)
+    printer_(QPrinter::HighResolution),
+    firstPage_(1),
+    lastPage_(0),
+    draft_(false),
+    imageDpi_(0),
+    pagesPrinted_(0),
+    buildMode_(false),
+    fragmentDoc_(0),
+    painter_(0),
+    sectionFile_(0),
+    pageOffset_(0),
+    pageNumberOffset_(0),
+    layoutThreads_(1),
+    pipelined_(false),
+    compressionLevel_(PdfCompressor::DefaultLevel),
+    directPdf_(false),
+    writer_(0)
 {
     Formats defaultFormat;
 
@@ -113,6 +287,7 @@ PalayDocument::PalayDocument(QObject *parent) :
 
     printer_.setOutputFormat(QPrinter::PdfFormat);
     printer_.setColorMode(QPrinter::Color);
+    printerResolution_ = printer_.resolution();
     doc_->setDocumentMargin(0);
 
     // We set margins on the document root frame, not on
@@ -121,18 +296,67 @@ PalayDocument::PalayDocument(QObject *parent) :
     // and footnotes.
     setPageSize(QPrinter::Letter);
     printer_.setFullPage(true);
+
+    buildCursor_ = QTextCursor(doc_);
     printer_.setPageMargins(0,0,0,0,QPrinter::Millimeter);
-    setPageMargins(pointsToDotsX(54),
-                   pointsToDotsY(37),
-                   pointsToDotsX(54),
-                   pointsToDotsY(37));
+    applyPageMargins(pointsToDotsX(54),
+                     pointsToDotsY(37),
+                     pointsToDotsX(54),
+                     pointsToDotsY(37));
 }
 
 PalayDocument::~PalayDocument()
 {
+    // Sections can't be freed while they are being laid out
+    for (int i = 0; i < pendingSections_.size(); ++i)
+        finishLayout(pendingSections_[i]);
+
+    // Sections painted for a document that was never saved
+    if (painter_) {
+        painter_->end();
+        delete painter_;
+    }
+    delete writer_;
+}
+
+/*!
+    Returns a description of the last error. Methods that can fail return
+    false (or 0 for handles) and set the error string.
+ */
+QString PalayDocument::errorString() const
+{
+    return errorString_;
+}
+
+/*!
+    Returns an ID of this build of the library, so that output cached by
+    one build isn't reused by another. It is a hash of the library file,
+    or the time this file was compiled if the library can't be found.
+ */
+QByteArray PalayDocument::buildId()
+{
+    QString library;
+#if defined(Q_OS_WIN)
+    HMODULE module;
+    wchar_t path[MAX_PATH];
+    if (GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                           reinterpret_cast<LPCWSTR>(&PalayDocument::buildId), &module) &&
+            GetModuleFileNameW(module, path, MAX_PATH) > 0)
+        library = QString::fromWCharArray(path);
+#elif defined(Q_OS_UNIX)
+    Dl_info info;
+    if (dladdr(reinterpret_cast<void *>(&PalayDocument::buildId), &info) && info.dli_fname)
+        library = QFile::decodeName(info.dli_fname);
+#endif
+
+    QFile file(library);
+    if (!library.isEmpty() && file.open(QFile::ReadOnly))
+        return QCryptographicHash::hash(file.readAll(), QCryptographicHash::Sha1).toHex();
+    return __DATE__ " " __TIME__;
 }
 
-int PalayDocument::paragraph(lua_State *L)
+
+void PalayDocument::paragraph(const QString &text)
 {
     QTextBlock currentBlock = cursorStack_.top().block();
     if (currentBlock.begin().atEnd()) {
@@ -147,226 +371,372 @@ int PalayDocument::paragraph(lua_State *L)
         cursorStack_.top().insertBlock(formatStack_.top().block_, formatStack_.top().char_);
     }
 
-    text(L);
-
-    return 0;
-}
-
-int PalayDocument::text(lua_State *L)
-{
-    const char *text = luaL_checkstring(L, 2);
-    cursorStack_.top().insertText(QString::fromUtf8(text), formatStack_.top().char_);
-    return 0;
+    this->text(text);
 }
 
-static void debugStackDump(lua_State *L)
+void PalayDocument::text(const QString &text)
 {
-    int top = lua_gettop(L);
-    for (int i = 1; i <= top; i++) {  /* repeat for each level */
-        int t = lua_type(L, i);
-        switch (t) {
-        case LUA_TSTRING:  /* strings */
-            qDebug("%d: `%s'", i, lua_tostring(L, i));
-            break;
-
-        case LUA_TBOOLEAN:  /* booleans */
-            qDebug("%d: %s", i, lua_toboolean(L, i) ? "true" : "false");
-            break;
-
-        case LUA_TNUMBER:  /* numbers */
-            qDebug("%d: %g", i, lua_tonumber(L, i));
-            break;
-
-        default:  /* other values */
-            qDebug("%d: %s %p", i, lua_typename(L, t), lua_topointer(L, i));
-            break;
-        }
-    }
+    cursorStack_.top().insertText(text, formatStack_.top().char_);
 }
 
-int PalayDocument::style(lua_State *L)
+/*!
+    Changes the current style. The keys are the same as for the Lua
+    style() function, e.g. "font_size" or "border_color", and the values
+    are numbers, strings or, for colors, lists of 3 or 4 numbers.
+ */
+bool PalayDocument::style(const QVariantMap &style)
 {
-    luaL_checktype(L, 2, LUA_TTABLE);
-    lua_pushnil(L);
-    while (lua_next(L, 2) != 0) {
-        if (!lua_isstring(L, -2))
-            luaL_error(L, "Invalid key in style table. All style keys must be strings.");
-        const char *key = lua_tostring(L, -2);
+    for (QVariantMap::const_iterator i = style.constBegin(); i != style.constEnd(); ++i) {
+        const QByteArray keyBytes = i.key().toUtf8();
+        const char *key = keyBytes.constData();
+        const QVariant &value = i.value();
+        qreal number;
         if (qstricmp(key, "font_family") == 0) {
-            if (!lua_isstring(L, -1))
-                luaL_error(L, "Invalid value for font_family. Must be a string.");
-            formatStack_.top().char_.setFontFamily(lua_tostring(L, -1));
+            if (!isString(value))
+                return fail("Invalid value for font_family. Must be a string.");
+            formatStack_.top().char_.setFontFamily(value.toString());
         } else if (qstricmp(key, "font_size") == 0) {
-            if (!lua_isnumber(L, -1) || lua_tointeger(L, -1) <= 0)
-                luaL_error(L, "Invalid value for font_size. Must be a positive number.");
+            if (!isNumber(value, &number) || int(number) <= 0)
+                return fail("Invalid value for font_size. Must be a positive number.");
             // Note that QTextDocument takes font size in points, not dots
             // even though other measurements are in dots.
-            formatStack_.top().char_.setFontPointSize(lua_tointeger(L, -1));
+            formatStack_.top().char_.setFontPointSize(int(number));
         } else if (qstricmp(key, "font_style") == 0) {
-            setFontStyle(L, formatStack_.top().char_, -1);
+            if (!setFontStyle(value, formatStack_.top().char_))
+                return false;
         } else if (qstricmp(key, "border_width") == 0) {
-            if (!lua_isnumber(L, -1) || lua_tonumber(L, -1) < 0)
-                luaL_error(L, "Invalid value for border_width. Must be a positive number.");
-            qreal border = pointsToDotsX(lua_tonumber(L, -1));
+            if (!isNumber(value, &number) || number < 0)
+                return fail("Invalid value for border_width. Must be a positive number.");
+            qreal border = pointsToDotsX(number);
             formatStack_.top().table_.setBorder(border);
             formatStack_.top().frame_.setBorder(border);
         } else if (qstricmp(key, "cell_padding") == 0) {
-            if (!lua_isnumber(L, -1) || lua_tonumber(L, -1) < 0)
-                luaL_error(L, "Invalid value for cell_padding. Must be a positive number.");
-            qreal padding = pointsToDotsX(lua_tonumber(L, -1));
-            formatStack_.top().cell_.setPadding(padding);
+            if (!isNumber(value, &number) || number < 0)
+                return fail("Invalid value for cell_padding. Must be a positive number.");
+            formatStack_.top().cell_.setPadding(pointsToDotsX(number));
         } else if (qstricmp(key, "cell_left_padding") == 0) {
-            if (!lua_isnumber(L, -1) || lua_tonumber(L, -1) < 0)
-                luaL_error(L, "Invalid value for cell_left_padding. Must be a positive number.");
-            qreal padding = pointsToDotsX(lua_tonumber(L, -1));
-            formatStack_.top().cell_.setLeftPadding(padding);
+            if (!isNumber(value, &number) || number < 0)
+                return fail("Invalid value for cell_left_padding. Must be a positive number.");
+            formatStack_.top().cell_.setLeftPadding(pointsToDotsX(number));
         } else if (qstricmp(key, "cell_right_padding") == 0) {
-            if (!lua_isnumber(L, -1) || lua_tonumber(L, -1) < 0)
-                luaL_error(L, "Invalid value for cell_right_padding. Must be a positive number.");
-            qreal padding = pointsToDotsX(lua_tonumber(L, -1));
-            formatStack_.top().cell_.setRightPadding(padding);
+            if (!isNumber(value, &number) || number < 0)
+                return fail("Invalid value for cell_right_padding. Must be a positive number.");
+            formatStack_.top().cell_.setRightPadding(pointsToDotsX(number));
         } else if (qstricmp(key, "cell_top_padding") == 0) {
-            if (!lua_isnumber(L, -1) || lua_tonumber(L, -1) < 0)
-                luaL_error(L, "Invalid value for cell_top_padding. Must be a positive number.");
-            qreal padding = pointsToDotsX(lua_tonumber(L, -1));
-            formatStack_.top().cell_.setTopPadding(padding);
+            if (!isNumber(value, &number) || number < 0)
+                return fail("Invalid value for cell_top_padding. Must be a positive number.");
+            formatStack_.top().cell_.setTopPadding(pointsToDotsX(number));
         } else if (qstricmp(key, "cell_bottom_padding") == 0) {
-            if (!lua_isnumber(L, -1) || lua_tonumber(L, -1) < 0)
-                luaL_error(L, "Invalid value for cell_bottom_padding. Must be a positive number.");
-            qreal padding = pointsToDotsX(lua_tonumber(L, -1));
-            formatStack_.top().cell_.setBottomPadding(padding);
+            if (!isNumber(value, &number) || number < 0)
+                return fail("Invalid value for cell_bottom_padding. Must be a positive number.");
+            formatStack_.top().cell_.setBottomPadding(pointsToDotsX(number));
         } else if (qstricmp(key, "border_style") == 0) {
-            QTextFrameFormat::BorderStyle borderStyle = getBorderStyle(L, -1);
+            QTextFrameFormat::BorderStyle borderStyle;
+            if (!getBorderStyle(value, &borderStyle))
+                return false;
             formatStack_.top().table_.setBorderStyle(borderStyle);
             formatStack_.top().frame_.setBorderStyle(borderStyle);
         } else if (qstricmp(key, "border_color") == 0) {
-            QColor color = getColor(L, -1);
-            if (!color.isValid())
-                luaL_error(L, "Invalid color for text_color.");
+            QColor color;
+            if (!getColor(value, &color))
+                return false;
             formatStack_.top().table_.setBorderBrush(QBrush(color));
             formatStack_.top().frame_.setBorderBrush(QBrush(color));
         } else if (qstricmp(key, "text_color") == 0) {
-            QColor color = getColor(L, -1);
-            if (!color.isValid())
-                luaL_error(L, "Invalid color for text_color.");
+            QColor color;
+            if (!getColor(value, &color))
+                return false;
             formatStack_.top().char_.setForeground(QBrush(color));
         } else if (qstricmp(key, "text_background_color") == 0) {
-            QColor color = getColor(L, -1);
-            if (!color.isValid())
-                luaL_error(L, "Invalid color for background_color.");
+            QColor color;
+            if (!getColor(value, &color))
+                return false;
             formatStack_.top().char_.setBackground(QBrush(color));
         } else if (qstricmp(key, "background_color") == 0) {
-            QColor color = getColor(L, -1);
-            if (!color.isValid())
-                luaL_error(L, "Invalid color for background_color.");
+            QColor color;
+            if (!getColor(value, &color))
+                return false;
             formatStack_.top().block_.setBackground(QBrush(color));
         } else if (qstricmp(key, "alignment") == 0) {
-            Qt::Alignment align = getAlignment(L, -1);
+            Qt::Alignment align;
+            if (!getAlignment(value, &align))
+                return false;
             formatStack_.top().block_.setAlignment(align);
             formatStack_.top().table_.setAlignment(align);
         } else if (qstricmp(key, "width") == 0) {
-            if (lua_isnumber(L, -1) && lua_tonumber(L, -1) >= 0) {
-                qreal widthDots = pointsToDotsX(lua_tonumber(L, -1));
-                formatStack_.top().table_.setWidth(widthDots);
-                formatStack_.top().frame_.setWidth(widthDots);
-            } else if (lua_isstring(L, -1) && (qstricmp(lua_tostring(L, -1), "variable") == 0)) {
-                formatStack_.top().table_.setWidth(QTextLength());
-                formatStack_.top().frame_.setWidth(QTextLength());
-            } else if (lua_isstring(L, -1) && (qstricmp(lua_tostring(L, -1), "page") == 0)) {
-                qreal widthDots = doc_->pageSize().width();
-                formatStack_.top().table_.setWidth(widthDots);
-                formatStack_.top().frame_.setWidth(widthDots);
-            } else if (lua_isstring(L, -1) && (qstricmp(lua_tostring(L, -1), "inside_page") == 0)) {
-                QTextFrameFormat rootFormat = doc_->rootFrame()->frameFormat();
-                qreal widthDots = doc_->pageSize().width() - rootFormat.leftMargin() - rootFormat.rightMargin();
-                formatStack_.top().table_.setWidth(widthDots);
-                formatStack_.top().frame_.setWidth(widthDots);
-            } else {
-                luaL_error(L, "Invalid value for width. Must be a positive number, \"page\", \"inside_page\", or \"variable\".");
-            }
+            QTextLength width;
+            if (!getLength("width", value, true, &width))
+                return false;
+            formatStack_.top().table_.setWidth(width);
+            formatStack_.top().frame_.setWidth(width);
         } else if (qstricmp(key, "height") == 0) {
-            if (lua_isnumber(L, -1) && lua_tonumber(L, -1) >= 0) {
-                qreal heightDots = pointsToDotsY(lua_tonumber(L, -1));
-                formatStack_.top().table_.setHeight(heightDots);
-                formatStack_.top().frame_.setHeight(heightDots);
-            } else if (lua_isstring(L, -1) && (qstricmp(lua_tostring(L, -1), "variable") == 0)) {
-                formatStack_.top().table_.setHeight(QTextLength());
-                formatStack_.top().frame_.setHeight(QTextLength());
-            } else if (lua_isstring(L, -1) && (qstricmp(lua_tostring(L, -1), "page") == 0)) {
-                qreal heightDots = doc_->pageSize().height();
-                formatStack_.top().table_.setHeight(heightDots);
-                formatStack_.top().frame_.setHeight(heightDots);
-            } else if (lua_isstring(L, -1) && (qstricmp(lua_tostring(L, -1), "inside_page") == 0)) {
-                QTextFrameFormat rootFormat = doc_->rootFrame()->frameFormat();
-                qreal heightDots = doc_->pageSize().height() - rootFormat.topMargin() - rootFormat.bottomMargin();
-                formatStack_.top().table_.setHeight(heightDots);
-                formatStack_.top().frame_.setHeight(heightDots);
-            } else {
-                luaL_error(L, "Invalid value for height. Must be a positive number, \"page\", \"inside_page\", or \"variable\".");
-            }
+            QTextLength height;
+            if (!getLength("height", value, false, &height))
+                return false;
+            formatStack_.top().table_.setHeight(height);
+            formatStack_.top().frame_.setHeight(height);
         } else if (qstricmp(key, "indent") == 0) {
-           if (!lua_isnumber(L, -1) || lua_tonumber(L, -1) < 0)
-               luaL_error(L, "Invalid value for indent. Must be a positive number.");
-           formatStack_.top().block_.setIndent(lua_tointeger(L, -1));
+           if (!isNumber(value, &number) || number < 0)
+               return fail("Invalid value for indent. Must be a positive number.");
+           formatStack_.top().block_.setIndent(int(number));
         } else if (qstricmp(key, "left_margin") == 0) {
-           if (!lua_isnumber(L, -1) || lua_tonumber(L, -1) < 0)
-               luaL_error(L, "Invalid value for left_margin. Must be a positive number.");
-           formatStack_.top().block_.setLeftMargin(pointsToDotsX(lua_tonumber(L, -1)));
+           if (!isNumber(value, &number) || number < 0)
+               return fail("Invalid value for left_margin. Must be a positive number.");
+           formatStack_.top().block_.setLeftMargin(pointsToDotsX(number));
         } else if (qstricmp(key, "right_margin") == 0) {
-           if (!lua_isnumber(L, -1) || lua_tonumber(L, -1) < 0)
-               luaL_error(L, "Invalid value for right_margin. Must be a positive number.");
-           formatStack_.top().block_.setRightMargin(pointsToDotsX(lua_tonumber(L, -1)));
+           if (!isNumber(value, &number) || number < 0)
+               return fail("Invalid value for right_margin. Must be a positive number.");
+           formatStack_.top().block_.setRightMargin(pointsToDotsX(number));
         } else if (qstricmp(key, "top_margin") == 0) {
-           if (!lua_isnumber(L, -1) || lua_tonumber(L, -1) < 0)
-               luaL_error(L, "Invalid value for top_margin. Must be a positive number.");
-           formatStack_.top().block_.setTopMargin(pointsToDotsY(lua_tonumber(L, -1)));
+           if (!isNumber(value, &number) || number < 0)
+               return fail("Invalid value for top_margin. Must be a positive number.");
+           formatStack_.top().block_.setTopMargin(pointsToDotsY(number));
         } else if (qstricmp(key, "bottom_margin") == 0) {
-           if (!lua_isnumber(L, -1) || lua_tonumber(L, -1) < 0)
-               luaL_error(L, "Invalid value for bottom_margin. Must be a positive number.");
-           formatStack_.top().block_.setBottomMargin(pointsToDotsY(lua_tonumber(L, -1)));
+           if (!isNumber(value, &number) || number < 0)
+               return fail("Invalid value for bottom_margin. Must be a positive number.");
+           formatStack_.top().block_.setBottomMargin(pointsToDotsY(number));
         } else {
-            luaL_error(L, "Invalid key in style table: %s", key);
+            return fail(QString("Invalid key in style table: %1").arg(i.key()));
         }
-        lua_pop(L, 1);
     }
 
-    return 0;
+    if (buildMode_)
+        internFormats();
+
+    return true;
 }
 
-int PalayDocument::pushStyle(lua_State *L)
+bool PalayDocument::pushStyle(const QVariantMap &style)
 {
     formatStack_.push(formatStack_.top());
-    style(L);
-    return 0;
+    return this->style(style);
 }
 
-int PalayDocument::popStyle(lua_State *L)
+bool PalayDocument::popStyle()
 {
     if (formatStack_.size() < 2)
-        luaL_error(L, "popStyle called with no matching pushStyle");
+        return fail("popStyle called with no matching pushStyle");
     formatStack_.pop();
-    return 0;
+    return true;
 }
 
-int PalayDocument::saveAs(lua_State *L)
+bool PalayDocument::saveAs(const QString &filename)
 {
-    const char *path = luaL_checkstring(L, 2);
-    printer_.setOutputFileName(QString::fromUtf8(path));
-    print();
-    return 0;
+    if (!checkCompression())
+        return false;
+
+    if (sectionFile_) {
+        // The earlier sections are already in a temporary file
+        print();
+        QString sectionFilename = sectionFile_->fileName();
+        if (pagesPrinted_ == 0) {
+            delete sectionFile_;
+            sectionFile_ = 0;
+            return fail(QString("Page range starts at page %1, after the end of the document").arg(firstPage_));
+        }
+        bool written = !writeFailed();
+        if (written) {
+            QFile::remove(filename);
+            written = QFile::rename(sectionFilename, filename) || QFile::copy(sectionFilename, filename);
+        }
+        delete sectionFile_;
+        sectionFile_ = 0;
+        if (!written)
+            return fail(QString("Error writing %1").arg(filename));
+    } else {
+        printer_.setOutputFileName(filename);
+        print();
+        // Finishing the file writes an empty page if nothing was painted
+        if (pagesPrinted_ == 0) {
+            QFile::remove(filename);
+            return fail(QString("Page range starts at page %1, after the end of the document").arg(firstPage_));
+        }
+        if (writeFailed())
+            return fail(QString("Error writing %1").arg(filename));
+    }
+
+    // Make the output reproducible if asked to
+    if (printer_.outputFormat() == QPrinter::PdfFormat && (creationDate_.isValid() || !documentId_.isEmpty()) &&
+            !PdfMetadata::rewrite(filename, creationDate_, documentId_))
+        return fail(QString("Error writing %1").arg(filename));
+    return true;
 }
 
-int PalayDocument::startTable(lua_State *L)
+/*!
+    Writes \a date as the creation date of PDFs instead of the current
+    time. Setting a date also makes the file ID a hash of the contents,
+    unless it is set with setDocumentId(), so that the same document
+    always gives the same file.
+ */
+void PalayDocument::setCreationDate(const QDateTime &date)
 {
-    int rows = luaL_checkinteger(L, 2);
-    int cols = luaL_checkinteger(L, 3);
-    if (rows < 1 || cols < 1)
-        luaL_error(L, "Tables must have at least one column and at least one row.");
+    creationDate_ = date;
+}
 
-    if (rows < 1)
-        luaL_error(L, "Number of table rows must be greater than zero.");
-    if (cols < 1)
-        luaL_error(L, "Number of table columns must be greater than zero.");
+/*!
+    Sets the file ID of PDFs to a hash of \a id instead of a random one.
+ */
+void PalayDocument::setDocumentId(const QByteArray &id)
+{
+    documentId_ = id;
+}
+
+/*!
+    Returns the files that the document was built from: images, SVGs and
+    CSV files. Together with the script they determine the output.
+ */
+QStringList PalayDocument::referencedFiles() const
+{
+    return referencedFiles_;
+}
+
+/*!
+    Writes the built document to \a filename so that it can be rendered
+    again with loadSnapshot() without running the script: the contents
+    and formats of the document and its absolute blocks, the page size
+    and the images. Bitmaps are saved by absolute file name and SVGs by
+    their contents. Page range, draft mode and image resolution are
+    options of the rendering and aren't saved.
+ */
+bool PalayDocument::saveSnapshot(const QString &filename)
+{
+    if (fragmentDoc_)
+        return fail("saveSnapshot cannot be used while recording a fragment");
+    if (sectionFile_)
+        return fail("saveSnapshot cannot be used after section()");
+
+    QFile file(filename);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate))
+        return fail(QString("Error writing %1: %2").arg(filename).arg(file.errorString()));
+
+    QDataStream out(&file);
+    out.setVersion(QDataStream::Qt_4_8);
+    out << snapshotMagic << snapshotVersion << qint32(printer_.paperSize());
+    DocumentSerializer::write(out, doc_);
+
+    out << qint32(absoluteBlocks_.size());
+    foreach (AbsoluteBlock *block, absoluteBlocks_) {
+        out << qint32(block->corner()) << block->position();
+        DocumentSerializer::write(out, block->document());
+    }
+
+    // Images are found by the document they are in: 0 for the main
+    // document, otherwise the number of the absolute block
+    out << qint32(layoutHandlers_.size());
+    foreach (const LayoutHandler &handler, layoutHandlers_) {
+        qint32 document = 0;
+        for (int i = 0; i < absoluteBlocks_.size(); ++i) {
+            if (handler.cursor.document() == absoluteBlocks_.at(i)->document())
+                document = i + 1;
+        }
+        if (BitmapTextObject *bitmap = qobject_cast<BitmapTextObject*>(handler.component)) {
+            out << quint8(SnapshotBitmap) << document << qint32(handler.position)
+                << bitmap->size() << handler.filename;
+        } else if (SvgVectorTextObject *svg = qobject_cast<SvgVectorTextObject*>(handler.component)) {
+            out << quint8(SnapshotSvg) << document << qint32(handler.position)
+                << svg->size() << handler.svgContents;
+        }
+    }
+    out << referencedFiles_;
+
+    if (out.status() != QDataStream::Ok || file.error() != QFile::NoError)
+        return fail(QString("Error writing %1: %2").arg(filename).arg(file.errorString()));
+    return true;
+}
+
+/*!
+    Reads a snapshot written by saveSnapshot() into this document, which
+    must be empty. The page size is set from the snapshot and can be
+    changed afterwards to paginate the document again. Absolute blocks
+    keep their positions, so headers and footers placed on each page by
+    the script only fit the page size they were made for.
+ */
+bool PalayDocument::loadSnapshot(const QString &filename)
+{
+    if (!doc_->isEmpty() || !absoluteBlocks_.isEmpty() || !layoutHandlers_.isEmpty())
+        return fail("loadSnapshot needs an empty document");
+
+    QFile file(filename);
+    if (!file.open(QFile::ReadOnly))
+        return fail(QString("Error opening %1: %2").arg(filename).arg(file.errorString()));
+
+    QDataStream in(&file);
+    in.setVersion(QDataStream::Qt_4_8);
+    quint32 magic;
+    quint32 version;
+    qint32 paperSize;
+    in >> magic >> version >> paperSize;
+    if (magic != snapshotMagic)
+        return fail(QString("%1 is not a palay snapshot").arg(filename));
+    if (version != snapshotVersion)
+        return fail(QString("%1 is a version %2 snapshot, only version %3 is supported").arg(filename).arg(version).arg(snapshotVersion));
+
+    const QString corrupt = QString("%1 is truncated or corrupt").arg(filename);
+    setPageSize(QPrinter::PaperSize(paperSize));
+    if (!DocumentSerializer::read(in, doc_))
+        return fail(corrupt);
+
+    qint32 blockCount;
+    in >> blockCount;
+    for (qint32 i = 0; i < blockCount && in.status() == QDataStream::Ok; ++i) {
+        qint32 corner;
+        QPointF position;
+        in >> corner >> position;
+        AbsoluteBlock *block = new AbsoluteBlock(Qt::Corner(corner), position, doc_->pageSize(), this);
+        block->document()->setUndoRedoEnabled(!buildMode_);
+        absoluteBlocks_ << block;
+        if (!DocumentSerializer::read(in, block->document()))
+            return fail(corrupt);
+    }
+
+    qint32 objectCount;
+    in >> objectCount;
+    for (qint32 i = 0; i < objectCount && in.status() == QDataStream::Ok; ++i) {
+        quint8 type;
+        qint32 document;
+        qint32 position;
+        QSizeF size;
+        in >> type >> document >> position >> size;
+        if (document < 0 || document > absoluteBlocks_.size())
+            return fail(corrupt);
+
+        LayoutHandler lh;
+        lh.cursor = QTextCursor(document == 0 ? doc_ : absoluteBlocks_.at(document - 1)->document());
+        lh.position = position;
+        if (type == SnapshotBitmap) {
+            in >> lh.filename;
+            BitmapTextObject *bitmap = new BitmapTextObject(lh.filename, size.width(), size.height(), this);
+            if (!bitmap->isValid()) {
+                delete bitmap;
+                return fail(QString("Failed to load image from file %1").arg(lh.filename));
+            }
+            lh.component = bitmap;
+        } else if (type == SnapshotSvg) {
+            in >> lh.svgContents;
+            SvgVectorTextObject *svg = new SvgVectorTextObject(lh.svgContents, size.width(), size.height(), this);
+            if (!svg->isValid()) {
+                delete svg;
+                return fail("Error parsing SVG");
+            }
+            lh.component = svg;
+        } else {
+            return fail(corrupt);
+        }
+        layoutHandlers_.append(lh);
+    }
+    in >> referencedFiles_;
+    if (in.status() != QDataStream::Ok)
+        return fail(corrupt);
+
+    // Anything added after loading goes at the end
+    cursorStack_.top().movePosition(QTextCursor::End);
+    return true;
+}
+
+bool PalayDocument::startTable(int rows, int columns)
+{
+    if (rows < 1 || columns < 1)
+        return fail("Tables must have at least one column and at least one row.");
 
     // Save off position before inserting the table so that we can move past the end
     // of the table when endTable is called.
@@ -376,7 +746,7 @@ int PalayDocument::startTable(lua_State *L)
     // The call to cell() will do the same but we may not get a call
     // for each cell if some are left empty but we still want them to
     // have the right padding.
-    QTextTable *table = cursorStack_.top().insertTable(rows, cols, formatStack_.top().table_);
+    QTextTable *table = cursorStack_.top().insertTable(rows, columns, formatStack_.top().table_);
     for (int i = 0; i < table->rows(); ++i) {
         for (int j = 0; j < table->columns(); ++j) {
             QTextTableCell cell = table->cellAt(i, j);
@@ -386,35 +756,24 @@ int PalayDocument::startTable(lua_State *L)
             cellCursor.setCharFormat(formatStack_.top().char_);
         }
     }
-    return 0;
+    return true;
 }
 
-int PalayDocument::cell(lua_State *L)
+bool PalayDocument::cell(int row, int column, int rowSpan, int columnSpan)
 {
-    int row = luaL_checkinteger(L, 2);
-    int col = luaL_checkinteger(L, 3);
-    int rowspan = 1;
-    int colspan = 1;
-    if (lua_gettop(L) >= 4) {
-        rowspan = luaL_checkinteger(L, 4);
-    }
-    if (lua_gettop(L) >= 5) {
-        colspan = luaL_checkinteger(L, 5);
-    }
-
     QTextTable *table = cursorStack_.top().currentTable();
     if (!table)
-        luaL_error(L, "cell called with no matching call to table()");
+        return fail("cell called with no matching call to table()");
 
     if (row < 1 || row > table->rows())
-        luaL_error(L, "Invalid row number %d: must be between 1 and %d", row, table->rows());
-    if (col < 1 || col > table->columns())
-        luaL_error(L, "Invalid column number %d: must be between 1 and %d", col, table->columns());
+        return fail(QString("Invalid row number %1: must be between 1 and %2").arg(row).arg(table->rows()));
+    if (column < 1 || column > table->columns())
+        return fail(QString("Invalid column number %1: must be between 1 and %2").arg(column).arg(table->columns()));
 
-    if (rowspan > 1 or colspan > 1)
-        table->mergeCells(row - 1, col - 1, rowspan, colspan);
+    if (rowSpan > 1 || columnSpan > 1)
+        table->mergeCells(row - 1, column - 1, rowSpan, columnSpan);
 
-    QTextTableCell tableCell = table->cellAt(row - 1, col - 1);
+    QTextTableCell tableCell = table->cellAt(row - 1, column - 1);
     QTextCursor cellCursor = tableCell.firstCursorPosition();
 
     // Propogate formats to cell (in case any have changed since
@@ -426,13 +785,13 @@ int PalayDocument::cell(lua_State *L)
     // Put current cursor at start of cell.
     cursorStack_.top() = cellCursor;
 
-    return 0;
+    return true;
 }
 
-int PalayDocument::endTable(lua_State *L)
+bool PalayDocument::endTable()
 {
     if (!cursorStack_.top().currentTable())
-        luaL_error(L, "endTable called with no matching call to startTable()");
+        return fail("endTable called with no matching call to startTable()");
 
     cursorStack_.pop();
 
@@ -446,61 +805,218 @@ int PalayDocument::endTable(lua_State *L)
     } else {
         cursorStack_.top() = cursorStack_.top().currentFrame()->lastCursorPosition();
     }
-    return 0;
+    return true;
+}
+
+/*!
+    Inserts a table with the contents of the CSV or TSV file \a filename.
+    The file is memory mapped and parsed here, so large files don't go
+    through Lua a field at a time. The \a options are:
+
+        - delimiter: the field separator, "," or a tab for .tsv and .tab files
+        - header: true if the first row holds column names (default false).
+          It is inserted as the first row of the table and is never
+          formatted as a number.
+        - columns: the columns to include, in order, as a list of 1-based
+          numbers or header names. The default is every column.
+        - max_rows: the most rows to insert after the header
+        - decimals: fields that are numbers are shown with this many decimal places
+        - thousands_separator: put between groups of thousands in numbers, e.g. ","
+        - number_alignment: alignment of numbers (default "Right")
+
+    Cells get the current style like cells added with cell().
+ */
+bool PalayDocument::tableFromCsv(const QString &filename, const QVariantMap &options)
+{
+    qreal number;
+    char delimiter = filename.endsWith(".tsv", Qt::CaseInsensitive) ||
+                     filename.endsWith(".tab", Qt::CaseInsensitive) ? '\t' : ',';
+    bool header = false;
+    int maxRows = -1;
+    int decimals = -1;
+    QString separator;
+    QVariantList columnList;
+    QTextBlockFormat numberFormat(formatStack_.top().block_);
+    numberFormat.setAlignment(Qt::AlignRight);
+
+    for (QVariantMap::const_iterator i = options.constBegin(); i != options.constEnd(); ++i) {
+        const QByteArray keyBytes = i.key().toUtf8();
+        const char *key = keyBytes.constData();
+        const QVariant &value = i.value();
+        if (qstricmp(key, "delimiter") == 0) {
+            const QByteArray delimiterBytes = value.toString().toUtf8();
+            if (!isString(value) || delimiterBytes.size() != 1 || delimiterBytes.at(0) == '"' ||
+                    delimiterBytes.at(0) == '\n' || delimiterBytes.at(0) == '\r')
+                return fail("Invalid value for delimiter. Must be a single character.");
+            delimiter = delimiterBytes.at(0);
+        } else if (qstricmp(key, "header") == 0) {
+            if (value.type() != QVariant::Bool)
+                return fail("Invalid value for header. Must be true or false.");
+            header = value.toBool();
+        } else if (qstricmp(key, "columns") == 0) {
+            if (value.type() != QVariant::List || value.toList().isEmpty())
+                return fail("Invalid value for columns. Must be a list of column numbers or names.");
+            columnList = value.toList();
+        } else if (qstricmp(key, "max_rows") == 0) {
+            if (!isNumber(value, &number) || number < 0)
+                return fail("Invalid value for max_rows. Must be a positive number.");
+            maxRows = int(number);
+        } else if (qstricmp(key, "decimals") == 0) {
+            if (!isNumber(value, &number) || number < 0)
+                return fail("Invalid value for decimals. Must be a positive number.");
+            decimals = int(number);
+        } else if (qstricmp(key, "thousands_separator") == 0) {
+            if (!isString(value))
+                return fail("Invalid value for thousands_separator. Must be a string.");
+            separator = value.toString();
+        } else if (qstricmp(key, "number_alignment") == 0) {
+            Qt::Alignment align;
+            if (!getAlignment(value, &align))
+                return false;
+            numberFormat.setAlignment(align);
+        } else {
+            return fail(QString("Invalid key in options table: %1").arg(i.key()));
+        }
+    }
+
+    referencedFiles_ << filename;
+    CsvReader reader(delimiter);
+    if (!reader.open(filename))
+        return fail(reader.errorString());
+
+    // Count the rows and columns first since the table is created
+    // at its full size.
+    QList<QByteArray> headerFields;
+    if (header && reader.readRow(&headerFields) < 0)
+        headerFields.clear();
+    int rows = header && !headerFields.isEmpty() ? 1 : 0;
+    int fileColumns = headerFields.size();
+    int dataRows = 0;
+    for (int fields; (maxRows < 0 || dataRows < maxRows) && (fields = reader.readRow(0)) >= 0; ++dataRows)
+        fileColumns = qMax(fileColumns, fields);
+    rows += dataRows;
+    if (rows == 0)
+        return fail(QString("%1 has no rows").arg(filename));
+
+    // Map the table columns to columns in the file
+    QVector<int> columns;
+    if (columnList.isEmpty()) {
+        for (int i = 0; i < fileColumns; ++i)
+            columns << i;
+    }
+    foreach (const QVariant &column, columnList) {
+        if (column.type() == QVariant::String) {
+            int index = -1;
+            for (int i = 0; i < headerFields.size() && index < 0; ++i) {
+                if (QString::fromUtf8(headerFields.at(i)) == column.toString())
+                    index = i;
+            }
+            if (index < 0)
+                return fail(QString("No column named \"%1\" in %2").arg(column.toString()).arg(filename));
+            columns << index;
+        } else if (isNumber(column, &number) && int(number) >= 1) {
+            columns << int(number) - 1;
+        } else {
+            return fail("Invalid value for columns. Must be a list of column numbers or names.");
+        }
+    }
+
+    if (!startTable(rows, columns.size()))
+        return false;
+
+    QTextCursor cellCursor = cursorStack_.top();
+    const QTextCharFormat &charFormat = formatStack_.top().char_;
+    QString text;
+    QList<QByteArray> fields;
+    reader.rewind();
+    for (int row = 0; row < rows; ++row) {
+        reader.readRow(&fields);
+        const bool isHeader = header && row == 0;
+        for (int column = 0; column < columns.size(); ++column) {
+            const int index = columns.at(column);
+            if (index < fields.size() && !fields.at(index).isEmpty()) {
+                if (!isHeader && formatNumber(fields.at(index), decimals, separator, &text)) {
+                    cellCursor.setBlockFormat(numberFormat);
+                    cellCursor.insertText(text, charFormat);
+                } else {
+                    cellCursor.insertText(QString::fromUtf8(fields.at(index)), charFormat);
+                }
+            }
+            cellCursor.movePosition(QTextCursor::NextCell);
+        }
+    }
+
+    return endTable();
 }
 
-int PalayDocument::pageBreak(lua_State *L)
+void PalayDocument::pageBreak()
 {
-    Q_UNUSED(L);
     QTextBlockFormat breakBlock(formatStack_.top().block_);
     breakBlock.setPageBreakPolicy(QTextBlockFormat::PageBreak_AlwaysBefore);
     cursorStack_.top().insertBlock(breakBlock);
-    return 0;
 }
 
-int PalayDocument::image(lua_State *L)
+/*!
+    Inserts the image in \a filename, SVG or bitmap, at \a widthPts by
+    \a heightPts. If only one is given the other keeps the aspect ratio,
+    if neither is given the image's own size is used. The size the image
+    is placed at is returned in \a placedSize.
+ */
+bool PalayDocument::image(const QString &filename, float widthPts, float heightPts, QSizeF *placedSize)
 {
-    QString name = QString::fromUtf8(luaL_checkstring(L, 2));
-    float widthPts = -1;
-    float heightPts = -1;
-
-    if (lua_gettop(L) >= 3)
-        widthPts = luaL_checkinteger(L, 3);
-    if (lua_gettop(L) >= 4)
-        heightPts = luaL_checkinteger(L, 4);
+    if (fragmentDoc_)
+        return fail("Images cannot be used in fragments");
 
-    if (name.endsWith(".svg", Qt::CaseInsensitive)) {
-        QFile svgFile(name);
+    referencedFiles_ << filename;
+    QSizeF size;
+    if (filename.endsWith(".svg", Qt::CaseInsensitive)) {
+        QFile svgFile(filename);
         if (!svgFile.open(QFile::ReadOnly))
-            luaL_error(L, "Failed to open SVG file %s", qPrintable(name));
+            return fail(QString("Failed to open SVG file %1").arg(filename));
         QByteArray svgContents = svgFile.readAll();
-        insertSvgImage(L, svgContents, widthPts, heightPts);
+        size = insertSvgImage(svgContents, widthPts, heightPts);
     } else {
-        insertBitmapImage(L, name, widthPts, heightPts);
+        size = insertBitmapImage(filename, widthPts, heightPts);
     }
+    if (!size.isValid())
+        return false;
 
-    return 0;
+    if (placedSize)
+        *placedSize = size;
+    return true;
 }
 
-int PalayDocument::svg(lua_State *L)
+bool PalayDocument::svg(const QByteArray &svgContents, float widthPts, float heightPts, QSizeF *placedSize)
 {
-    QByteArray svgContents = luaL_checkstring(L, 2);
-    float widthPts = -1;
-    float heightPts = -1;
-
-    if (lua_gettop(L) >= 3)
-        widthPts = luaL_checkinteger(L, 3);
-    if (lua_gettop(L) >= 4)
-        heightPts = luaL_checkinteger(L, 4);
+    if (fragmentDoc_)
+        return fail("Images cannot be used in fragments");
 
-    insertSvgImage(L, svgContents, widthPts, heightPts);
+    QSizeF size = insertSvgImage(svgContents, widthPts, heightPts);
+    if (!size.isValid())
+        return false;
 
-    return 0;
+    if (placedSize)
+        *placedSize = size;
+    return true;
 }
 
-int PalayDocument::html(lua_State *L)
+void PalayDocument::html(const QString &html)
 {
-    QString htmlText = QString::fromUtf8(luaL_checkstring(L, 2));
+    QString htmlText = html;
+
+    // The inserted html gets the current font family, size and color
+    // but not the rest of the current style, the same as with the
+    // default style sheet below.
+    const QTextCharFormat &current = formatStack_.top().char_;
+    QTextCharFormat baseFormat;
+    baseFormat.setFontFamily(current.fontFamily());
+    baseFormat.setFontPointSize(current.fontPointSize());
+    baseFormat.setForeground(QBrush(QColor(current.foreground().color().name())));
+
+    // Simple inline markup is inserted directly. Anything else
+    // goes through Qt's html parser.
+    if (HtmlImporter::insert(cursorStack_.top(), htmlText, baseFormat))
+        return;
 
     // Add <html> start and end tags if they are not already there.
     // This ensures that the selector in the default style sheet
@@ -509,7 +1025,6 @@ int PalayDocument::html(lua_State *L)
     // is text inside any tag (bar in this case) and without wrapping
     // the fragment in some tag, there is no css selector that can
     // get that text.
-    QRegExp htmlTagExp("\\s*<html.*<\\/html>\\s*", Qt::CaseInsensitive);
     if (!htmlTagExp.exactMatch(htmlText))
         htmlText = QString("<html>") + htmlText + "</html>";
 
@@ -519,13 +1034,14 @@ int PalayDocument::html(lua_State *L)
     // that when you insert html without a specified font color
     // it gets imported with null color (brush style of zero) and doesn't
     // get drawn. This works around that problem.
-    doc_->setDefaultStyleSheet(QString("html { color: %1; font-family: \"%2\"; font-size: %3pt; }")
-                               .arg(formatStack_.top().char_.foreground().color().name())
-                               .arg(formatStack_.top().char_.fontFamily())
-                               .arg(formatStack_.top().char_.fontPointSize()));
+    QString styleSheet = QString("html { color: %1; font-family: \"%2\"; font-size: %3pt; }")
+            .arg(current.foreground().color().name())
+            .arg(current.fontFamily())
+            .arg(current.fontPointSize());
+    if (styleSheet != doc_->defaultStyleSheet())
+        doc_->setDefaultStyleSheet(styleSheet);
 
     cursorStack_.top().insertHtml(htmlText);
-    return 0;
 }
 
 struct PageSizeLookup {
@@ -678,67 +1194,364 @@ static const PageSizeLookup nameToPageSize[] =
 #endif
 };
 
-int PalayDocument::pageSize(lua_State *L)
+/*!
+    Sets the page size by name, e.g. "Letter" or "A4". The names are
+    the QPrinter::PaperSize values.
+ */
+bool PalayDocument::setPageSize(const QString &name)
 {
-    const char * sizeString = luaL_checkstring(L, 2);
-    QPrinter::PaperSize size = (QPrinter::PaperSize) (QPrinter::NPageSize + 1);
+    if (painter_)
+        return fail("The page size cannot be changed after section()");
+    const QByteArray nameBytes = name.toUtf8();
     for (size_t i = 0; i < NUM_ELEMENTS(nameToPageSize); i++) {
-        if (qstricmp(sizeString, nameToPageSize[i].name) == 0) {
-            size = nameToPageSize[i].value;
-            break;
+        if (qstricmp(nameBytes.constData(), nameToPageSize[i].name) == 0) {
+            setPageSize(nameToPageSize[i].value);
+            return true;
         }
     }
-    if (size > QPrinter::NPageSize)
-        luaL_error(L, "\"%s\" is not a valid page size. Try \"Letter\" or \"A4\".", qPrintable(sizeString));
-
-    setPageSize(size);
+    return fail(QString("\"%1\" is not a valid page size. Try \"Letter\" or \"A4\".").arg(name));
+}
 
-    return 0;
+void PalayDocument::setPageSize(QPrinter::PaperSize size)
+{
+    printer_.setPaperSize(size);
+    applyPageSize();
 }
 
-int PalayDocument::pageMargins(lua_State *L)
+void PalayDocument::setPageMargins(qreal leftPts, qreal topPts, qreal rightPts, qreal bottomPts)
 {
-    setPageMargins(pointsToDotsX(luaL_checkinteger(L, 2)),
-                   pointsToDotsY(luaL_checkinteger(L, 3)),
-                   pointsToDotsX(luaL_checkinteger(L, 4)),
-                   pointsToDotsY(luaL_checkinteger(L, 5)));
-    return 0;
+    applyPageMargins(pointsToDotsX(leftPts),
+                     pointsToDotsY(topPts),
+                     pointsToDotsX(rightPts),
+                     pointsToDotsY(bottomPts));
 }
 
-int PalayDocument::getPageWidth(lua_State *L)
+qreal PalayDocument::pageWidth() const
 {
-    lua_pushnumber(L, printer_.pageRect(QPrinter::Point).width());
-    return 1;
+    return printer_.pageRect(QPrinter::Point).width();
 }
 
-int PalayDocument::getPageHeight(lua_State *L)
+qreal PalayDocument::pageHeight() const
 {
-    lua_pushnumber(L, printer_.pageRect(QPrinter::Point).height());
-    return 1;
+    return printer_.pageRect(QPrinter::Point).height();
 }
 
-int PalayDocument::getPageMargins(lua_State *L)
+void PalayDocument::pageMargins(qreal *leftPts, qreal *topPts, qreal *rightPts, qreal *bottomPts) const
 {
     QTextFrameFormat rootFormat = doc_->rootFrame()->frameFormat();
-    lua_pushnumber(L, dotsToPointsX(rootFormat.leftMargin()));
-    lua_pushnumber(L, dotsToPointsY(rootFormat.topMargin()));
-    lua_pushnumber(L, dotsToPointsX(rootFormat.rightMargin()));
-    lua_pushnumber(L, dotsToPointsY(rootFormat.bottomMargin()));
-    return 4;
+    *leftPts = dotsToPointsX(rootFormat.leftMargin());
+    *topPts = dotsToPointsY(rootFormat.topMargin());
+    *rightPts = dotsToPointsX(rootFormat.rightMargin());
+    *bottomPts = dotsToPointsY(rootFormat.bottomMargin());
+}
+
+int PalayDocument::pageCount()
+{
+    RenderStats::Scope layout(stats_, RenderStats::Layout);
+    PALAY_TRACE_SCOPE("layout", "pageCount");
+
+    // The layout only hears about changes when the edit block ends
+    if (buildMode_)
+        buildCursor_.endEditBlock();
+    int count = doc_->pageCount();
+    if (buildMode_)
+        buildCursor_.beginEditBlock();
+    return count;
+}
+
+/*!
+    Returns the number of the first page of the current section: 1 plus
+    the pages of the sections before it, back to the last section ended
+    with section(true).
+ */
+int PalayDocument::firstPageNumber()
+{
+    // Only the sections since the numbering restarted are waited for
+    int pages = 0;
+    int i = pendingSections_.size() - 1;
+    for (; i >= 0 && !pendingSections_[i].restartsPageNumbers; --i)
+        pages += sectionPageCount(pendingSections_[i]);
+    if (i < 0)
+        pages += pageNumberOffset_;
+    return pages + 1;
+}
+
+/*!
+    Ends the current section and starts a new one on a new page. The
+    section is laid out and its pages are painted to a temporary file
+    (straight away unless setLayoutThreads() is used), then it is freed,
+    so a long document only needs the memory of its largest section.
+    saveAs() adds the last section and writes the file.
+
+    Page numbers carry on from one section to the next: pageCount() is
+    the number of pages in the current section, and firstPageNumber()
+    is the number of its first page. If \a restartPageNumbers is true
+    the next section is numbered from 1 instead, as when several
+    documents are merged into one file. Absolute blocks belong to the
+    section they are made in and are positioned on its pages. The page
+    size can't change once a section has been painted.
+ */
+bool PalayDocument::section(bool restartPageNumbers)
+{
+    if (fragmentDoc_)
+        return fail("section cannot be used while recording a fragment");
+    if (cursorStack_.size() > 1)
+        return fail("section cannot be used inside a table or block");
+    if (!checkCompression())
+        return false;
+    if (doc_->isEmpty() && absoluteBlocks_.isEmpty() && layoutHandlers_.isEmpty()) {
+        // Nothing to end, so the restart applies to the last section
+        if (restartPageNumbers && !pendingSections_.isEmpty())
+            pendingSections_.last().restartsPageNumbers = true;
+        else if (restartPageNumbers)
+            pageNumberOffset_ = 0;
+        return true;
+    }
+
+    RenderStats::Scope writing(stats_, RenderStats::Write);
+    PALAY_TRACE_SCOPE("render", "section");
+
+    if (!sectionFile_) {
+        sectionFile_ = new QTemporaryFile(QDir::temp().filePath("palay-XXXXXX.pdf"), this);
+        if (!sectionFile_->open()) {
+            delete sectionFile_;
+            sectionFile_ = 0;
+            return fail("Error creating a temporary file for sections");
+        }
+        printer_.setOutputFileName(sectionFile_->fileName());
+    }
+
+    if (buildMode_)
+        buildCursor_.endEditBlock();
+    if (!painter_)
+        startPainting();
+
+    Section finished = currentSection();
+    finished.restartsPageNumbers = restartPageNumbers;
+    registerHandlers(finished);
+    if (layoutThreads_ > 1 && (lastPage_ == 0 || pageOffset_ < lastPage_)) {
+        QList<QTextDocument*> documents;
+        documents << finished.document;
+        foreach (AbsoluteBlock *block, finished.absoluteBlocks)
+            documents << block->document();
+        foreach (QTextDocument *document, documents)
+            document->documentLayout();
+        finished.layout = new SectionLayout(documents);
+        finished.layout->start();
+    }
+    pendingSections_ << finished;
+
+    // Paint the sections that are laid out, in order. Waiting for the
+    // oldest when more sections are pending than threads bounds memory.
+    while (!pendingSections_.isEmpty() &&
+           (!pendingSections_.first().layout || pendingSections_.first().layout->isFinished() ||
+            pendingSections_.size() > layoutThreads_))
+        paintPendingSection();
+    if (writeFailed())
+        return fail("Error writing sections");
+
+    // The finished section belongs to pendingSections_ now
+    absoluteBlocks_.clear();
+    layoutHandlers_.clear();
+    QTextDocument *section = new QTextDocument(this);
+    section->setUndoRedoEnabled(!buildMode_);
+    section->setDefaultFont(doc_->defaultFont());
+    section->setDocumentMargin(0);
+    section->setPageSize(doc_->pageSize());
+    section->rootFrame()->setFrameFormat(doc_->rootFrame()->frameFormat());
+    doc_ = section;
+
+    QTextCursor sectionCursor(doc_);
+    sectionCursor.setBlockFormat(formatStack_.top().block_);
+    sectionCursor.setBlockCharFormat(formatStack_.top().char_);
+    sectionCursor.setCharFormat(formatStack_.top().char_);
+    cursorStack_.top() = sectionCursor;
+
+    buildCursor_ = QTextCursor(doc_);
+    if (buildMode_)
+        buildCursor_.beginEditBlock();
+    return true;
 }
 
-int PalayDocument::getPageCount(lua_State *L)
+/*!
+    When \a enabled, PdfWriter compresses and writes each page in the
+    thread pool while the next one is painted. Pages are still painted on
+    the calling thread, so the file is the same. It only applies to the
+    direct PDF writer (see setDirectPdf()); Qt's PDF engine compresses
+    each page itself when the next one is started.
+ */
+void PalayDocument::setPipelined(bool enabled)
 {
-    lua_pushinteger(L, doc_->pageCount());
-    return 1;
+    pipelined_ = enabled;
 }
 
-int PalayDocument::startBlock(lua_State *L)
+/*!
+    Sets how hard the streams in PDFs are compressed. \a level is "fast"
+    for quick previews, "default" or "max" for the smallest files.
+    PdfWriter (see setDirectPdf()) compresses each page's streams at the
+    level given in the thread pool. Qt's PDF engine always uses the
+    default level, so other levels are refused when the document is
+    written with it (see checkCompression()).
+ */
+bool PalayDocument::setCompression(const QString &level)
 {
-    Qt::Corner corner = getCorner(L, 2);
-    float x = pointsToDotsX(luaL_checkinteger(L, 3));
-    float y = pointsToDotsY(luaL_checkinteger(L, 4));
-    AbsoluteBlock *block = new AbsoluteBlock(corner, QPointF(x,y), doc_->pageSize(), this);
+    if (level == "fast")
+        compressionLevel_ = PdfCompressor::FastLevel;
+    else if (level == "default")
+        compressionLevel_ = PdfCompressor::DefaultLevel;
+    else if (level == "max")
+        compressionLevel_ = PdfCompressor::MaxLevel;
+    else
+        return fail(QString("Unknown compression level %1: must be fast, default or max.").arg(level));
+    return true;
+}
+
+/*!
+    Returns true if the compression level can be used for the output.
+    Qt's PDF engine always compresses at its default level, so other
+    levels need PdfWriter rather than being ignored.
+ */
+bool PalayDocument::checkCompression()
+{
+    if (compressionLevel_ != PdfCompressor::DefaultLevel && !directPdf_ &&
+            printer_.outputFormat() == QPrinter::PdfFormat)
+        return fail("Compression levels other than default need the direct PDF writer (--direct-pdf)");
+    return true;
+}
+
+/*!
+    When \a enabled, PDFs are written with PdfWriter instead of QPrinter.
+    It writes each page to the file as soon as it is painted, shares
+    fonts and images between pages and packs the objects into compressed
+    object streams, so files are smaller and use less memory to write.
+    It only applies to documents started after it is set.
+ */
+void PalayDocument::setDirectPdf(bool enabled)
+{
+    directPdf_ = enabled;
+}
+
+/*!
+    Lays out up to \a threads sections at the same time while the script
+    builds the next one, each in a thread of its own that owns the
+    section's documents while it lays them out. Sections are still
+    painted in order. The default is 1, which lays out each section when
+    it is painted.
+ */
+bool PalayDocument::setLayoutThreads(int threads)
+{
+    if (threads < 1)
+        return fail(QString("Invalid number of layout threads %1: must be at least 1.").arg(threads));
+    layoutThreads_ = threads;
+    return true;
+}
+
+/*!
+    Only pages \a first to \a last are painted by saveAs(). A \a last
+    of 0 means the end of the document.
+ */
+bool PalayDocument::setPageRange(int first, int last)
+{
+    if (first < 1)
+        return fail(QString("Invalid first page %1: must be greater than zero.").arg(first));
+    if (last != 0 && last < first)
+        return fail(QString("Invalid last page %1: must not be before the first page or 0 for the end of the document.").arg(last));
+
+    firstPage_ = first;
+    lastPage_ = last;
+    return true;
+}
+
+void PalayDocument::setDraftMode(bool draft)
+{
+    draft_ = draft;
+}
+
+bool PalayDocument::setImageResolution(int dpi)
+{
+    if (dpi < 0)
+        return fail(QString("Invalid image resolution %1: must be a positive number or 0 for full resolution.").arg(dpi));
+    imageDpi_ = dpi;
+    return true;
+}
+
+/*!
+    Returns the time spent in each rendering phase so far, the peak
+    memory use and the size of the document.
+ */
+QVariantMap PalayDocument::statistics() const
+{
+    QVariantMap result;
+    for (int phase = 0; phase < RenderStats::PhaseCount; ++phase)
+        result[QString(RenderStats::phaseName(RenderStats::Phase(phase))) + "_seconds"] = stats_.seconds(RenderStats::Phase(phase));
+    result["total_seconds"] = stats_.totalSeconds();
+    result["peak_rss_kb"] = RenderStats::peakRssKb();
+    result["pages"] = pagesPrinted_;
+
+    // The sections already painted, the ones waiting and the current one
+    QList<Section> sections = pendingSections_;
+    sections << currentSection();
+    for (QVariantMap::const_iterator i = paintedCounts_.constBegin(); i != paintedCounts_.constEnd(); ++i)
+        result[i.key()] = i.value();
+    foreach (const Section &section, sections) {
+        const QVariantMap counts = sectionCounts(section);
+        for (QVariantMap::const_iterator i = counts.constBegin(); i != counts.constEnd(); ++i)
+            result[i.key()] = result.value(i.key()).toInt() + i.value().toInt();
+    }
+
+    return result;
+}
+
+/*!
+    Returns the sizes of \a section: blocks, formats, frames, absolute
+    blocks, images and SVGs.
+ */
+QVariantMap PalayDocument::sectionCounts(const Section &section) const
+{
+    QVariantMap result;
+    QList<QTextDocument*> documents;
+    documents << section.document;
+    foreach (AbsoluteBlock *block, section.absoluteBlocks)
+        documents << block->document();
+    int blocks = 0;
+    int formats = 0;
+    int frames = 0;
+    foreach (QTextDocument *document, documents) {
+        blocks += document->blockCount();
+        formats += document->allFormats().size();
+        frames += countFrames(document->rootFrame());
+    }
+    result["blocks"] = blocks;
+    result["formats"] = formats;
+    result["frames"] = frames;
+    result["absolute_blocks"] = section.absoluteBlocks.size();
+
+    int images = 0;
+    int svgs = 0;
+    foreach (const LayoutHandler &handler, section.layoutHandlers) {
+        if (qobject_cast<BitmapTextObject*>(handler.component))
+            ++images;
+        else if (qobject_cast<SvgVectorTextObject*>(handler.component))
+            ++svgs;
+    }
+    result["images"] = images;
+    result["svgs"] = svgs;
+
+    return result;
+}
+
+/*!
+    Starts an absolutely positioned block \a xPts and \a yPts from
+    \a corner of every page. Content goes into the block until endBlock().
+ */
+bool PalayDocument::startBlock(Qt::Corner corner, qreal xPts, qreal yPts)
+{
+    if (fragmentDoc_)
+        return fail("startBlock cannot be used while recording a fragment");
+
+    QPointF position(pointsToDotsX(xPts), pointsToDotsY(yPts));
+    AbsoluteBlock *block = new AbsoluteBlock(corner, position, doc_->pageSize(), this);
+    block->document()->setUndoRedoEnabled(!buildMode_);
     absoluteBlocks_ << block;
 
     block->document()->rootFrame()->setFrameFormat(formatStack_.top().frame_);
@@ -747,24 +1560,113 @@ int PalayDocument::startBlock(lua_State *L)
     blockCursor.setCharFormat(formatStack_.top().char_);
     cursorStack_.push(blockCursor);
 
-    return 0;
+    return true;
+}
+
+bool PalayDocument::endBlock()
+{
+    if (cursorStack_.top().document() == doc_ || cursorStack_.top().document() == fragmentDoc_)
+        return fail("endBlock called with no matching call to startBlock()");
+
+    cursorStack_.pop();
+    return true;
+}
+
+/*!
+    Starts recording content into a fragment instead of the document.
+    Everything up to the matching endFragment() is kept to be inserted
+    any number of times with insertFragment().
+ */
+bool PalayDocument::startFragment()
+{
+    if (fragmentDoc_)
+        return fail("startFragment called while already recording a fragment");
+
+    fragmentDoc_ = new QTextDocument(this);
+    fragmentDoc_->setUndoRedoEnabled(!buildMode_);
+    fragmentDoc_->setDefaultFont(doc_->defaultFont());
+    fragmentDoc_->setDocumentMargin(0);
+
+    QTextCursor fragmentCursor(fragmentDoc_);
+    fragmentCursor.setBlockFormat(formatStack_.top().block_);
+    fragmentCursor.setBlockCharFormat(formatStack_.top().char_);
+    fragmentCursor.setCharFormat(formatStack_.top().char_);
+    cursorStack_.push(fragmentCursor);
+    return true;
 }
 
-int PalayDocument::endBlock(lua_State *L)
+/*!
+    Stops recording and returns a handle to the fragment for
+    insertFragment(), or 0 if no fragment was being recorded.
+ */
+int PalayDocument::endFragment()
 {
-    if (cursorStack_.top().document() == doc_)
-        luaL_error(L, "endBlock called with no matching call to startBlock()");
+    if (!fragmentDoc_ || cursorStack_.top().document() != fragmentDoc_) {
+        fail("endFragment called with no matching call to startFragment()");
+        return 0;
+    }
 
     cursorStack_.pop();
-    return 0;
+    fragments_ << QTextDocumentFragment(fragmentDoc_);
+    delete fragmentDoc_;
+    fragmentDoc_ = 0;
+
+    return fragments_.size();
+}
+
+/*!
+    Inserts a recorded fragment at the cursor. \a substitutions maps
+    text to replace in the fragment to its replacement, e.g. "$NAME" to
+    "Jane Doe". Replacements keep the format of the text they replace.
+    Longer keys are replaced first, so "$NAME" doesn't replace the start
+    of "$NAME_FULL".
+ */
+bool PalayDocument::insertFragment(int handle, const QMap<QString, QString> &substitutions)
+{
+    if (handle < 1 || handle > fragments_.size())
+        return fail(QString("Invalid fragment %1").arg(handle));
+    const QTextDocumentFragment &fragment = fragments_.at(handle - 1);
+
+    if (substitutions.isEmpty()) {
+        cursorStack_.top().insertFragment(fragment);
+        return true;
+    }
+
+    QTextDocument scratch;
+    scratch.setUndoRedoEnabled(false);
+    QTextCursor(&scratch).insertFragment(fragment);
+
+    QStringList keys = substitutions.keys();
+    qStableSort(keys.begin(), keys.end(), isLonger);
+    foreach (const QString &key, keys) {
+        if (key.isEmpty())
+            continue;
+        const QString value = substitutions.value(key);
+        QTextCursor found = scratch.find(key, 0, QTextDocument::FindCaseSensitively);
+        while (!found.isNull()) {
+            found.insertText(value);
+            found = scratch.find(key, found, QTextDocument::FindCaseSensitively);
+        }
+    }
+
+    cursorStack_.top().insertFragment(QTextDocumentFragment(&scratch));
+    return true;
+}
+
+bool PalayDocument::fail(const QString &error)
+{
+    errorString_ = error;
+    return false;
 }
 
-void PalayDocument::setFontStyle(lua_State *L, QTextCharFormat &format, int index)
+bool PalayDocument::setFontStyle(const QVariant &value, QTextCharFormat &format)
 {
-    QString styleString = luaL_checkstring(L, index);
-    QStringList styles = QString(styleString).split(whitespaceOrComma);
+    if (!isString(value))
+        return fail("Invalid value for font_style. Must be a string.");
+    QString styleString = value.toString();
+    QStringList styles = styleString.split(whitespaceOrComma);
     if (styles.isEmpty())
-        luaL_error(L, "\"%s\" is not a valid font style. Try a comma or space seperated list of values like: \"Bold,Italic\" or \"Bold Underline\"", qPrintable(styleString));
+        return fail(QString("\"%1\" is not a valid font style. Try a comma or space seperated list of values like: \"Bold,Italic\" or \"Bold Underline\"").arg(styleString));
     format.setFontWeight(QFont::Normal);
     format.setFontItalic(false);
     format.setFontUnderline(false);
@@ -776,67 +1678,72 @@ void PalayDocument::setFontStyle(lua_State *L, QTextCharFormat &format, int inde
         else if (s.compare("Underline", Qt::CaseInsensitive) == 0)
             format.setFontUnderline(true);
         else if (s.compare("Normal", Qt::CaseInsensitive) != 0) {
-            luaL_error(L, "\"%s\" is not a valid font style. Try \"Normal\", \"Bold\", \"Italic\", \"Underline\" or a combination thereof.", qPrintable(s));
+            return fail(QString("\"%1\" is not a valid font style. Try \"Normal\", \"Bold\", \"Italic\", \"Underline\" or a combination thereof.").arg(s));
         }
     }
+    return true;
 }
 
-QTextFrameFormat::BorderStyle PalayDocument::getBorderStyle(lua_State *L, int index)
+bool PalayDocument::getBorderStyle(const QVariant &value, QTextFrameFormat::BorderStyle *borderStyle)
 {
-    const char* style = luaL_checkstring(L, index);
-    if (qstricmp(style, "None") == 0)
-        return QTextFrameFormat::BorderStyle_None;
-    else if (qstricmp(style, "Dotted") == 0)
-        return QTextFrameFormat::BorderStyle_Dotted;
-    else if (qstricmp(style, "Dashed") == 0)
-        return QTextFrameFormat::BorderStyle_Dashed;
-    else if (qstricmp(style, "Solid") == 0)
-        return QTextFrameFormat::BorderStyle_Solid;
+    if (!isString(value))
+        return fail("Invalid value for border_style.");
+    const QString style = value.toString();
+    if (style.compare("None", Qt::CaseInsensitive) == 0)
+        *borderStyle = QTextFrameFormat::BorderStyle_None;
+    else if (style.compare("Dotted", Qt::CaseInsensitive) == 0)
+        *borderStyle = QTextFrameFormat::BorderStyle_Dotted;
+    else if (style.compare("Dashed", Qt::CaseInsensitive) == 0)
+        *borderStyle = QTextFrameFormat::BorderStyle_Dashed;
+    else if (style.compare("Solid", Qt::CaseInsensitive) == 0)
+        *borderStyle = QTextFrameFormat::BorderStyle_Solid;
     else
-        return (QTextFrameFormat::BorderStyle) luaL_error(L, "Invalid value for border_style.");
-}
-
-QColor PalayDocument::getColor(lua_State *L, int index)
-{
-    index = index > 0 ? index : lua_gettop(L) + index + 1;
-    if (lua_type(L, index) == LUA_TSTRING) {
-        const char* colorName = lua_tostring(L, index);
-        QColor color(colorName);
-        if (!color.isValid())
-            luaL_error(L, "\"%s\" is not a valid color.", colorName);
-        return color;
-    } else if (lua_type(L, index) == LUA_TNUMBER) {
-        const int colorValue = lua_tointeger(L, index);
-        QColor color(colorValue);
-        if (!color.isValid())
-            luaL_error(L, "%d is not a valid color value.", colorValue);
-        return color;
-    } else if (lua_type(L, index) == LUA_TTABLE) {
-        luaL_checktype(L, index, LUA_TTABLE);
-        size_t len = lua_rawlen(L, index);
-        if (len < 3 || len > 4)
-            luaL_error(L, "Invalid number of entries in color array. Must be an array of 3 (RGB) or 4 (RGBA) numbers.");
+        return fail("Invalid value for border_style.");
+    return true;
+}
+
+/*!
+    Colors are a name or #rrggbb string, an integer 0xrrggbb or a list
+    of 3 (RGB) or 4 (RGBA) numbers.
+ */
+bool PalayDocument::getColor(const QVariant &value, QColor *color)
+{
+    qreal number;
+    if (value.type() == QVariant::String || value.type() == QVariant::ByteArray) {
+        const QString colorName = value.toString();
+        *color = QColor(colorName);
+        if (!color->isValid())
+            return fail(QString("\"%1\" is not a valid color.").arg(colorName));
+    } else if (isNumber(value, &number)) {
+        const int colorValue = int(number);
+        *color = QColor(QRgb(colorValue));
+        if (!color->isValid())
+            return fail(QString("%1 is not a valid color value.").arg(colorValue));
+    } else if (value.type() == QVariant::List) {
+        const QVariantList list = value.toList();
+        if (list.size() < 3 || list.size() > 4)
+            return fail("Invalid number of entries in color array. Must be an array of 3 (RGB) or 4 (RGBA) numbers.");
         int rgba[] = {0, 0, 0, 255};
-        for (size_t i = 1; i <= len; ++i) {
-            lua_pushnumber(L, i);
-            lua_gettable(L, -2);
-            if (!lua_isnumber(L, -1))
-                luaL_error(L, "Invalid value in color array. Must be numeric.");
-            rgba[i - 1] = lua_tonumber(L, -1);
-            lua_pop(L,1);
+        for (int i = 0; i < list.size(); ++i) {
+            if (!isNumber(list.at(i), &number))
+                return fail("Invalid value in color array. Must be numeric.");
+            rgba[i] = int(number);
         }
-        return QColor(rgba[0], rgba[1], rgba[2], rgba[3]);
-    }  else {
-        return luaL_error(L, "Invalid color. Must be a string, integer array or integer.");
+        *color = QColor(rgba[0], rgba[1], rgba[2], rgba[3]);
+    } else {
+        return fail("Invalid color. Must be a string, integer array or integer.");
     }
+    return true;
 }
 
-Qt::Alignment PalayDocument::getAlignment(lua_State *L, int index)
+bool PalayDocument::getAlignment(const QVariant &value, Qt::Alignment *alignment)
 {
-    QString alignment = luaL_checkstring(L, index);
-    QStringList alignments = QString(alignment).split(whitespaceOrComma);
-    if (alignment.isEmpty())
-        luaL_error(L, "\"%s\" is not a valid alignment. Try a comma or space seperated list of values like: \"Top Left\" or \"Top,HCenter\"", qPrintable(alignment));
+    if (!isString(value))
+        return fail("Invalid value for alignment. Must be a string.");
+    QString alignmentString = value.toString();
+    QStringList alignments = alignmentString.split(whitespaceOrComma);
+    if (alignmentString.isEmpty())
+        return fail(QString("\"%1\" is not a valid alignment. Try a comma or space seperated list of values like: \"Top Left\" or \"Top,HCenter\"").arg(alignmentString));
     Qt::Alignment result = 0;
     foreach (QString a, alignments) {
         if (a.compare("Left", Qt::CaseInsensitive) == 0)
@@ -851,41 +1758,50 @@ Qt::Alignment PalayDocument::getAlignment(lua_State *L, int index)
             result |= Qt::AlignBottom;
         else if (a.compare("VCenter", Qt::CaseInsensitive) == 0)
             result |= Qt::AlignVCenter;
-        else if (a.compare("Right", Qt::CaseInsensitive) == 0)
-            result |= Qt::AlignRight;
         else
-            luaL_error(L, "\"%s\" is not a value for alignment. Try \"Left\", \"Right\", \"HCenter\", \"Top\", \"Bottom\" or ", qPrintable(a));
+            return fail(QString("\"%1\" is not a value for alignment. Try \"Left\", \"Right\", \"HCenter\", \"Top\", \"Bottom\" or \"VCenter\"").arg(a));
     }
 
-    return result;
+    *alignment = result;
+    return true;
 }
 
-Qt::Corner PalayDocument::getCorner(lua_State *L, int index)
+/*!
+    Lengths for the width and height styles are a number of points,
+    "page" for the whole page, "inside_page" for the page inside the
+    margins or "variable" to fit the content.
+ */
+bool PalayDocument::getLength(const char *name, const QVariant &value, bool horizontal, QTextLength *length)
 {
-    const char *cornerString = luaL_checkstring(L, index);
-    if (qstricmp(cornerString, "TopLeft") == 0)
-        return Qt::TopLeftCorner;
-    else if (qstricmp(cornerString, "TopRight") == 0)
-        return Qt::TopRightCorner;
-    else if (qstricmp(cornerString, "BottomLeft") == 0)
-        return Qt::BottomLeftCorner;
-    else if (qstricmp(cornerString, "BottomRight") == 0)
-        return Qt::BottomRightCorner;
-    else
-        return (Qt::Corner) luaL_error(L, "%s is not a valid corner. Try \"TopLeft\", \"TopRight\", \"BottomLeft\" or \"BottomRight\"", qPrintable(cornerString));
+    qreal number;
+    const QString lengthString = value.toString();
+    QTextFrameFormat rootFormat = doc_->rootFrame()->frameFormat();
+    if (isNumber(value, &number) && number >= 0) {
+        *length = QTextLength(QTextLength::FixedLength, horizontal ? pointsToDotsX(number) : pointsToDotsY(number));
+    } else if (isString(value) && lengthString.compare("variable", Qt::CaseInsensitive) == 0) {
+        *length = QTextLength();
+    } else if (isString(value) && lengthString.compare("page", Qt::CaseInsensitive) == 0) {
+        *length = QTextLength(QTextLength::FixedLength, horizontal ? doc_->pageSize().width() : doc_->pageSize().height());
+    } else if (isString(value) && lengthString.compare("inside_page", Qt::CaseInsensitive) == 0) {
+        qreal dots = horizontal ?
+                    doc_->pageSize().width() - rootFormat.leftMargin() - rootFormat.rightMargin() :
+                    doc_->pageSize().height() - rootFormat.topMargin() - rootFormat.bottomMargin();
+        *length = QTextLength(QTextLength::FixedLength, dots);
+    } else {
+        return fail(QString("Invalid value for %1. Must be a positive number, \"page\", \"inside_page\", or \"variable\".").arg(name));
+    }
+    return true;
 }
 
-void PalayDocument::setPageSize(QPrinter::PaperSize size)
+void PalayDocument::applyPageSize()
 {
-    printer_.setPaperSize(size);
-
     // Need to set document page size to match printer page size so that document
     // gets paginated and the pageCount() method will work correctly.
     doc_->setPageSize(QSizeF(printer_.pageRect(QPrinter::Inch).width() * qt_defaultDpiX(),
                              printer_.pageRect(QPrinter::Inch).height() * qt_defaultDpiY()));
 }
 
-void PalayDocument::setPageMargins(float left, float top, float right, float bottom)
+void PalayDocument::applyPageMargins(float left, float top, float right, float bottom)
 {
     QTextFrameFormat rootFormat = doc_->rootFrame()->frameFormat();
     rootFormat.setLeftMargin(left);
@@ -895,27 +1811,73 @@ void PalayDocument::setPageMargins(float left, float top, float right, float bot
     doc_->rootFrame()->setFrameFormat(rootFormat);
 }
 
-void PalayDocument::insertBitmapImage(lua_State *L, const QString &filename, float widthPts, float heightPts)
+/*!
+    Build mode is for documents that are built once and printed: undo history
+    is turned off, the main document is edited inside one edit block so that
+    the layout is not told about every insertion, and the formats from style()
+    are interned so that equal styles share one format. It is off by default
+    and has to be turned on before the document is built.
+ */
+void PalayDocument::setBuildMode(bool enabled)
+{
+    if (enabled == buildMode_)
+        return;
+    buildMode_ = enabled;
+
+    doc_->setUndoRedoEnabled(!enabled);
+    foreach (AbsoluteBlock *block, absoluteBlocks_)
+        block->document()->setUndoRedoEnabled(!enabled);
+
+    if (enabled) {
+        buildCursor_.beginEditBlock();
+        internFormats();
+    } else {
+        buildCursor_.endEditBlock();
+        charFormats_.clear();
+        blockFormats_.clear();
+    }
+}
+
+void PalayDocument::internFormats()
 {
-    // Filename - load as a bitmap
-    QImage im;
-    if (!im.load(filename))
-        luaL_error(L, "Failed to load image from file %s", qPrintable(filename));
+    intern(charFormats_, formatStack_.top().char_);
+    intern(blockFormats_, formatStack_.top().block_);
+}
 
-    BitmapTextObject *bitmapTextFormatInterface = new BitmapTextObject(im, pointsToDotsX(widthPts), pointsToDotsX(heightPts));
+QSizeF PalayDocument::insertBitmapImage(const QString &filename, float widthPts, float heightPts)
+{
+    // Filename - only the header is read now. The image is decoded in
+    // the thread pool while the script goes on, if the images decoded
+    // ahead leave room for it, otherwise once its section ends (see
+    // registerHandlers()).
+    BitmapTextObject *bitmapTextFormatInterface = new BitmapTextObject(filename, widthPts, heightPts, this);
+    if (!bitmapTextFormatInterface->isValid()) {
+        delete bitmapTextFormatInterface;
+        fail(QString("Failed to load image from file %1").arg(filename));
+        return QSizeF();
+    }
+    bitmapTextFormatInterface->setDraft(draft_);
+    bitmapTextFormatInterface->setMaxDpi(imageDpi_);
+    bitmapTextFormatInterface->startDecode();
 
     LayoutHandler lh;
     lh.component = bitmapTextFormatInterface;
     lh.cursor = cursorStack_.top();
     lh.position = lh.cursor.position();
+    lh.filename = QFileInfo(filename).absoluteFilePath();
     layoutHandlers_.append(lh);
+
+    return bitmapTextFormatInterface->size();
 }
 
-void PalayDocument::insertSvgImage(lua_State *L, const QByteArray &svgContents, float widthPts, float heightPts)
+QSizeF PalayDocument::insertSvgImage(const QByteArray &svgContents, float widthPts, float heightPts)
 {
     SvgVectorTextObject *svgTextFormatInterface = new SvgVectorTextObject(svgContents, widthPts, heightPts, this);
-    if (!svgTextFormatInterface->isValid())
-        luaL_error(L, "Error parsing SVG");
+    if (!svgTextFormatInterface->isValid()) {
+        delete svgTextFormatInterface;
+        fail("Error parsing SVG");
+        return QSizeF();
+    }
 
     // Inserting the images inline here is amazingly slow, so defer the insertion
     // to just before printing. This cuts pdf generation time by 50% or more. The
@@ -926,25 +1888,149 @@ void PalayDocument::insertSvgImage(lua_State *L, const QByteArray &svgContents,
     lh.component = svgTextFormatInterface;
     lh.cursor = cursorStack_.top();
     lh.position = lh.cursor.position();
+    lh.svgContents = svgContents;
     layoutHandlers_.append(lh);
+
+    return svgTextFormatInterface->size();
 }
 
 void PalayDocument::print()
 {
-    QPainter painter(&printer_);
+    // Nothing is laid out until the edit block ends
+    if (buildMode_)
+        buildCursor_.endEditBlock();
+
+    // Starting pages and finishing the file is the writing phase,
+    // everything else is nested inside it.
+    RenderStats::Scope writing(stats_, RenderStats::Write);
+    PALAY_TRACE_SCOPE("render", "print");
+    if (!painter_)
+        startPainting();
+
+    // Once the page range is painted the rest are only freed
+    while (!pendingSections_.isEmpty())
+        paintPendingSection();
+
+    // A script that ends with section() leaves an empty section, which
+    // would otherwise be painted as a blank last page
+    if (pagesPrinted_ == 0 || !doc_->isEmpty() || !absoluteBlocks_.isEmpty() || !layoutHandlers_.isEmpty()) {
+        Section current = currentSection();
+        registerHandlers(current);
+        paintSection(current);
+    }
+
+    PALAY_TRACE_SCOPE("write", "finish");
+    painter_->end();
+    delete painter_;
+    painter_ = 0;
+    pageOffset_ = 0;
+    pageNumberOffset_ = 0;
+
+    // Draft output lowers the resolution for this file only
+    printer_.setResolution(printerResolution_);
+
+    if (buildMode_)
+        buildCursor_.beginEditBlock();
+}
+
+/*!
+    Opens the painter on the printer. It stays open while sections are
+    painted, until print() paints the last one and finishes the file.
+ */
+void PalayDocument::startPainting()
+{
+    if (draft_)
+        printer_.setResolution(draftResolution);
+    pagesPrinted_ = 0;
+    paintedCounts_.clear();
+
+    delete writer_;
+    writer_ = 0;
+    if (directPdf_ && printer_.outputFormat() == QPrinter::PdfFormat) {
+        writer_ = new PdfWriter(printer_.outputFileName());
+        writer_->setPageSize(printer_.paperRect(QPrinter::Point).size());
+        writer_->setResolution(printer_.resolution());
+        writer_->setCompressionLevel(compressionLevel_);
+        writer_->setCreationDate(creationDate_);
+        writer_->setPipelined(pipelined_);
+    }
+
+    painter_ = new QPainter(paintDevice());
 
     // Scale to printer dpi
-    const qreal dpiScaleX = qreal(printer_.logicalDpiX()) / qt_defaultDpiX();
-    const qreal dpiScaleY = qreal(printer_.logicalDpiY()) / qt_defaultDpiY();
-    painter.scale(dpiScaleX, dpiScaleY);
-    qreal pageWidth = doc_->pageSize().width();
-    qreal pageHeight = doc_->pageSize().height();
+    const qreal dpiScaleX = qreal(paintDevice()->logicalDpiX()) / qt_defaultDpiX();
+    const qreal dpiScaleY = qreal(paintDevice()->logicalDpiY()) / qt_defaultDpiY();
+    painter_->scale(dpiScaleX, dpiScaleY);
+}
+
+/*!
+    Returns what the pages are painted on: the PdfWriter if there is one,
+    otherwise the printer.
+ */
+QPaintDevice *PalayDocument::paintDevice()
+{
+    if (writer_)
+        return writer_;
+    return &printer_;
+}
+
+void PalayDocument::startNewPage()
+{
+    if (writer_)
+        writer_->newPage();
+    else
+        printer_.newPage();
+}
+
+/*!
+    Returns true if writing the pages painted so far failed.
+ */
+bool PalayDocument::writeFailed() const
+{
+    if (writer_)
+        return writer_->hasError();
+    return printer_.printerState() == QPrinter::Error;
+}
 
+/*!
+    Returns the section being built. It shares the document, absolute
+    blocks and images with this object.
+ */
+PalayDocument::Section PalayDocument::currentSection() const
+{
+    Section section;
+    section.document = doc_;
+    section.absoluteBlocks = absoluteBlocks_;
+    section.layoutHandlers = layoutHandlers_;
+    section.layout = 0;
+    section.restartsPageNumbers = false;
+    return section;
+}
+
+/*!
+    Inserts the images of \a section into its documents. This has to be
+    done before the section is laid out.
+ */
+void PalayDocument::registerHandlers(Section &section)
+{
     // Deferred registration of layout handlers
+    stats_.enter(RenderStats::Register);
+#ifndef PALAY_NO_TRACE
+    const qint64 registerStart = Trace::isEnabled() ? Trace::now() : -1;
+#endif
     int objectType = QTextFormat::UserObject + 1;
-    for (QList<LayoutHandler>::iterator i = layoutHandlers_.begin();
-         i != layoutHandlers_.end();
+    for (QList<LayoutHandler>::iterator i = section.layoutHandlers.begin();
+         i != section.layoutHandlers.end();
          ++i, ++objectType) {
+        if (BitmapTextObject *bitmap = qobject_cast<BitmapTextObject*>(i->component)) {
+            // Decodes again if the settings changed since it was inserted
+            bitmap->setDraft(draft_);
+            bitmap->setMaxDpi(imageDpi_);
+            bitmap->startDecode();
+            section.bitmaps << bitmap;
+        } else if (SvgVectorTextObject *svg = qobject_cast<SvgVectorTextObject*>(i->component))
+            svg->setDraft(draft_);
+
         i->cursor.setPosition(i->position);
         i->cursor.document()->documentLayout()->registerHandler(objectType, i->component);
 
@@ -952,10 +2038,89 @@ void PalayDocument::print()
         format.setObjectType(objectType);
         i->cursor.insertText(QString(QChar::ObjectReplacementCharacter), format);
     }
+#ifndef PALAY_NO_TRACE
+    if (registerStart >= 0)
+        Trace::complete("render", "register", registerStart);
+#endif
+    stats_.leave();
+}
+
+/*!
+    Waits for \a section to be laid out and returns its number of pages.
+ */
+int PalayDocument::sectionPageCount(Section &section)
+{
+    RenderStats::Scope layout(stats_, RenderStats::Layout);
+    finishLayout(section);
+    return section.document->pageCount();
+}
+
+/*!
+    Waits for \a section to be laid out if it is being laid out in a
+    thread of its own, and takes its documents back.
+ */
+void PalayDocument::finishLayout(Section &section)
+{
+    if (!section.layout)
+        return;
+    static_cast<SectionLayout*>(section.layout)->finish();
+    delete section.layout;
+    section.layout = 0;
+}
+
+/*!
+    Paints the oldest pending section and frees it. Sections after the
+    end of the page range are freed without being laid out.
+ */
+void PalayDocument::paintPendingSection()
+{
+    Section section = pendingSections_.takeFirst();
+    if (lastPage_ == 0 || pageOffset_ < lastPage_) {
+        paintSection(section);
+
+        // Nothing after the end of the page range is painted, so a section
+        // that reaches it isn't laid out to the end to count its pages
+        const int lastInSection = lastPage_ - pageOffset_;
+        const int pages = lastPage_ > 0 && pageExists(section.document, lastInSection) ?
+                    lastInSection : sectionPageCount(section);
+        pageOffset_ += pages;
+        pageNumberOffset_ = section.restartsPageNumbers ? 0 : pageNumberOffset_ + pages;
+    } else {
+        finishLayout(section);
+    }
+
+    const QVariantMap counts = sectionCounts(section);
+    for (QVariantMap::const_iterator i = counts.constBegin(); i != counts.constEnd(); ++i)
+        paintedCounts_[i.key()] = paintedCounts_.value(i.key()).toInt() + i.value().toInt();
+    foreach (const LayoutHandler &handler, section.layoutHandlers)
+        delete handler.component;
+    qDeleteAll(section.absoluteBlocks);
+    delete section.document;
+}
 
-    QAbstractTextDocumentLayout *layout = doc_->documentLayout();
-    for (int pageNumber = 1; pageNumber <= doc_->pageCount(); ++pageNumber) {
+/*!
+    Paints the pages of \a section that are in the page range. Its images
+    must have been registered with registerHandlers().
+ */
+void PalayDocument::paintSection(Section &section)
+{
+    finishLayout(section);
+
+    QPainter &painter = *painter_;
+    qreal pageWidth = section.document->pageSize().width();
+    qreal pageHeight = section.document->pageSize().height();
+
+    // Page numbers in the page range count the pages of earlier sections
+    QAbstractTextDocumentLayout *layout = section.document->documentLayout();
+    for (int pageNumber = qMax(1, firstPage_ - pageOffset_); pageExists(section.document, pageNumber); ++pageNumber) {
+
+        if (pagesPrinted_ > 0) {
+            PALAY_TRACE_SCOPE("write", "newPage", pageOffset_ + pageNumber);
+            startNewPage();
+        }
 
+        RenderStats::Scope painting(stats_, RenderStats::Paint);
+        PALAY_TRACE_SCOPE("paint", "page", pageOffset_ + pageNumber);
         painter.save();
         QRect view(0, (pageNumber - 1) * pageHeight, pageWidth, pageHeight);
         painter.translate(0, -view.top());
@@ -965,19 +2130,43 @@ void PalayDocument::print()
 
         layout->draw(&painter, ctx);
 
-        drawAbsoluteBlocks(&painter, view);
+        drawAbsoluteBlocks(section.absoluteBlocks, &painter, view);
 
         painter.restore();
-        if (pageNumber != doc_->pageCount())
-            printer_.newPage();
+
+        // Release images that are not needed for the following pages
+        foreach (BitmapTextObject *bitmap, section.bitmaps)
+            bitmap->pageFinished();
+        ++pagesPrinted_;
     }
+}
 
-    painter.end();
+bool PalayDocument::pageExists(QTextDocument *document, int pageNumber)
+{
+    RenderStats::Scope layout(stats_, RenderStats::Layout);
+    PALAY_TRACE_SCOPE("layout", "pageExists", pageNumber);
+    if (lastPage_ == 0)
+        return pageNumber <= document->pageCount();
+    if (pageOffset_ + pageNumber > lastPage_)
+        return false;
+
+    // pageCount() lays out the entire document. When only a range of pages
+    // is wanted hit test the top of the page instead, which only lays out
+    // the document as far as that point. Anything after the block found there
+    // must start on this page or later.
+    QAbstractTextDocumentLayout *layout = document->documentLayout();
+    qreal pageTop = (pageNumber - 1) * document->pageSize().height();
+    QTextBlock block = document->findBlock(layout->hitTest(QPointF(0, pageTop), Qt::FuzzyHit));
+    if (!block.isValid())
+        return false;
+    if (block.next().isValid())
+        return true;
+    return layout->blockBoundingRect(block).bottom() > pageTop;
 }
 
-void PalayDocument::drawAbsoluteBlocks(QPainter *painter, const QRectF &view)
+void PalayDocument::drawAbsoluteBlocks(const QList<AbsoluteBlock*> &blocks, QPainter *painter, const QRectF &view)
 {
-    foreach (AbsoluteBlock *block, absoluteBlocks_) {
+    foreach (AbsoluteBlock *block, blocks) {
         QRectF blockBounds = block->bounds();
         if (view.intersects(blockBounds)) {
             block->draw(painter);
@@ -17,6 +17,7 @@
 #ifndef PALAYDOCUMENT_H
 #define PALAYDOCUMENT_H
 
+#include "libpalay_global.h"
 #include <QObject>
 #include <QTextDocument>
 #include <QTextBlockFormat>
@@ -24,57 +25,128 @@
 #include <QTextTableFormat>
 #include <QTextTableCellFormat>
 #include <QTextCursor>
+#include <QTextDocumentFragment>
 #include <QStack>
 #include <QPrinter>
+#include <QVariant>
+#include <QMap>
+#include <QHash>
+#include <QDateTime>
+#include <QStringList>
+#include "RenderStats.h"
 
-struct lua_State;
 class AbsoluteBlock;
+class QThread;
+class BitmapTextObject;
+class PdfWriter;
+class QTemporaryFile;
 
-class PalayDocument : public QObject
+class LIBPALAYSHARED_EXPORT PalayDocument : public QObject
 {
     Q_OBJECT
 public:
     explicit PalayDocument(QObject *parent = 0);
     ~PalayDocument();
 
-    int paragraph(lua_State *L);
-    int text(lua_State *L);
-    int style(lua_State *L);
-    int pushStyle(lua_State *L);
-    int popStyle(lua_State *L);
-    int saveAs(lua_State *L);
+    QString errorString() const;
+    static QByteArray buildId();
 
-    int startTable(lua_State *L);
-    int cell(lua_State *L);
-    int endTable(lua_State *L);
+    void paragraph(const QString &text);
+    void text(const QString &text);
+    bool style(const QVariantMap &style);
+    bool pushStyle(const QVariantMap &style = QVariantMap());
+    bool popStyle();
+    bool saveAs(const QString &filename);
+    void setCreationDate(const QDateTime &date);
+    void setDocumentId(const QByteArray &id);
+    QStringList referencedFiles() const;
+    bool saveSnapshot(const QString &filename);
+    bool loadSnapshot(const QString &filename);
 
-    int pageBreak(lua_State *L);
-    int image(lua_State *L);
-    int svg(lua_State *L);
-    int html(lua_State *L);
+    bool startTable(int rows, int columns);
+    bool cell(int row, int column, int rowSpan = 1, int columnSpan = 1);
+    bool endTable();
+    bool tableFromCsv(const QString &filename, const QVariantMap &options = QVariantMap());
 
-    int pageSize(lua_State *L);
-    int pageMargins(lua_State *L);
-    int getPageWidth(lua_State *L);
-    int getPageHeight(lua_State *L);
-    int getPageMargins(lua_State *L);
-    int getPageCount(lua_State *L);
+    void pageBreak();
+    bool image(const QString &filename, float widthPts = -1, float heightPts = -1, QSizeF *placedSize = 0);
+    bool svg(const QByteArray &svgContents, float widthPts = -1, float heightPts = -1, QSizeF *placedSize = 0);
+    void html(const QString &html);
 
-    int startBlock(lua_State *L);
-    int endBlock(lua_State *L);
+    bool setPageSize(const QString &name);
+    void setPageSize(QPrinter::PaperSize size);
+    void setPageMargins(qreal leftPts, qreal topPts, qreal rightPts, qreal bottomPts);
+    qreal pageWidth() const;
+    qreal pageHeight() const;
+    void pageMargins(qreal *leftPts, qreal *topPts, qreal *rightPts, qreal *bottomPts) const;
+    int pageCount();
+    int firstPageNumber();
+    bool section(bool restartPageNumbers = false);
+    bool setLayoutThreads(int threads);
+    void setPipelined(bool enabled);
+    bool setCompression(const QString &level);
+    void setDirectPdf(bool enabled);
+    bool setPageRange(int first, int last = 0);
+    void setDraftMode(bool draft);
+    bool setImageResolution(int dpi);
+    void setBuildMode(bool enabled);
+
+    bool startBlock(Qt::Corner corner, qreal xPts, qreal yPts);
+    bool endBlock();
+
+    bool startFragment();
+    int endFragment();
+    bool insertFragment(int handle, const QMap<QString, QString> &substitutions = QMap<QString, QString>());
+
+    QVariantMap statistics() const;
+    RenderStats &stats() { return stats_; }
 
 private:
-    void setFontStyle(lua_State *L, QTextCharFormat &format, int index);
-    QTextFrameFormat::BorderStyle getBorderStyle(lua_State *L, int index);
-    QColor getColor(lua_State *L, int index);
-    Qt::Alignment getAlignment(lua_State *L, int index);
-    Qt::Corner getCorner(lua_State *L, int index);
-    void setPageSize(QPrinter::PaperSize size);
-    void setPageMargins(float left, float top, float right, float bottom);
-    void insertBitmapImage(lua_State *L, const QString &filename, float widthPts, float heightPts);
-    void insertSvgImage(lua_State *L, const QByteArray &svgContents, float widthPts, float heightPts);
+    bool fail(const QString &error);
+    bool setFontStyle(const QVariant &value, QTextCharFormat &format);
+    bool getBorderStyle(const QVariant &value, QTextFrameFormat::BorderStyle *borderStyle);
+    bool getColor(const QVariant &value, QColor *color);
+    bool getAlignment(const QVariant &value, Qt::Alignment *alignment);
+    bool getLength(const char *name, const QVariant &value, bool horizontal, QTextLength *length);
+    void applyPageSize();
+    void applyPageMargins(float left, float top, float right, float bottom);
+    void internFormats();
+    QSizeF insertBitmapImage(const QString &filename, float widthPts, float heightPts);
+    QSizeF insertSvgImage(const QByteArray &svgContents, float widthPts, float heightPts);
+
+    struct LayoutHandler {
+        QObject *component;
+        QTextCursor cursor;
+        int position;
+        QString filename;       // absolute path of a bitmap, for snapshots
+        QByteArray svgContents;
+    };
+
+    // A document with its absolute blocks and images, painted as a unit
+    struct Section {
+        QTextDocument *document;
+        QList<AbsoluteBlock*> absoluteBlocks;
+        QList<LayoutHandler> layoutHandlers;
+        QList<BitmapTextObject*> bitmaps;   // set by registerHandlers()
+        QThread *layout;                    // when laid out in a thread of its own
+        bool restartsPageNumbers;           // the next section is numbered from 1
+    };
+
     void print();
-    void drawAbsoluteBlocks(QPainter *painter, const QRectF &view);
+    void startPainting();
+    QPaintDevice *paintDevice();
+    void startNewPage();
+    bool writeFailed() const;
+    bool checkCompression();
+    Section currentSection() const;
+    void registerHandlers(Section &section);
+    int sectionPageCount(Section &section);
+    void finishLayout(Section &section);
+    void paintPendingSection();
+    void paintSection(Section &section);
+    QVariantMap sectionCounts(const Section &section) const;
+    bool pageExists(QTextDocument *document, int pageNumber);
+    void drawAbsoluteBlocks(const QList<AbsoluteBlock*> &blocks, QPainter *painter, const QRectF &view);
 
     void dump();
 
@@ -91,12 +163,34 @@ private:
     QPrinter printer_;
     QList<AbsoluteBlock*> absoluteBlocks_;
     QStack<Formats> formatStack_;
-
-    struct LayoutHandler {
-        QObject *component;
-        QTextCursor cursor;
-        int position;
-    };
+    QString errorString_;
+    int firstPage_;
+    int lastPage_;  // 0 means print to the end of the document
+    bool draft_;
+    int printerResolution_;     // restored after draft output
+    int imageDpi_;  // 0 embeds images at full resolution
+    int pagesPrinted_;
+    bool buildMode_;
+    QTextCursor buildCursor_;   // holds the edit block open in build mode
+    QMultiHash<uint, QTextCharFormat> charFormats_;     // by formatHash()
+    QMultiHash<uint, QTextBlockFormat> blockFormats_;
+    QTextDocument *fragmentDoc_;    // non-null while a fragment is being recorded
+    QList<QTextDocumentFragment> fragments_;
+    RenderStats stats_;
+    QDateTime creationDate_;    // invalid means the current time
+    QByteArray documentId_;
+    QStringList referencedFiles_;
+    QPainter *painter_;             // open while sections are being painted
+    QTemporaryFile *sectionFile_;   // sections painted before saveAs()
+    int pageOffset_;                // pages in the sections already painted
+    int pageNumberOffset_;          // of those, pages since numbering restarted
+    QVariantMap paintedCounts_;     // sectionCounts() of those sections
+    QList<Section> pendingSections_;    // finished but not painted yet
+    int layoutThreads_;
+    bool pipelined_;
+    int compressionLevel_;      // zlib level of the streams in PDFs
+    bool directPdf_;            // write PDFs with PdfWriter instead of QPrinter
+    PdfWriter *writer_;         // the open PdfWriter when directPdf_
     QList<LayoutHandler> layoutHandlers_;
 };
 
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "PdfCompressor.h"
+#include "Trace.h"
+#include <QList>
+#include <QtConcurrentMap>
+
+/*!
+    \class PdfCompressor
+    \brief The PdfCompressor class deflates PDF streams in the thread pool.
+
+    PdfWriter compresses the streams of each page with compress(), which
+    spreads them across the global thread pool at the level given, instead
+    of one after another at zlib's default level like Qt's PDF engine.
+ */
+
+namespace {
+
+    struct Deflate
+    {
+        typedef QByteArray result_type;
+
+        explicit Deflate(int level) : level_(level) {}
+
+        QByteArray operator()(const QByteArray &data) const
+        {
+            PALAY_TRACE_SCOPE("write", "deflate");
+            return PdfCompressor::deflate(data, level_);
+        }
+
+        int level_;
+    };
+
+}
+
+/*!
+    Returns \a data as a zlib stream, the format of the FlateDecode
+    filter, compressed at \a level from 0 to 9 or -1 for zlib's default.
+ */
+QByteArray PdfCompressor::deflate(const QByteArray &data, int level)
+{
+    // qCompress() puts the uncompressed size in front of the zlib stream
+    return qCompress(data, level).mid(4);
+}
+
+/*!
+    Returns \a streams deflated at \a level, spread across the global
+    thread pool. The streams have to be independent of each other.
+ */
+QList<QByteArray> PdfCompressor::compress(const QList<QByteArray> &streams, int level)
+{
+    if (streams.size() == 1)
+        return QList<QByteArray>() << deflate(streams.first(), level);
+    return QtConcurrent::blockingMapped<QList<QByteArray> >(streams, Deflate(level));
+}
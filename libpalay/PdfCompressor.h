@@ -0,0 +1,38 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef PDFCOMPRESSOR_H
+#define PDFCOMPRESSOR_H
+
+#include <QByteArray>
+#include <QList>
+
+class PdfCompressor
+{
+public:
+    // zlib compression levels
+    enum Level {
+        FastLevel = 1,
+        DefaultLevel = 6,
+        MaxLevel = 9
+    };
+
+    static QByteArray deflate(const QByteArray &data, int level);
+    static QList<QByteArray> compress(const QList<QByteArray> &streams, int level);
+};
+
+#endif // PDFCOMPRESSOR_H
@@ -0,0 +1,140 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "PdfMetadata.h"
+#include <QFile>
+#include <QCryptographicHash>
+
+/*!
+    \class PdfMetadata
+    \brief The PdfMetadata class replaces the creation date and file ID that Qt writes in PDFs.
+
+    Qt writes the current time as the creation date and, in Qt 5, a random
+    file ID, so rendering the same document twice gives different files.
+    rewrite() replaces them so that output can be compared and cached by
+    content. The fields are overwritten in place with text of the same
+    length so the cross reference table stays valid.
+ */
+
+namespace {
+
+    const char hexDigits[] = "0123456789abcdef";
+
+    bool isHexDigit(char c)
+    {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+    }
+
+    // Returns the range of the hex strings in the /ID array, or false
+    // if there is no /ID.
+    bool findId(const QByteArray &pdf, int *start, int *end)
+    {
+        int id = pdf.lastIndexOf("/ID");
+        while (id >= 0) {
+            int i = id + 3;
+            while (i < pdf.size() && (pdf.at(i) == ' ' || pdf.at(i) == '\n' || pdf.at(i) == '\r'))
+                ++i;
+            if (i < pdf.size() && pdf.at(i) == '[') {
+                const int close = pdf.indexOf(']', i);
+                if (close < 0)
+                    return false;
+                *start = i + 1;
+                *end = close;
+                return true;
+            }
+            id = id > 0 ? pdf.lastIndexOf("/ID", id - 1) : -1;
+        }
+        return false;
+    }
+
+}
+
+/*!
+    Rewrites the PDF \a filename in place. See the other overload.
+ */
+bool PdfMetadata::rewrite(const QString &filename, const QDateTime &creationDate, const QByteArray &idSeed)
+{
+    QFile file(filename);
+    if (!file.open(QFile::ReadWrite))
+        return false;
+    QByteArray pdf = file.readAll();
+    if (!rewrite(pdf, creationDate, idSeed))
+        return true;
+    return file.seek(0) && file.write(pdf) == pdf.size();
+}
+
+/*!
+    Sets the creation date in \a pdf to \a creationDate if it is valid and
+    sets the file ID to a hash of \a idSeed, or of the contents of the file if
+    \a idSeed is empty. Returns true if anything was changed.
+ */
+bool PdfMetadata::rewrite(QByteArray &pdf, const QDateTime &creationDate, const QByteArray &idSeed)
+{
+    bool changed = false;
+
+    if (creationDate.isValid()) {
+        const int key = pdf.lastIndexOf("/CreationDate (");
+        const int start = key < 0 ? -1 : key + int(sizeof("/CreationDate (")) - 1;
+        const int end = start < 0 ? -1 : pdf.indexOf(')', start);
+        if (end > start) {
+            // D:YYYYMMDDHHmmSS followed by UTC in the same form as the
+            // original time zone: none (Qt 4), Z or +hh'mm' (Qt 5)
+            QByteArray date = "D:" + creationDate.toUTC().toString("yyyyMMddhhmmss").toLatin1();
+            const QByteArray utcZones[] = { "Z", "+00'00'" };
+            const int zoneLength = end - start - date.size();
+            for (size_t i = 0; zoneLength > 0 && i < sizeof(utcZones) / sizeof(utcZones[0]); ++i) {
+                if (utcZones[i].size() == zoneLength) {
+                    date += utcZones[i];
+                    break;
+                }
+            }
+            if (date.size() == end - start) {
+                pdf.replace(start, date.size(), date);
+                changed = true;
+            }
+        }
+    }
+
+    int idStart;
+    int idEnd;
+    if (findId(pdf, &idStart, &idEnd)) {
+        // Hash the file with the old ID blanked so the ID only depends
+        // on the content
+        for (int i = idStart; i < idEnd; ++i) {
+            if (isHexDigit(pdf.at(i)))
+                pdf[i] = '0';
+        }
+        QByteArray hash = QCryptographicHash::hash(idSeed.isEmpty() ? pdf : idSeed, QCryptographicHash::Sha1);
+        int digit = 0;
+        bool inString = false;
+        for (int i = idStart; i < idEnd; ++i) {
+            const char c = pdf.at(i);
+            if (c == '<') {
+                inString = true;
+            } else if (c == '>') {
+                inString = false;
+            } else if (inString && isHexDigit(c)) {
+                const uchar byte = hash.at((digit / 2) % hash.size());
+                pdf[i] = hexDigits[digit % 2 == 0 ? byte >> 4 : byte & 0xf];
+                ++digit;
+            }
+        }
+        changed = true;
+    }
+
+    return changed;
+}
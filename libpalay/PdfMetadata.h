@@ -0,0 +1,32 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef PDFMETADATA_H
+#define PDFMETADATA_H
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QString>
+
+class PdfMetadata
+{
+public:
+    static bool rewrite(const QString &filename, const QDateTime &creationDate, const QByteArray &idSeed);
+    static bool rewrite(QByteArray &pdf, const QDateTime &creationDate, const QByteArray &idSeed);
+};
+
+#endif // PDFMETADATA_H
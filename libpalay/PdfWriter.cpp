@@ -0,0 +1,1780 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "PdfWriter.h"
+#include "PdfCompressor.h"
+#include "ImagePreprocessor.h"
+#include "Trace.h"
+#include <QFile>
+#include <QHash>
+#include <QMap>
+#include <QSet>
+#include <QVector>
+#include <QFuture>
+#include <QtConcurrentRun>
+#include <QImage>
+#include <QPixmap>
+#include <QPainter>
+#include <QPainterPath>
+#include <QRawFont>
+#include <QTextLayout>
+#include <QGlyphRun>
+#include <QCryptographicHash>
+#include <QtAlgorithms>
+#include <qmath.h>
+
+/*!
+    \class PdfWriter
+    \brief The PdfWriter class is a paint device that writes PDF files directly.
+
+    It is a lean alternative to QPrinter for PalayDocument::saveAs(). Pages
+    are written to the file as soon as they are finished, so only the page
+    being painted is kept in memory. Fonts, images and transparency states
+    are written once and shared by all pages through a single resource
+    dictionary. Everything that isn't a stream (pages, fonts and so on)
+    is packed into compressed object streams with a cross reference stream,
+    which needs PDF 1.5. The streams of each page are compressed in the
+    thread pool at the level set with setCompressionLevel(). When
+    pipelined, they are also written there while the next page is painted.
+
+    Text is written with the TrueType fonts Qt lays it out with, subset
+    to the glyphs used. JPEG and JPEG 2000 images can be embedded without
+    being decoded with drawEncodedImage().
+
+    The paint engine only supports what palay draws: solid pens and brushes,
+    constant opacity, clipping, images and left to right text. QPainter
+    draws anything else, like gradients, into an image first. Right to left
+    text and fonts that aren't TrueType are drawn as outlines.
+ */
+
+namespace {
+
+    // Objects in each object stream
+    const int objectsPerStream = 100;
+
+    void appendReal(QByteArray &out, qreal value)
+    {
+        if (qAbs(value) < 0.0005) {
+            out += '0';
+            return;
+        }
+        // Drop the trailing zeros and the point
+        const QByteArray number = QByteArray::number(value, 'f', 3);
+        int end = number.size();
+        while (number.at(end - 1) == '0')
+            --end;
+        if (number.at(end - 1) == '.')
+            --end;
+        out.append(number.constData(), end);
+    }
+
+    void appendPoint(QByteArray &out, const QPointF &point)
+    {
+        appendReal(out, point.x());
+        out += ' ';
+        appendReal(out, point.y());
+        out += ' ';
+    }
+
+    void appendColor(QByteArray &out, const QColor &color)
+    {
+        appendReal(out, color.redF());
+        out += ' ';
+        appendReal(out, color.greenF());
+        out += ' ';
+        appendReal(out, color.blueF());
+        out += ' ';
+    }
+
+    void appendHex16(QByteArray &out, quint32 value)
+    {
+        const char digits[] = "0123456789ABCDEF";
+        out += digits[(value >> 12) & 0xf];
+        out += digits[(value >> 8) & 0xf];
+        out += digits[(value >> 4) & 0xf];
+        out += digits[value & 0xf];
+    }
+
+    QByteArray reference(int object)
+    {
+        return QByteArray::number(object) + " 0 R";
+    }
+
+    // Appends the path with its subpaths closed by "h" so that strokes join
+    void appendPath(QByteArray &out, const QPainterPath &path)
+    {
+        QPointF start;
+        for (int i = 0; i < path.elementCount(); ++i) {
+            const QPainterPath::Element &element = path.elementAt(i);
+            switch (element.type) {
+            case QPainterPath::MoveToElement:
+                start = element;
+                appendPoint(out, element);
+                out += "m\n";
+                break;
+            case QPainterPath::LineToElement:
+                appendPoint(out, element);
+                out += "l\n";
+                if (QPointF(element) == start &&
+                        (i + 1 == path.elementCount() || path.elementAt(i + 1).type == QPainterPath::MoveToElement))
+                    out += "h\n";
+                break;
+            case QPainterPath::CurveToElement:
+                appendPoint(out, element);
+                appendPoint(out, path.elementAt(i + 1));
+                appendPoint(out, path.elementAt(i + 2));
+                out += "c\n";
+                i += 2;
+                break;
+            case QPainterPath::CurveToDataElement:
+                break;
+            }
+        }
+    }
+
+    // Big endian values in font tables
+    quint16 readU16(const QByteArray &data, int offset)
+    {
+        if (offset < 0 || offset + 2 > data.size())
+            return 0;
+        const uchar *p = reinterpret_cast<const uchar *>(data.constData()) + offset;
+        return (p[0] << 8) | p[1];
+    }
+
+    qint16 readS16(const QByteArray &data, int offset)
+    {
+        return qint16(readU16(data, offset));
+    }
+
+    quint32 readU32(const QByteArray &data, int offset)
+    {
+        return (quint32(readU16(data, offset)) << 16) | readU16(data, offset + 2);
+    }
+
+    void appendU16(QByteArray &out, quint16 value)
+    {
+        out += char(value >> 8);
+        out += char(value);
+    }
+
+    void appendU32(QByteArray &out, quint32 value)
+    {
+        appendU16(out, value >> 16);
+        appendU16(out, value);
+    }
+
+    void writeU32(QByteArray &data, int offset, quint32 value)
+    {
+        data[offset] = char(value >> 24);
+        data[offset + 1] = char(value >> 16);
+        data[offset + 2] = char(value >> 8);
+        data[offset + 3] = char(value);
+    }
+
+    quint32 tableChecksum(const QByteArray &table)
+    {
+        quint32 sum = 0;
+        for (int i = 0; i < table.size(); i += 4)
+            sum += (quint32(uchar(table.at(i))) << 24) |
+                   (i + 1 < table.size() ? quint32(uchar(table.at(i + 1))) << 16 : 0) |
+                   (i + 2 < table.size() ? quint32(uchar(table.at(i + 2))) << 8 : 0) |
+                   (i + 3 < table.size() ? quint32(uchar(table.at(i + 3))) : 0);
+        return sum;
+    }
+
+    quint32 glyphOffset(const QByteArray &loca, bool longFormat, int glyph)
+    {
+        return longFormat ? readU32(loca, 4 * glyph) : 2 * quint32(readU16(loca, 2 * glyph));
+    }
+
+    // Returns a cmap table with one Unicode subtable that maps nothing.
+    // PDF text uses glyph numbers, but some readers and validators want
+    // the table to be there.
+    QByteArray emptyCmap()
+    {
+        QByteArray cmap;
+        appendU16(cmap, 0);         // version
+        appendU16(cmap, 1);         // number of subtables
+        appendU16(cmap, 3);         // Windows
+        appendU16(cmap, 1);         // Unicode BMP
+        appendU32(cmap, 12);        // offset of the subtable
+        appendU16(cmap, 4);         // format 4 with just the final segment
+        appendU16(cmap, 24);        // length
+        appendU16(cmap, 0);         // language
+        appendU16(cmap, 2);         // segCountX2
+        appendU16(cmap, 2);         // searchRange
+        appendU16(cmap, 0);         // entrySelector
+        appendU16(cmap, 0);         // rangeShift
+        appendU16(cmap, 0xffff);    // endCode
+        appendU16(cmap, 0);         // reservedPad
+        appendU16(cmap, 0xffff);    // startCode
+        appendU16(cmap, 1);         // idDelta
+        appendU16(cmap, 0);         // idRangeOffset
+        return cmap;
+    }
+
+    // Returns a TrueType font with the tables a PDF needs and only the
+    // outlines of \a glyphs and the glyphs they are made of. Glyph numbers
+    // stay the same so the font can be used with an identity mapping.
+    QByteArray subsetTrueType(const QRawFont &font, const QSet<quint32> &glyphs)
+    {
+        QByteArray head = font.fontTable("head");
+        const QByteArray loca = font.fontTable("loca");
+        const QByteArray glyf = font.fontTable("glyf");
+        const int numGlyphs = readU16(font.fontTable("maxp"), 4);
+        const bool longLoca = readS16(head, 50) == 1;
+
+        QSet<quint32> kept;
+        QList<quint32> queue = glyphs.toList();
+        while (!queue.isEmpty()) {
+            const quint32 glyph = queue.takeFirst();
+            if (int(glyph) >= numGlyphs || kept.contains(glyph))
+                continue;
+            kept.insert(glyph);
+
+            // Composite glyphs are made of other glyphs
+            const int start = glyphOffset(loca, longLoca, glyph);
+            const int end = glyphOffset(loca, longLoca, glyph + 1);
+            if (end - start < 10 || end > glyf.size() || readS16(glyf, start) >= 0)
+                continue;
+            int pos = start + 10;
+            quint16 flags;
+            do {
+                flags = readU16(glyf, pos);
+                queue << readU16(glyf, pos + 2);
+                pos += 4 + ((flags & 0x1) ? 4 : 2);
+                if (flags & 0x8)
+                    pos += 2;
+                else if (flags & 0x40)
+                    pos += 4;
+                else if (flags & 0x80)
+                    pos += 8;
+            } while ((flags & 0x20) && pos + 4 <= end);
+        }
+
+        QByteArray newGlyf;
+        QByteArray newLoca;
+        for (int glyph = 0; glyph < numGlyphs; ++glyph) {
+            appendU32(newLoca, newGlyf.size());
+            const int start = glyphOffset(loca, longLoca, glyph);
+            const int end = glyphOffset(loca, longLoca, glyph + 1);
+            if (kept.contains(glyph) && end > start && end <= glyf.size()) {
+                newGlyf += glyf.mid(start, end - start);
+                while (newGlyf.size() % 4)
+                    newGlyf += '\0';
+            }
+        }
+        appendU32(newLoca, newGlyf.size());
+
+        // The checksum adjustment is set when the font is complete and
+        // the new loca table is in the long format
+        writeU32(head, 8, 0);
+        head[50] = 0;
+        head[51] = 1;
+
+        // Tables in tag order
+        QMap<QByteArray, QByteArray> tables;
+        const char *copied[] = { "OS/2", "cvt ", "fpgm", "prep", "hhea", "hmtx", "maxp" };
+        for (size_t i = 0; i < sizeof(copied) / sizeof(copied[0]); ++i) {
+            const QByteArray table = font.fontTable(copied[i]);
+            if (!table.isEmpty())
+                tables.insert(copied[i], table);
+        }
+
+        // Version 3 of post has the metrics without the glyph names
+        QByteArray post = font.fontTable("post").left(32);
+        if (post.size() == 32) {
+            writeU32(post, 0, 0x00030000);
+            tables.insert("post", post);
+        }
+        tables.insert("cmap", emptyCmap());
+        tables.insert("glyf", newGlyf);
+        tables.insert("head", head);
+        tables.insert("loca", newLoca);
+
+        const int count = tables.size();
+        int entrySelector = 0;
+        while ((2 << entrySelector) <= count)
+            ++entrySelector;
+        const int searchRange = (1 << entrySelector) * 16;
+
+        QByteArray out;
+        appendU32(out, 0x00010000);
+        appendU16(out, count);
+        appendU16(out, searchRange);
+        appendU16(out, entrySelector);
+        appendU16(out, count * 16 - searchRange);
+        int offset = 12 + 16 * count;
+        int headOffset = 0;
+        for (QMap<QByteArray, QByteArray>::const_iterator i = tables.constBegin(); i != tables.constEnd(); ++i) {
+            out += i.key();
+            appendU32(out, tableChecksum(i.value()));
+            appendU32(out, offset);
+            appendU32(out, i.value().size());
+            if (i.key() == "head")
+                headOffset = offset;
+            offset += (i.value().size() + 3) & ~3;
+        }
+        foreach (QByteArray table, tables) {
+            while (table.size() % 4)
+                table += '\0';
+            out += table;
+        }
+        writeU32(out, headOffset + 8, 0xb1b0afba - tableChecksum(out));
+        return out;
+    }
+
+    // Returns the PostScript name of the font or one made from its family
+    // and style, with only characters that can be in a PDF name
+    QByteArray postScriptName(const QRawFont &font)
+    {
+        QString name;
+        const QByteArray table = font.fontTable("name");
+        const int count = readU16(table, 2);
+        const int strings = readU16(table, 4);
+        for (int i = 0; i < count && name.isEmpty(); ++i) {
+            const int record = 6 + 12 * i;
+            if (readU16(table, record + 6) != 6)
+                continue;
+            const int platform = readU16(table, record);
+            const QByteArray value = table.mid(strings + readU16(table, record + 10), readU16(table, record + 8));
+            if (platform == 0 || platform == 3) {
+                for (int j = 0; j + 1 < value.size(); j += 2)
+                    name += QChar(readU16(value, j));
+            } else {
+                name = QString::fromLatin1(value);
+            }
+        }
+        if (name.isEmpty())
+            name = font.familyName() + '-' + font.styleName();
+
+        QByteArray result;
+        foreach (QChar c, name) {
+            if (c.unicode() > ' ' && c.unicode() < 127 && !QByteArray("()<>[]{}/%#").contains(c.toLatin1()))
+                result += c.toLatin1();
+        }
+        return result.isEmpty() ? QByteArray("Font") : result;
+    }
+
+    // Reads the size and number of color components of a JPEG from
+    // its start of frame marker. Adobe JPEGs store CMYK inverted.
+    bool readJpegInfo(const QByteArray &data, int *width, int *height, int *components, bool *adobe)
+    {
+        *adobe = false;
+        if (readU16(data, 0) != 0xffd8)
+            return false;
+        int pos = 2;
+        while (pos + 4 <= data.size()) {
+            if (uchar(data.at(pos)) != 0xff)
+                return false;
+            const uchar marker = data.at(pos + 1);
+            if (marker == 0xff) {
+                ++pos;
+                continue;
+            }
+            const int length = readU16(data, pos + 2);
+            if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+                *height = readU16(data, pos + 5);
+                *width = readU16(data, pos + 7);
+                *components = pos + 9 < data.size() ? uchar(data.at(pos + 9)) : 0;
+                return *width > 0 && *height > 0 && *components > 0;
+            }
+            if (marker == 0xee && data.mid(pos + 4, 5) == "Adobe")
+                *adobe = true;
+            pos += 2 + length;
+        }
+        return false;
+    }
+
+    // Reads the size from the image header box of a JPEG 2000 file
+    bool readJp2Info(const QByteArray &data, int *width, int *height)
+    {
+        const int header = data.indexOf("ihdr");
+        if (header < 0 || header > 1024)
+            return false;
+        *height = readU32(data, header + 4);
+        *width = readU32(data, header + 8);
+        return *width > 0 && *height > 0;
+    }
+
+}
+
+class PdfPaintEngine : public QPaintEngine
+{
+public:
+    explicit PdfPaintEngine(PdfWriter *writer);
+
+    bool begin(QPaintDevice *device);
+    bool end();
+    void updateState(const QPaintEngineState &state);
+
+    using QPaintEngine::drawRects;
+    using QPaintEngine::drawLines;
+    using QPaintEngine::drawPolygon;
+    void drawPath(const QPainterPath &path);
+    void drawPolygon(const QPointF *points, int pointCount, PolygonDrawMode mode);
+    void drawRects(const QRectF *rects, int rectCount);
+    void drawLines(const QLineF *lines, int lineCount);
+    void drawPixmap(const QRectF &rect, const QPixmap &pixmap, const QRectF &sourceRect);
+    void drawImage(const QRectF &rect, const QImage &image, const QRectF &sourceRect,
+                   Qt::ImageConversionFlags flags = Qt::AutoColor);
+    void drawTextItem(const QPointF &p, const QTextItem &textItem);
+    Type type() const;
+
+    bool newPage();
+    bool hasError();
+    bool setEncodedImage(const QByteArray &data, const QByteArray &format);
+    void clearEncodedImage();
+
+private:
+    struct XrefEntry {
+        XrefEntry() : type(0), field2(0), field3(0) {}
+        int type;       // 0 free, 1 at offset field2, 2 number field3 in object stream field2
+        qint64 field2;
+        int field3;
+    };
+
+    struct PendingStream {
+        int object;
+        QByteArray dict;
+        QByteArray data;
+        bool compress;
+    };
+
+    // Where writeStreams() wrote each stream
+    struct WrittenStreams {
+        WrittenStreams() : error(false) {}
+        QList<int> objects;
+        QList<qint64> offsets;
+        bool error;
+    };
+
+    // An embedded font and the glyphs used from it
+    struct Font {
+        QRawFont rawFont;
+        int object;
+        int unitsPerEm;
+        QVector<quint16> widths;            // advance widths in font units
+        QMap<quint32, QString> glyphs;      // the text each glyph stands for
+    };
+
+    // A QFont and the embedded font it is drawn with, -1 if none
+    struct TextFont {
+        QRawFont rawFont;
+        int font;
+    };
+
+    void write(const QByteArray &data);
+    int allocate();
+    void addObject(int object, const QByteArray &body);
+    void flushObjectStream();
+    bool writeStreamObject(int object, const QByteArray &dict, const QByteArray &data, bool flate);
+    void writeStream(int object, const QByteArray &dict, const QByteArray &data, bool flate);
+    void queueStream(int object, const QByteArray &dict, const QByteArray &data, bool compress);
+    void flushStreams(bool background = false);
+    WrittenStreams writeStreams(const QList<PendingStream> &streams);
+    void recordStreams(const WrittenStreams &written);
+    void waitForStreams();
+
+    void startPage();
+    void finishPage();
+    void writeFonts();
+    void writeTrailer();
+
+    void updateClip(const QPainterPath &path, Qt::ClipOperation operation);
+    void setupGraphicsState();
+    void resetEmittedState();
+    void applyAlpha(qreal stroke, qreal fill);
+    void applyPen();
+    void applyFill(const QColor &color);
+    void paint(const QByteArray &path, bool fill, bool oddEven);
+
+    int imageObject(const QImage &image, const QRectF &sourceRect);
+    int encodedImageObject();
+    TextFont *textFont(const QFont &font);
+    QVector<quint32> glyphsForText(const QRawFont &rawFont, const QString &text);
+    QVector<qreal> textAdvances(const QFont &font, const QRawFont &rawFont, const QString &text,
+                                const QVector<quint32> &glyphs);
+
+    PdfWriter *writer_;
+    QFile file_;
+    bool error_;
+    int level_;
+    bool pipelined_;
+    qreal scale_;       // points per device pixel
+    QSizeF pageSize_;
+
+    QVector<XrefEntry> xref_;
+    QList<int> objectStreamObjects_;
+    QList<int> objectStreamOffsets_;
+    QByteArray objectStreamData_;
+    QList<PendingStream> pendingStreams_;
+    QFuture<WrittenStreams> streamsWritten_;    // the last page's streams when pipelined
+    bool writingStreams_;
+    int pagesObject_;
+    int resourcesObject_;
+    QList<int> pageObjects_;
+    QByteArray content_;
+
+    QHash<QString, int> images_;
+    QList<int> imageObjects_;
+    QHash<int, int> alphaStates_;
+    QList<Font> fonts_;
+    QHash<QString, int> fontIndexes_;
+    QHash<QString, TextFont> textFonts_;
+    QByteArray encodedImage_;
+    QByteArray encodedImageDict_;
+
+    // The painter's state
+    QTransform matrix_;
+    QPen pen_;
+    QBrush brush_;
+    qreal opacity_;
+    bool clipEnabled_;
+    QList<QPainterPath> clip_;      // in device coordinates, intersected
+
+    // What has been written to the page
+    bool clipOpen_;
+    bool matrixOpen_;
+    bool clipDirty_;
+    bool matrixDirty_;
+    int emittedAlpha_;
+    QByteArray emittedPen_;
+    QByteArray emittedFill_;
+};
+
+PdfPaintEngine::PdfPaintEngine(PdfWriter *writer) :
+    QPaintEngine(PrimitiveTransform | PixmapTransform | PainterPaths | AlphaBlend |
+                 Antialiasing | ConstantOpacity | PaintOutsidePaintEvent),
+    writer_(writer),
+    error_(false),
+    level_(PdfCompressor::DefaultLevel),
+    pipelined_(false),
+    writingStreams_(false),
+    scale_(1),
+    pagesObject_(0),
+    resourcesObject_(0),
+    opacity_(1),
+    clipEnabled_(false),
+    clipOpen_(false),
+    matrixOpen_(false),
+    clipDirty_(false),
+    matrixDirty_(false),
+    emittedAlpha_(0xffff)
+{
+}
+
+bool PdfPaintEngine::begin(QPaintDevice *device)
+{
+    Q_UNUSED(device);
+    error_ = false;
+    xref_.clear();
+    objectStreamObjects_.clear();
+    objectStreamOffsets_.clear();
+    objectStreamData_.clear();
+    pendingStreams_.clear();
+    pageObjects_.clear();
+    images_.clear();
+    imageObjects_.clear();
+    alphaStates_.clear();
+    fonts_.clear();
+    fontIndexes_.clear();
+    textFonts_.clear();
+    clearEncodedImage();
+    matrix_ = QTransform();
+    pen_ = QPen();
+    brush_ = QBrush();
+    opacity_ = 1;
+    clipEnabled_ = false;
+    clip_.clear();
+
+    file_.setFileName(writer_->fileName());
+    if (!file_.open(QFile::WriteOnly | QFile::Truncate)) {
+        error_ = true;
+        return false;
+    }
+    level_ = writer_->compressionLevel();
+    pipelined_ = writer_->isPipelined();
+    scale_ = 72.0 / writer_->resolution();
+    pageSize_ = writer_->pageSize();
+
+    // Object 0 is the head of the free list
+    allocate();
+    xref_[0].field3 = 0xffff;
+    write("%PDF-1.5\n%\xe2\xe3\xcf\xd3\n");
+    pagesObject_ = allocate();
+    resourcesObject_ = allocate();
+    startPage();
+    return true;
+}
+
+bool PdfPaintEngine::end()
+{
+    PALAY_TRACE_SCOPE("write", "finishPdf");
+    finishPage();
+    writeFonts();
+
+    QByteArray resources = "<< /ProcSet [/PDF /Text /ImageB /ImageC]";
+    if (!fonts_.isEmpty()) {
+        resources += " /Font <<";
+        foreach (const Font &font, fonts_)
+            resources += " /F" + QByteArray::number(font.object) + ' ' + reference(font.object);
+        resources += " >>";
+    }
+    if (!imageObjects_.isEmpty()) {
+        resources += " /XObject <<";
+        foreach (int image, imageObjects_)
+            resources += " /Im" + QByteArray::number(image) + ' ' + reference(image);
+        resources += " >>";
+    }
+    if (!alphaStates_.isEmpty()) {
+        resources += " /ExtGState <<";
+        foreach (int state, alphaStates_)
+            resources += " /GS" + QByteArray::number(state) + ' ' + reference(state);
+        resources += " >>";
+    }
+    resources += " >>";
+    addObject(resourcesObject_, resources);
+
+    QByteArray kids;
+    foreach (int page, pageObjects_)
+        kids += reference(page) + ' ';
+    addObject(pagesObject_, "<< /Type /Pages /Kids [" + kids.trimmed() + "] /Count " +
+              QByteArray::number(pageObjects_.size()) + " >>");
+
+    writeTrailer();
+    file_.close();
+    if (file_.error() != QFile::NoError)
+        error_ = true;
+    return !error_;
+}
+
+void PdfPaintEngine::updateState(const QPaintEngineState &state)
+{
+    const DirtyFlags flags = state.state();
+    if (flags & DirtyTransform) {
+        matrix_ = state.transform();
+        matrixDirty_ = true;
+    }
+    if (flags & DirtyPen)
+        pen_ = state.pen();
+    if (flags & DirtyBrush)
+        brush_ = state.brush();
+    if (flags & DirtyOpacity)
+        opacity_ = state.opacity();
+    if (flags & DirtyClipEnabled) {
+        clipEnabled_ = state.isClipEnabled();
+        clipDirty_ = true;
+    }
+    if (flags & DirtyClipPath)
+        updateClip(state.clipPath(), state.clipOperation());
+    if (flags & DirtyClipRegion) {
+        QPainterPath path;
+        path.addRegion(state.clipRegion());
+        updateClip(path, state.clipOperation());
+    }
+}
+
+/*!
+    QPainter passes a new clip in the coordinates of the transform at the
+    time, so it is kept in device coordinates.
+ */
+void PdfPaintEngine::updateClip(const QPainterPath &path, Qt::ClipOperation operation)
+{
+    clipDirty_ = true;
+    if (operation == Qt::NoClip) {
+        clip_.clear();
+        return;
+    }
+    const QPainterPath devicePath = matrix_.map(path);
+    if (operation == Qt::ReplaceClip || clip_.isEmpty()) {
+        clip_.clear();
+        clip_ << devicePath;
+    } else if (operation == Qt::IntersectClip) {
+        clip_ << devicePath;
+    } else {
+        // Qt 4's UniteClip
+        QPainterPath united = clip_.first();
+        for (int i = 1; i < clip_.size(); ++i)
+            united = united.intersected(clip_.at(i));
+        clip_.clear();
+        clip_ << united.united(devicePath);
+    }
+}
+
+/*!
+    Brings the clip and transform on the page up to date. The clip is set
+    inside one saved graphics state and the transform inside a second one,
+    so a new transform only restores the inner one and a new clip both.
+ */
+void PdfPaintEngine::setupGraphicsState()
+{
+    if (clipDirty_) {
+        if (matrixOpen_)
+            content_ += "Q\n";
+        if (clipOpen_)
+            content_ += "Q\n";
+        matrixOpen_ = false;
+        clipOpen_ = false;
+        if (clipEnabled_ && !clip_.isEmpty()) {
+            content_ += "q\n";
+            clipOpen_ = true;
+            foreach (const QPainterPath &path, clip_) {
+                if (path.isEmpty())
+                    content_ += "0 0 0 0 re\n";
+                else
+                    appendPath(content_, path);
+                content_ += path.fillRule() == Qt::OddEvenFill ? "W* n\n" : "W n\n";
+            }
+        }
+        resetEmittedState();
+        clipDirty_ = false;
+        matrixDirty_ = true;
+    }
+    if (matrixDirty_) {
+        if (matrixOpen_) {
+            content_ += "Q\n";
+            resetEmittedState();
+        }
+        content_ += "q\n";
+        matrixOpen_ = true;
+        if (!matrix_.isIdentity()) {
+            appendReal(content_, matrix_.m11());
+            content_ += ' ';
+            appendReal(content_, matrix_.m12());
+            content_ += ' ';
+            appendReal(content_, matrix_.m21());
+            content_ += ' ';
+            appendReal(content_, matrix_.m22());
+            content_ += ' ';
+            appendPoint(content_, QPointF(matrix_.dx(), matrix_.dy()));
+            content_ += "cm\n";
+        }
+        matrixDirty_ = false;
+    }
+}
+
+/*!
+    Forgets the colors and line style written since the last restore.
+ */
+void PdfPaintEngine::resetEmittedState()
+{
+    emittedAlpha_ = 0xffff;
+    emittedPen_.clear();
+    emittedFill_.clear();
+}
+
+/*!
+    Sets the stroke and fill alpha from 0 to 1 with a shared graphics
+    state for each combination.
+ */
+void PdfPaintEngine::applyAlpha(qreal stroke, qreal fill)
+{
+    const int key = (qRound(stroke * 255) << 8) | qRound(fill * 255);
+    if (key == emittedAlpha_)
+        return;
+    int state = alphaStates_.value(key);
+    if (!state) {
+        state = allocate();
+        QByteArray body = "<< /Type /ExtGState /CA ";
+        appendReal(body, (key >> 8) / 255.0);
+        body += " /ca ";
+        appendReal(body, (key & 0xff) / 255.0);
+        body += " >>";
+        addObject(state, body);
+        alphaStates_.insert(key, state);
+    }
+    content_ += "/GS" + QByteArray::number(state) + " gs\n";
+    emittedAlpha_ = key;
+}
+
+void PdfPaintEngine::applyPen()
+{
+    QByteArray pen;
+    appendColor(pen, pen_.color());
+    pen += "RG\n";
+
+    // Cosmetic pens are as wide on the device whatever the transform
+    qreal width = pen_.widthF();
+    const qreal determinant = qAbs(matrix_.determinant());
+    if (pen_.isCosmetic() && width > 0 && determinant > 0)
+        width /= qSqrt(determinant);
+    appendReal(pen, width);
+    pen += " w ";
+
+    switch (pen_.capStyle()) {
+    case Qt::RoundCap:
+        pen += "1 J ";
+        break;
+    case Qt::SquareCap:
+        pen += "2 J ";
+        break;
+    default:
+        pen += "0 J ";
+        break;
+    }
+    switch (pen_.joinStyle()) {
+    case Qt::RoundJoin:
+        pen += "1 j\n";
+        break;
+    case Qt::BevelJoin:
+        pen += "2 j\n";
+        break;
+    default:
+        // Qt measures the miter from the join, PDF across the whole miter
+        pen += "0 j ";
+        appendReal(pen, qMax(qreal(1), 2 * pen_.miterLimit()));
+        pen += " M\n";
+        break;
+    }
+
+    pen += '[';
+    if (pen_.style() != Qt::SolidLine) {
+        const qreal unit = width > 0 ? width : 1;
+        foreach (qreal dash, pen_.dashPattern()) {
+            appendReal(pen, dash * unit);
+            pen += ' ';
+        }
+    }
+    pen += "] ";
+    appendReal(pen, pen_.style() != Qt::SolidLine ? pen_.dashOffset() * (width > 0 ? width : 1) : 0);
+    pen += " d\n";
+
+    if (pen != emittedPen_) {
+        content_ += pen;
+        emittedPen_ = pen;
+    }
+}
+
+void PdfPaintEngine::applyFill(const QColor &color)
+{
+    QByteArray fill;
+    appendColor(fill, color);
+    fill += "rg\n";
+    if (fill != emittedFill_) {
+        content_ += fill;
+        emittedFill_ = fill;
+    }
+}
+
+/*!
+    Strokes the \a path operators with the pen and, if \a fill is true,
+    fills them with the brush.
+ */
+void PdfPaintEngine::paint(const QByteArray &path, bool fill, bool oddEven)
+{
+    const bool stroke = pen_.style() != Qt::NoPen;
+    fill = fill && brush_.style() != Qt::NoBrush;
+    if (!stroke && !fill)
+        return;
+
+    setupGraphicsState();
+    applyAlpha(stroke ? pen_.color().alphaF() * opacity_ : 1, fill ? brush_.color().alphaF() * opacity_ : 1);
+    if (stroke)
+        applyPen();
+    if (fill)
+        applyFill(brush_.color());
+    content_ += path;
+    if (stroke && fill)
+        content_ += oddEven ? "B*\n" : "B\n";
+    else if (fill)
+        content_ += oddEven ? "f*\n" : "f\n";
+    else
+        content_ += "S\n";
+}
+
+void PdfPaintEngine::drawPath(const QPainterPath &path)
+{
+    if (path.isEmpty())
+        return;
+    QByteArray operators;
+    appendPath(operators, path);
+    paint(operators, true, path.fillRule() == Qt::OddEvenFill);
+}
+
+void PdfPaintEngine::drawPolygon(const QPointF *points, int pointCount, PolygonDrawMode mode)
+{
+    if (pointCount < 2)
+        return;
+    QByteArray operators;
+    appendPoint(operators, points[0]);
+    operators += "m\n";
+    for (int i = 1; i < pointCount; ++i) {
+        appendPoint(operators, points[i]);
+        operators += "l\n";
+    }
+    if (mode != PolylineMode)
+        operators += "h\n";
+    paint(operators, mode != PolylineMode, mode == OddEvenMode);
+}
+
+void PdfPaintEngine::drawRects(const QRectF *rects, int rectCount)
+{
+    QByteArray operators;
+    for (int i = 0; i < rectCount; ++i) {
+        appendPoint(operators, rects[i].topLeft());
+        appendPoint(operators, QPointF(rects[i].width(), rects[i].height()));
+        operators += "re\n";
+    }
+    paint(operators, true, false);
+}
+
+void PdfPaintEngine::drawLines(const QLineF *lines, int lineCount)
+{
+    QByteArray operators;
+    for (int i = 0; i < lineCount; ++i) {
+        appendPoint(operators, lines[i].p1());
+        operators += "m\n";
+        appendPoint(operators, lines[i].p2());
+        operators += "l\n";
+    }
+    paint(operators, false, false);
+}
+
+void PdfPaintEngine::drawPixmap(const QRectF &rect, const QPixmap &pixmap, const QRectF &sourceRect)
+{
+    drawImage(rect, pixmap.toImage(), sourceRect);
+}
+
+/*!
+    Draws \a image, or the image given to setEncodedImage() instead if
+    there is one.
+ */
+void PdfPaintEngine::drawImage(const QRectF &rect, const QImage &image, const QRectF &sourceRect,
+                               Qt::ImageConversionFlags flags)
+{
+    Q_UNUSED(flags);
+    const int object = encodedImage_.isEmpty() ? imageObject(image, sourceRect) : encodedImageObject();
+    clearEncodedImage();
+    if (!object)
+        return;
+
+    setupGraphicsState();
+    applyAlpha(opacity_, opacity_);
+    // Image space is a unit square with the first row at the top
+    content_ += "q ";
+    appendReal(content_, rect.width());
+    content_ += " 0 0 ";
+    appendReal(content_, -rect.height());
+    content_ += ' ';
+    appendPoint(content_, rect.bottomLeft());
+    content_ += "cm /Im" + QByteArray::number(object) + " Do Q\n";
+}
+
+void PdfPaintEngine::drawTextItem(const QPointF &p, const QTextItem &textItem)
+{
+    if (pen_.style() == Qt::NoPen)
+        return;
+
+    // Anything that can't be written as text is drawn as outlines
+    const QString text = textItem.text();
+    TextFont *pdfFont = text.isEmpty() || (textItem.renderFlags() & QTextItem::RightToLeft) ? 0 : textFont(textItem.font());
+    const QVector<quint32> glyphs = pdfFont ? glyphsForText(pdfFont->rawFont, text) : QVector<quint32>();
+    if (glyphs.isEmpty()) {
+        QPaintEngine::drawTextItem(p, textItem);
+        return;
+    }
+
+    Font &font = fonts_[pdfFont->font];
+    const qreal size = pdfFont->rawFont.pixelSize();
+    const QVector<qreal> advances = textAdvances(textItem.font(), pdfFont->rawFont, text, glyphs);
+
+    // Justified text is wider than the advances, the extra goes into the
+    // spaces or, if there are none, between all the glyphs
+    qreal natural = 0;
+    int spaces = 0;
+    for (int i = 0; i < glyphs.size(); ++i) {
+        natural += advances.at(i);
+        if (text.at(i).isSpace())
+            ++spaces;
+    }
+    const qreal extra = textItem.width() - natural;
+    const qreal extraPerGap = spaces > 0 ? extra / spaces : (glyphs.size() > 1 ? extra / (glyphs.size() - 1) : 0);
+
+    setupGraphicsState();
+    applyAlpha(pen_.color().alphaF() * opacity_, pen_.color().alphaF() * opacity_);
+    applyFill(pen_.color());
+    content_ += "BT\n/F" + QByteArray::number(font.object) + ' ';
+    appendReal(content_, size);
+    content_ += " Tf\n1 0 0 -1 ";
+    appendPoint(content_, p);
+    content_ += "Tm\n[<";
+    for (int i = 0; i < glyphs.size(); ++i) {
+        const quint32 glyph = glyphs.at(i);
+        const bool space = text.at(i).isSpace();
+        appendHex16(content_, glyph);
+        if (!font.glyphs.contains(glyph))
+            font.glyphs.insert(glyph, space ? QString(" ") : QString(text.at(i)));
+        if (i + 1 == glyphs.size())
+            break;
+
+        // Move to where Qt put the next glyph, in thousandths of the size
+        qreal advance = advances.at(i);
+        if (spaces == 0 || space)
+            advance += extraPerGap;
+        const qreal width = int(glyph) < font.widths.size() ? font.widths.at(glyph) * 1000.0 / font.unitsPerEm : 0;
+        const qreal adjustment = width - advance * 1000 / size;
+        if (qAbs(adjustment) >= 0.05) {
+            content_ += '>';
+            content_ += QByteArray::number(adjustment, 'f', 1);
+            content_ += '<';
+        }
+    }
+    content_ += ">] TJ\nET\n";
+}
+
+QPaintEngine::Type PdfPaintEngine::type() const
+{
+    return Type(PdfWriter::EngineType);
+}
+
+bool PdfPaintEngine::newPage()
+{
+    if (!isActive())
+        return false;
+    finishPage();
+    startPage();
+    return !error_;
+}
+
+bool PdfPaintEngine::hasError()
+{
+    waitForStreams();
+    return error_;
+}
+
+/*!
+    Makes the next drawImage() embed \a data, a JPEG or JPEG 2000 file,
+    as is. Returns false if the file can't be read.
+ */
+bool PdfPaintEngine::setEncodedImage(const QByteArray &data, const QByteArray &format)
+{
+    int width;
+    int height;
+    QByteArray dict;
+    if (format == "jpeg" || format == "jpg") {
+        int components;
+        bool adobe;
+        if (!readJpegInfo(data, &width, &height, &components, &adobe) ||
+                (components != 1 && components != 3 && components != 4))
+            return false;
+        dict = QByteArray(" /ColorSpace ") + (components == 1 ? "/DeviceGray" : components == 3 ? "/DeviceRGB" : "/DeviceCMYK") +
+                " /BitsPerComponent 8 /Filter /DCTDecode";
+        if (components == 4 && adobe)
+            dict += " /Decode [1 0 1 0 1 0 1 0]";
+    } else if (format == "jp2") {
+        if (!readJp2Info(data, &width, &height))
+            return false;
+        dict = " /Filter /JPXDecode";
+    } else {
+        return false;
+    }
+    encodedImage_ = data;
+    encodedImageDict_ = "/Type /XObject /Subtype /Image /Width " + QByteArray::number(width) +
+            " /Height " + QByteArray::number(height) + dict;
+    return true;
+}
+
+void PdfPaintEngine::clearEncodedImage()
+{
+    encodedImage_.clear();
+    encodedImageDict_.clear();
+}
+
+void PdfPaintEngine::write(const QByteArray &data)
+{
+    if (file_.write(data) != data.size())
+        error_ = true;
+}
+
+int PdfPaintEngine::allocate()
+{
+    xref_.append(XrefEntry());
+    return xref_.size() - 1;
+}
+
+/*!
+    Adds an object that isn't a stream to the object stream being filled.
+ */
+void PdfPaintEngine::addObject(int object, const QByteArray &body)
+{
+    objectStreamObjects_ << object;
+    objectStreamOffsets_ << objectStreamData_.size();
+    objectStreamData_ += body;
+    objectStreamData_ += '\n';
+    if (objectStreamObjects_.size() >= objectsPerStream)
+        flushObjectStream();
+}
+
+void PdfPaintEngine::flushObjectStream()
+{
+    if (objectStreamObjects_.isEmpty())
+        return;
+    const int stream = allocate();
+    QByteArray data;
+    for (int i = 0; i < objectStreamObjects_.size(); ++i) {
+        XrefEntry &entry = xref_[objectStreamObjects_.at(i)];
+        entry.type = 2;
+        entry.field2 = stream;
+        entry.field3 = i;
+        data += QByteArray::number(objectStreamObjects_.at(i)) + ' ' + QByteArray::number(objectStreamOffsets_.at(i)) + ' ';
+    }
+    const int first = data.size();
+    data += objectStreamData_;
+    writeStream(stream, "/Type /ObjStm /N " + QByteArray::number(objectStreamObjects_.size()) +
+                " /First " + QByteArray::number(first), PdfCompressor::deflate(data, level_), true);
+    objectStreamObjects_.clear();
+    objectStreamOffsets_.clear();
+    objectStreamData_.clear();
+}
+
+/*!
+    Writes a stream object at the current position in the file and
+    returns false if that fails. \a data is already encoded, with deflate
+    if \a flate is true. It only touches the file, so writeStreams() can
+    call it in the thread pool.
+ */
+bool PdfPaintEngine::writeStreamObject(int object, const QByteArray &dict, const QByteArray &data, bool flate)
+{
+    QByteArray header = QByteArray::number(object) + " 0 obj\n<< " + dict;
+    if (flate)
+        header += " /Filter /FlateDecode";
+    header += " /Length " + QByteArray::number(data.size()) + " >>\nstream\n";
+    const QByteArray trailer("\nendstream\nendobj\n");
+    return file_.write(header) == header.size() &&
+            file_.write(data) == data.size() &&
+            file_.write(trailer) == trailer.size();
+}
+
+/*!
+    Writes a stream object to the file after the streams being written
+    in the background.
+ */
+void PdfPaintEngine::writeStream(int object, const QByteArray &dict, const QByteArray &data, bool flate)
+{
+    waitForStreams();
+    xref_[object].type = 1;
+    xref_[object].field2 = file_.pos();
+    if (!writeStreamObject(object, dict, data, flate))
+        error_ = true;
+}
+
+/*!
+    Queues a stream to be written by flushStreams(), which compresses
+    all the queued streams at the same time.
+ */
+void PdfPaintEngine::queueStream(int object, const QByteArray &dict, const QByteArray &data, bool compress)
+{
+    PendingStream stream;
+    stream.object = object;
+    stream.dict = dict;
+    stream.data = data;
+    stream.compress = compress;
+    pendingStreams_ << stream;
+}
+
+/*!
+    Writes the queued streams. If \a background is true, they are written
+    in the thread pool and the next call to waitForStreams() records where.
+ */
+void PdfPaintEngine::flushStreams(bool background)
+{
+    waitForStreams();
+    if (background) {
+        streamsWritten_ = QtConcurrent::run(this, &PdfPaintEngine::writeStreams, pendingStreams_);
+        writingStreams_ = true;
+    } else {
+        recordStreams(writeStreams(pendingStreams_));
+    }
+    pendingStreams_.clear();
+}
+
+/*!
+    Compresses \a streams and writes them to the file. Nothing but the
+    file is touched, so the next page can be painted at the same time.
+ */
+PdfPaintEngine::WrittenStreams PdfPaintEngine::writeStreams(const QList<PendingStream> &streams)
+{
+    PALAY_TRACE_SCOPE("write", "streams", streams.size());
+    QList<QByteArray> uncompressed;
+    foreach (const PendingStream &stream, streams) {
+        if (stream.compress)
+            uncompressed << stream.data;
+    }
+    const QList<QByteArray> compressed = uncompressed.isEmpty() ? uncompressed : PdfCompressor::compress(uncompressed, level_);
+    WrittenStreams written;
+    int next = 0;
+    foreach (const PendingStream &stream, streams) {
+        written.objects << stream.object;
+        written.offsets << file_.pos();
+        if (!writeStreamObject(stream.object, stream.dict, stream.compress ? compressed.at(next++) : stream.data, stream.compress))
+            written.error = true;
+    }
+    return written;
+}
+
+void PdfPaintEngine::recordStreams(const WrittenStreams &written)
+{
+    for (int i = 0; i < written.objects.size(); ++i) {
+        xref_[written.objects.at(i)].type = 1;
+        xref_[written.objects.at(i)].field2 = written.offsets.at(i);
+    }
+    if (written.error)
+        error_ = true;
+}
+
+/*!
+    Waits for the streams being written in the background, if any.
+ */
+void PdfPaintEngine::waitForStreams()
+{
+    if (!writingStreams_)
+        return;
+    writingStreams_ = false;
+    recordStreams(streamsWritten_.result());
+}
+
+/*!
+    Starts the content of a page with a transform from device pixels,
+    with y down, to PDF points, with y up.
+ */
+void PdfPaintEngine::startPage()
+{
+    content_.clear();
+    appendReal(content_, scale_);
+    content_ += " 0 0 ";
+    appendReal(content_, -scale_);
+    content_ += " 0 ";
+    appendReal(content_, pageSize_.height());
+    content_ += " cm\n";
+    clipOpen_ = false;
+    matrixOpen_ = false;
+    clipDirty_ = true;
+    matrixDirty_ = true;
+    resetEmittedState();
+}
+
+/*!
+    Writes the page with its content and the images first drawn on it.
+ */
+void PdfPaintEngine::finishPage()
+{
+    PALAY_TRACE_SCOPE("write", "flushPage", pageObjects_.size() + 1);
+    if (matrixOpen_)
+        content_ += "Q\n";
+    if (clipOpen_)
+        content_ += "Q\n";
+    matrixOpen_ = false;
+    clipOpen_ = false;
+
+    const int contents = allocate();
+    const int page = allocate();
+    queueStream(contents, QByteArray(), content_, true);
+    QByteArray mediaBox;
+    appendPoint(mediaBox, QPointF(pageSize_.width(), pageSize_.height()));
+    addObject(page, "<< /Type /Page /Parent " + reference(pagesObject_) + " /MediaBox [0 0 " + mediaBox.trimmed() +
+              "] /Resources " + reference(resourcesObject_) + " /Contents " + reference(contents) + " >>");
+    pageObjects_ << page;
+    flushStreams(pipelined_);
+    content_.clear();
+}
+
+/*!
+    Writes each font as a Type 0 font with its TrueType program subset
+    to the glyphs used, their widths and a map to Unicode for copying
+    and searching text.
+ */
+void PdfPaintEngine::writeFonts()
+{
+    foreach (const Font &font, fonts_) {
+        QSet<quint32> glyphs = font.glyphs.keys().toSet();
+        glyphs.insert(0);
+        const QByteArray program = subsetTrueType(font.rawFont, glyphs);
+
+        // Subsets are named with a tag of six capital letters
+        QList<quint32> sorted = glyphs.toList();
+        qSort(sorted);
+        uint hash = font.object;
+        foreach (quint32 glyph, sorted)
+            hash = hash * 31 + glyph;
+        QByteArray name;
+        for (int i = 0; i < 6; ++i, hash /= 26)
+            name += char('A' + hash % 26);
+        name += '+' + postScriptName(font.rawFont);
+
+        const QByteArray head = font.rawFont.fontTable("head");
+        const QByteArray hhea = font.rawFont.fontTable("hhea");
+        const QByteArray post = font.rawFont.fontTable("post");
+        const QByteArray os2 = font.rawFont.fontTable("OS/2");
+        const qreal unit = 1000.0 / font.unitsPerEm;
+        const qreal italicAngle = post.size() >= 8 ? readS16(post, 4) + readU16(post, 6) / 65536.0 : 0;
+
+        // sCapHeight is in version 2 and later of the OS/2 table
+        const int capHeight = readU16(os2, 0) >= 2 && os2.size() >= 90 ? readS16(os2, 88) : readS16(hhea, 4);
+
+        const int descendant = allocate();
+        const int descriptor = allocate();
+        const int file = allocate();
+        const int toUnicode = allocate();
+
+        queueStream(file, "/Length1 " + QByteArray::number(program.size()), program, true);
+
+        QByteArray descriptorBody = "<< /Type /FontDescriptor /FontName /" + name +
+                " /Flags " + QByteArray::number(italicAngle != 0 ? 4 | 64 : 4) + " /FontBBox [";
+        for (int i = 0; i < 4; ++i) {
+            appendReal(descriptorBody, readS16(head, 36 + 2 * i) * unit);
+            descriptorBody += i < 3 ? " " : "]";
+        }
+        descriptorBody += " /ItalicAngle ";
+        appendReal(descriptorBody, italicAngle);
+        descriptorBody += " /Ascent ";
+        appendReal(descriptorBody, readS16(hhea, 4) * unit);
+        descriptorBody += " /Descent ";
+        appendReal(descriptorBody, readS16(hhea, 6) * unit);
+        descriptorBody += " /CapHeight ";
+        appendReal(descriptorBody, capHeight * unit);
+        descriptorBody += " /StemV 80 /FontFile2 " + reference(file) + " >>";
+        addObject(descriptor, descriptorBody);
+
+        // Widths of runs of consecutive glyphs
+        QByteArray widths;
+        quint32 previous = 0;
+        for (int i = 0; i < sorted.size(); ++i) {
+            const quint32 glyph = sorted.at(i);
+            if (i == 0 || glyph != previous + 1)
+                widths += (i == 0 ? "" : "] ") + QByteArray::number(glyph) + " [";
+            else
+                widths += ' ';
+            appendReal(widths, int(glyph) < font.widths.size() ? font.widths.at(glyph) * unit : 0);
+            previous = glyph;
+        }
+        widths += ']';
+        addObject(descendant, "<< /Type /Font /Subtype /CIDFontType2 /BaseFont /" + name +
+                  " /CIDSystemInfo << /Registry (Adobe) /Ordering (Identity) /Supplement 0 >>"
+                  " /FontDescriptor " + reference(descriptor) + " /W [" + widths + "] /CIDToGIDMap /Identity >>");
+
+        QByteArray cmap = "/CIDInit /ProcSet findresource begin\n"
+                "12 dict begin\n"
+                "begincmap\n"
+                "/CIDSystemInfo << /Registry (Adobe) /Ordering (UCS) /Supplement 0 >> def\n"
+                "/CMapName /Adobe-Identity-UCS def\n"
+                "/CMapType 2 def\n"
+                "1 begincodespacerange\n<0000> <FFFF>\nendcodespacerange\n";
+        const QList<quint32> mapped = font.glyphs.keys();
+        for (int i = 0; i < mapped.size(); i += 100) {
+            const int count = qMin(100, mapped.size() - i);
+            cmap += QByteArray::number(count) + " beginbfchar\n";
+            for (int j = i; j < i + count; ++j) {
+                cmap += '<';
+                appendHex16(cmap, mapped.at(j));
+                cmap += "> <";
+                foreach (QChar c, font.glyphs.value(mapped.at(j)))
+                    appendHex16(cmap, c.unicode());
+                cmap += ">\n";
+            }
+            cmap += "endbfchar\n";
+        }
+        cmap += "endcmap\n"
+                "CMapName currentdict /CMapResource defineresource pop\n"
+                "end\n"
+                "end\n";
+        queueStream(toUnicode, QByteArray(), cmap, true);
+
+        addObject(font.object, "<< /Type /Font /Subtype /Type0 /BaseFont /" + name +
+                  " /Encoding /Identity-H /DescendantFonts [" + reference(descendant) +
+                  "] /ToUnicode " + reference(toUnicode) + " >>");
+    }
+    flushStreams();
+}
+
+/*!
+    Writes the catalog, the last object stream, the document information
+    and the cross reference stream. The creation date and file ID are
+    outside the compressed streams so PdfMetadata can replace them.
+ */
+void PdfPaintEngine::writeTrailer()
+{
+    const int catalog = allocate();
+    addObject(catalog, "<< /Type /Catalog /Pages " + reference(pagesObject_) + " >>");
+    flushObjectStream();
+
+    const QDateTime date = writer_->creationDate().isValid() ? writer_->creationDate() : QDateTime::currentDateTime();
+    const QByteArray dateString = "D:" + date.toUTC().toString("yyyyMMddhhmmss").toLatin1() + "Z";
+    const int info = allocate();
+    xref_[info].type = 1;
+    xref_[info].field2 = file_.pos();
+    write(QByteArray::number(info) + " 0 obj\n<< /Producer (palay) /CreationDate (" + dateString + ") >>\nendobj\n");
+
+    const int xref = allocate();
+    xref_[xref].type = 1;
+    xref_[xref].field2 = file_.pos();
+
+    // The cross reference stream is the last object, so its offset is the
+    // largest and sets how many bytes the offsets need
+    int offsetBytes = 1;
+    while (offsetBytes < 8 && (quint64(xref_[xref].field2) >> (8 * offsetBytes)) != 0)
+        ++offsetBytes;
+    QByteArray rows;
+    foreach (const XrefEntry &entry, xref_) {
+        rows += char(entry.type);
+        for (int shift = 8 * (offsetBytes - 1); shift >= 0; shift -= 8)
+            rows += char(quint64(entry.field2) >> shift);
+        appendU16(rows, entry.field3);
+    }
+    const QByteArray id = QCryptographicHash::hash(writer_->fileName().toUtf8() + dateString +
+                                                   QByteArray::number(file_.pos()), QCryptographicHash::Md5).toHex();
+    const qint64 xrefOffset = xref_[xref].field2;
+    writeStream(xref, "/Type /XRef /Size " + QByteArray::number(xref_.size()) + " /W [1 " + QByteArray::number(offsetBytes) + " 2] /Root " + reference(catalog) +
+                " /Info " + reference(info) + " /ID [<" + id + "> <" + id + ">]", PdfCompressor::deflate(rows, level_), true);
+    write("startxref\n" + QByteArray::number(xrefOffset) + "\n%%EOF\n");
+}
+
+/*!
+    Returns the image object for the \a sourceRect part of \a image,
+    writing it the first time. Opaque gray images are written with one
+    channel and transparent ones, gray or not, as RGB with a soft mask.
+ */
+int PdfPaintEngine::imageObject(const QImage &image, const QRectF &sourceRect)
+{
+    const QRect source = sourceRect.toAlignedRect() & image.rect();
+    const QString key = QString("%1:%2,%3,%4,%5").arg(image.cacheKey())
+            .arg(source.x()).arg(source.y()).arg(source.width()).arg(source.height());
+    int object = images_.value(key);
+    if (object)
+        return object;
+
+    QImage part = source == image.rect() ? image : image.copy(source);
+    if (part.isNull())
+        return 0;
+    const QByteArray size = "/Width " + QByteArray::number(part.width()) + " /Height " + QByteArray::number(part.height());
+
+    QByteArray data;
+    QByteArray colorSpace;
+    int softMask = 0;
+    if (part.format() == QImage::Format_Indexed8 && part.isGrayscale() && !part.hasAlphaChannel()) {
+        // Go through the palette in case it isn't in order
+        const QVector<QRgb> colors = part.colorTable();
+        uchar levels[256];
+        for (int i = 0; i < 256; ++i)
+            levels[i] = i < colors.size() ? qGray(colors.at(i)) : 0;
+        data.resize(part.width() * part.height());
+        uchar *out = reinterpret_cast<uchar *>(data.data());
+        for (int y = 0; y < part.height(); ++y) {
+            const uchar *line = part.constScanLine(y);
+            for (int x = 0; x < part.width(); ++x)
+                *out++ = levels[line[x]];
+        }
+        colorSpace = "/DeviceGray";
+    } else {
+        if (part.format() != QImage::Format_RGB32 && part.format() != QImage::Format_ARGB32)
+            part = part.convertToFormat(part.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+        if (!part.hasAlphaChannel() && ImagePreprocessor::isGray(part)) {
+            data = ImagePreprocessor::grayPlane(part);
+            colorSpace = "/DeviceGray";
+        } else {
+            data = ImagePreprocessor::rgbPlane(part);
+            colorSpace = "/DeviceRGB";
+        }
+        if (part.hasAlphaChannel()) {
+            softMask = allocate();
+            queueStream(softMask, "/Type /XObject /Subtype /Image " + size + " /ColorSpace /DeviceGray /BitsPerComponent 8",
+                        ImagePreprocessor::alphaPlane(part), true);
+        }
+    }
+
+    object = allocate();
+    QByteArray dict = "/Type /XObject /Subtype /Image " + size + " /ColorSpace " + colorSpace + " /BitsPerComponent 8";
+    if (softMask)
+        dict += " /SMask " + reference(softMask);
+    queueStream(object, dict, data, true);
+    images_.insert(key, object);
+    imageObjects_ << object;
+    return object;
+}
+
+/*!
+    Returns the image object for the image given to setEncodedImage(),
+    writing it the first time.
+ */
+int PdfPaintEngine::encodedImageObject()
+{
+    const QString key = QString("encoded:%1:%2").arg(qHash(encodedImage_)).arg(encodedImage_.size());
+    int object = images_.value(key);
+    if (object)
+        return object;
+    object = allocate();
+    queueStream(object, encodedImageDict_, encodedImage_, false);
+    images_.insert(key, object);
+    imageObjects_ << object;
+    return object;
+}
+
+/*!
+    Returns the font that text in \a font is written with, or 0 if it has
+    to be drawn as outlines. Fonts of different sizes share the embedded font.
+ */
+PdfPaintEngine::TextFont *PdfPaintEngine::textFont(const QFont &font)
+{
+    const QString key = font.key();
+    QHash<QString, TextFont>::iterator i = textFonts_.find(key);
+    if (i == textFonts_.end()) {
+        TextFont entry;
+        entry.rawFont = QRawFont::fromFont(font);
+        entry.font = -1;
+
+        const QRawFont &rawFont = entry.rawFont;
+        const QString fontKey = QString("%1|%2|%3|%4").arg(rawFont.familyName()).arg(rawFont.styleName())
+                .arg(rawFont.weight()).arg(rawFont.style());
+        if (fontIndexes_.contains(fontKey)) {
+            entry.font = fontIndexes_.value(fontKey);
+        } else if (rawFont.isValid()) {
+            const QByteArray head = rawFont.fontTable("head");
+            const QByteArray hhea = rawFont.fontTable("hhea");
+            const QByteArray hmtx = rawFont.fontTable("hmtx");
+            const QByteArray maxp = rawFont.fontTable("maxp");
+            const int unitsPerEm = readU16(head, 18);
+            const int metrics = readU16(hhea, 34);
+            if (unitsPerEm > 0 && metrics > 0 && hmtx.size() >= 4 * metrics &&
+                    !rawFont.fontTable("glyf").isEmpty() && !rawFont.fontTable("loca").isEmpty()) {
+                Font embedded;
+                embedded.rawFont = rawFont;
+                embedded.object = allocate();
+                embedded.unitsPerEm = unitsPerEm;
+                const int numGlyphs = readU16(maxp, 4);
+                embedded.widths.resize(numGlyphs);
+                for (int glyph = 0; glyph < numGlyphs; ++glyph)
+                    embedded.widths[glyph] = readU16(hmtx, 4 * qMin(glyph, metrics - 1));
+                entry.font = fonts_.size();
+                fonts_ << embedded;
+            }
+            fontIndexes_.insert(fontKey, entry.font);
+        }
+        i = textFonts_.insert(key, entry);
+    }
+    return i.value().font < 0 ? 0 : &i.value();
+}
+
+/*!
+    Returns a glyph for each character of \a text, without shaping, or an
+    empty vector if the font doesn't have them all. White space is drawn
+    with the space glyph.
+ */
+QVector<quint32> PdfPaintEngine::glyphsForText(const QRawFont &rawFont, const QString &text)
+{
+    QVector<quint32> glyphs = rawFont.glyphIndexesForString(text);
+    if (glyphs.size() != text.size())
+        return QVector<quint32>();
+    quint32 space = 0;
+    for (int i = 0; i < glyphs.size(); ++i) {
+        if (text.at(i).isSpace()) {
+            if (!space)
+                space = rawFont.glyphIndexesForString(" ").value(0);
+            glyphs[i] = space;
+        }
+        if (glyphs.at(i) == 0)
+            return QVector<quint32>();
+    }
+    return glyphs;
+}
+
+/*!
+    Returns the advance of each of \a glyphs, the glyphs of \a text, as
+    Qt's text layout places them in \a font, so kerned pairs keep their
+    spacing. If the layout shapes the text into other glyphs the advances
+    come from \a rawFont without kerning.
+ */
+QVector<qreal> PdfPaintEngine::textAdvances(const QFont &font, const QRawFont &rawFont, const QString &text,
+                                            const QVector<quint32> &glyphs)
+{
+    QVector<qreal> advances(glyphs.size());
+    const QVector<QPointF> unkerned = rawFont.advancesForGlyphIndexes(glyphs);
+    for (int i = 0; i < glyphs.size(); ++i)
+        advances[i] = unkerned.at(i).x();
+
+    QTextLayout layout(text, font);
+    layout.beginLayout();
+    layout.createLine();
+    layout.endLayout();
+    const QList<QGlyphRun> runs = layout.glyphRuns();
+    if (runs.size() != 1 || runs.first().glyphIndexes().size() != glyphs.size())
+        return advances;
+    const QVector<quint32> shaped = runs.first().glyphIndexes();
+    const QVector<QPointF> positions = runs.first().positions();
+    for (int i = 0; i < glyphs.size(); ++i) {
+        if (shaped.at(i) != glyphs.at(i) && !text.at(i).isSpace())
+            return advances;
+    }
+
+    // The last glyph has nothing after it to be kerned with
+    for (int i = 0; i + 1 < glyphs.size(); ++i)
+        advances[i] = positions.at(i + 1).x() - positions.at(i).x();
+    return advances;
+}
+
+/*!
+    Constructs a writer for the PDF \a filename. The file is written
+    while a QPainter is open on the writer.
+ */
+PdfWriter::PdfWriter(const QString &filename) :
+    engine_(0),
+    filename_(filename),
+    pageSize_(612, 792),
+    resolution_(1200),
+    compressionLevel_(PdfCompressor::DefaultLevel),
+    pipelined_(false)
+{
+    engine_ = new PdfPaintEngine(this);
+}
+
+PdfWriter::~PdfWriter()
+{
+    delete engine_;
+}
+
+QString PdfWriter::fileName() const
+{
+    return filename_;
+}
+
+/*!
+    Sets the size of the pages in points. The default is Letter.
+ */
+void PdfWriter::setPageSize(const QSizeF &sizePts)
+{
+    pageSize_ = sizePts;
+}
+
+QSizeF PdfWriter::pageSize() const
+{
+    return pageSize_;
+}
+
+/*!
+    Sets the resolution of the device in dots per inch. Coordinates are
+    in device pixels as they are for QPrinter. The default is 1200.
+ */
+void PdfWriter::setResolution(int dpi)
+{
+    resolution_ = dpi;
+}
+
+int PdfWriter::resolution() const
+{
+    return resolution_;
+}
+
+/*!
+    Sets the zlib \a level streams are compressed with, from 0 to 9.
+ */
+void PdfWriter::setCompressionLevel(int level)
+{
+    compressionLevel_ = level;
+}
+
+int PdfWriter::compressionLevel() const
+{
+    return compressionLevel_;
+}
+
+/*!
+    When \a enabled, each finished page is compressed and written in the
+    thread pool while the next one is painted. The file is the same.
+ */
+void PdfWriter::setPipelined(bool enabled)
+{
+    pipelined_ = enabled;
+}
+
+bool PdfWriter::isPipelined() const
+{
+    return pipelined_;
+}
+
+/*!
+    Writes \a date as the creation date instead of the current time.
+ */
+void PdfWriter::setCreationDate(const QDateTime &date)
+{
+    creationDate_ = date;
+}
+
+QDateTime PdfWriter::creationDate() const
+{
+    return creationDate_;
+}
+
+/*!
+    Writes the current page to the file and starts a new one.
+ */
+bool PdfWriter::newPage()
+{
+    return engine_->newPage();
+}
+
+bool PdfWriter::hasError() const
+{
+    return engine_->hasError();
+}
+
+/*!
+    Draws the JPEG or JPEG 2000 file \a data into \a rect without decoding
+    it. Returns false, and draws nothing, if \a painter isn't painting on
+    this writer or \a data can't be embedded as is.
+ */
+bool PdfWriter::drawEncodedImage(QPainter *painter, const QRectF &rect, const QByteArray &data, const QByteArray &format)
+{
+    if (painter->paintEngine() != engine_ || !engine_->setEncodedImage(data, format))
+        return false;
+
+    // The engine embeds the file instead of this placeholder, after
+    // QPainter has given it the current transform and clip
+    QImage placeholder(1, 1, QImage::Format_RGB32);
+    placeholder.fill(0);
+    painter->drawImage(rect, placeholder);
+    engine_->clearEncodedImage();
+    return true;
+}
+
+QPaintEngine *PdfWriter::paintEngine() const
+{
+    return engine_;
+}
+
+int PdfWriter::metric(PaintDeviceMetric metric) const
+{
+    switch (metric) {
+    case PdmWidth:
+        return qRound(pageSize_.width() * resolution_ / 72);
+    case PdmHeight:
+        return qRound(pageSize_.height() * resolution_ / 72);
+    case PdmWidthMM:
+        return qRound(pageSize_.width() * 25.4 / 72);
+    case PdmHeightMM:
+        return qRound(pageSize_.height() * 25.4 / 72);
+    case PdmNumColors:
+        return 1 << 24;
+    case PdmDepth:
+        return 32;
+    case PdmDpiX:
+    case PdmDpiY:
+    case PdmPhysicalDpiX:
+    case PdmPhysicalDpiY:
+        return resolution_;
+    default:
+        return QPaintDevice::metric(metric);
+    }
+}
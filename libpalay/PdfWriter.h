@@ -0,0 +1,72 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef PDFWRITER_H
+#define PDFWRITER_H
+
+#include <QPaintDevice>
+#include <QPaintEngine>
+#include <QDateTime>
+#include <QSizeF>
+#include <QString>
+
+class PdfPaintEngine;
+
+class PdfWriter : public QPaintDevice
+{
+public:
+    // QPaintEngine::type() of the writer's paint engine
+    static const int EngineType = QPaintEngine::User + 1;
+
+    explicit PdfWriter(const QString &filename);
+    ~PdfWriter();
+
+    QString fileName() const;
+    void setPageSize(const QSizeF &sizePts);
+    QSizeF pageSize() const;
+    void setResolution(int dpi);
+    int resolution() const;
+    void setCompressionLevel(int level);
+    int compressionLevel() const;
+    void setPipelined(bool enabled);
+    bool isPipelined() const;
+    void setCreationDate(const QDateTime &date);
+    QDateTime creationDate() const;
+
+    bool newPage();
+    bool hasError() const;
+
+    bool drawEncodedImage(QPainter *painter, const QRectF &rect, const QByteArray &data, const QByteArray &format);
+
+    QPaintEngine *paintEngine() const;
+
+protected:
+    int metric(PaintDeviceMetric metric) const;
+
+private:
+    Q_DISABLE_COPY(PdfWriter)
+
+    PdfPaintEngine *engine_;
+    QString filename_;
+    QSizeF pageSize_;
+    int resolution_;
+    int compressionLevel_;
+    bool pipelined_;
+    QDateTime creationDate_;
+};
+
+#endif // PDFWRITER_H
@@ -0,0 +1,133 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "RenderStats.h"
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#include <psapi.h>
+#elif defined(Q_OS_UNIX)
+#include <sys/resource.h>
+#endif
+
+/*!
+    \class RenderStats
+    \brief The RenderStats class accumulates the time a document spends in each phase of rendering.
+
+    The phases nest: enter() pushes a phase and leave() pops it. Time is only
+    charged to the innermost phase so the phase times add up to the total.
+    The outermost phase is always Script.
+
+    Lua errors unwind with longjmp, which skips leave() calls and Scope
+    destructors. Callers that know what the depth should be, such as the
+    method dispatch from Lua, call unwindTo() first to drop phases left behind
+    by an error.
+ */
+
+RenderStats::RenderStats() :
+    lastCharge_(0)
+{
+    for (int i = 0; i < PhaseCount; ++i)
+        nsecs_[i] = 0;
+    phases_.append(Script);
+    timer_.start();
+}
+
+void RenderStats::enter(Phase phase)
+{
+    charge();
+    phases_.append(phase);
+}
+
+void RenderStats::leave()
+{
+    if (phases_.size() > 1) {
+        charge();
+        phases_.removeLast();
+    }
+}
+
+/*!
+    Leaves phases until only \a depth are left.
+ */
+void RenderStats::unwindTo(int depth)
+{
+    while (phases_.size() > qMax(depth, 1))
+        leave();
+}
+
+int RenderStats::depth() const
+{
+    return phases_.size();
+}
+
+/*!
+    Returns the time spent in \a phase so far, including the
+    current phase up to now.
+ */
+double RenderStats::seconds(Phase phase) const
+{
+    qint64 nsecs = nsecs_[phase];
+    if (phases_.last() == phase)
+        nsecs += timer_.nsecsElapsed() - lastCharge_;
+    return nsecs / 1e9;
+}
+
+double RenderStats::totalSeconds() const
+{
+    return timer_.nsecsElapsed() / 1e9;
+}
+
+const char *RenderStats::phaseName(Phase phase)
+{
+    static const char *names[PhaseCount] = {
+        "script", "edit", "layout", "register", "paint", "write"
+    };
+    return names[phase];
+}
+
+/*!
+    Returns the peak resident set size of the process in kilobytes
+    or 0 if it is not known on this platform.
+ */
+qint64 RenderStats::peakRssKb()
+{
+#if defined(Q_OS_WIN)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.PeakWorkingSetSize / 1024;
+    return 0;
+#elif defined(Q_OS_UNIX)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#if defined(Q_OS_MAC)
+    // bytes on OS X, kilobytes everywhere else
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+void RenderStats::charge()
+{
+    qint64 now = timer_.nsecsElapsed();
+    nsecs_[phases_.last()] += now - lastCharge_;
+    lastCharge_ = now;
+}
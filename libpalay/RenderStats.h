@@ -0,0 +1,68 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RENDERSTATS_H
+#define RENDERSTATS_H
+
+#include <QElapsedTimer>
+#include <QVector>
+
+class RenderStats
+{
+public:
+    enum Phase {
+        Script,     // running Lua outside of the document methods
+        Edit,       // building the QTextDocument
+        Layout,     // laying out the document
+        Register,   // registering the image and SVG handlers before painting
+        Paint,      // drawing the pages
+        Write,      // starting pages and finishing the output file
+        PhaseCount
+    };
+
+    class Scope
+    {
+    public:
+        Scope(RenderStats &stats, Phase phase) : stats_(stats) { stats_.enter(phase); }
+        ~Scope() { stats_.leave(); }
+
+    private:
+        RenderStats &stats_;
+    };
+
+    RenderStats();
+
+    void enter(Phase phase);
+    void leave();
+    void unwindTo(int depth);
+    int depth() const;
+
+    double seconds(Phase phase) const;
+    double totalSeconds() const;
+
+    static const char *phaseName(Phase phase);
+    static qint64 peakRssKb();
+
+private:
+    void charge();
+
+    QElapsedTimer timer_;
+    qint64 lastCharge_;
+    qint64 nsecs_[PhaseCount];
+    QVector<Phase> phases_;
+};
+
+#endif // RENDERSTATS_H
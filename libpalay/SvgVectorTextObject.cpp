@@ -16,10 +16,18 @@
 
 #include "SvgVectorTextObject.h"
 #include <QSvgRenderer>
+#include <QPainter>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QCryptographicHash>
 
 Q_GUI_EXPORT extern int qt_defaultDpiX();
 Q_GUI_EXPORT extern int qt_defaultDpiY();
 
+// Number of parsed SVGs kept for reuse
+static const int rendererCacheSize = 64;
+
 /*!
     \class SvgVectorTextObject
     \brief The SvgVectorTextObject class is used to insert an SVG vector image as a custom object in a QTextDocument without rendering it to bitmap.
@@ -61,7 +69,8 @@ Q_GUI_EXPORT extern int qt_defaultDpiY();
 SvgVectorTextObject::SvgVectorTextObject(const QByteArray &svgContents, float width, float height, QObject *parent) :
     QObject(parent),
     size_(width, height),
-    renderer_(new QSvgRenderer(svgContents, this))
+    renderer_(renderer(svgContents)),
+    draft_(false)
 {
     if (renderer_->isValid()) {
         if (width < 0 && height < 0) {
@@ -77,11 +86,54 @@ SvgVectorTextObject::SvgVectorTextObject(const QByteArray &svgContents, float wi
     }
 }
 
+/*!
+    Returns a renderer for \a svgContents. Renderers are shared by all
+    objects with the same SVG, in this document or later ones, so that an
+    SVG used on every page or in every document of a merge is only parsed
+    once. Rendering doesn't change a renderer so sharing is safe, but
+    the table of renderers is locked since pages can be laid out and
+    painted in the thread pool.
+ */
+QSharedPointer<QSvgRenderer> SvgVectorTextObject::renderer(const QByteArray &svgContents)
+{
+    static QHash<QByteArray, QSharedPointer<QSvgRenderer> > renderers;
+    static QMutex renderersMutex;
+
+    const QByteArray key = QCryptographicHash::hash(svgContents, QCryptographicHash::Sha1);
+    QMutexLocker locker(&renderersMutex);
+    QSharedPointer<QSvgRenderer> result = renderers.value(key);
+    if (result.isNull()) {
+        result = QSharedPointer<QSvgRenderer>(new QSvgRenderer(svgContents));
+        // Objects still using evicted renderers keep them alive
+        if (renderers.size() >= rendererCacheSize)
+            renderers.clear();
+        renderers.insert(key, result);
+    }
+    return result;
+}
+
 bool SvgVectorTextObject::isValid() const
 {
     return renderer_->isValid();
 }
 
+/*!
+    Returns the size that the SVG is placed at in points.
+ */
+QSizeF SvgVectorTextObject::size() const
+{
+    return size_;
+}
+
+/*!
+    In draft mode an outlined placeholder is drawn instead
+    of rendering the SVG.
+ */
+void SvgVectorTextObject::setDraft(bool draft)
+{
+    draft_ = draft;
+}
+
 QSizeF SvgVectorTextObject::intrinsicSize(QTextDocument *doc, int posInDocument, const QTextFormat &format)
 {
     Q_UNUSED(posInDocument);
@@ -106,5 +158,16 @@ void SvgVectorTextObject::drawObject(QPainter *painter, const QRectF &rect, QTex
     Q_UNUSED(doc);
     Q_UNUSED(format);
 
+    if (draft_) {
+        painter->save();
+        painter->setPen(QPen(Qt::gray, 0));
+        painter->setBrush(Qt::NoBrush);
+        painter->drawRect(rect);
+        painter->drawLine(rect.topLeft(), rect.bottomRight());
+        painter->drawLine(rect.topRight(), rect.bottomLeft());
+        painter->restore();
+        return;
+    }
+
     renderer_->render(painter, rect);
 }
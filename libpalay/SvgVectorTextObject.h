@@ -19,6 +19,7 @@
 
 #include <QObject>
 #include <QTextObjectInterface>
+#include <QSharedPointer>
 
 class QSvgRenderer;
 
@@ -31,6 +32,9 @@ public:
     explicit SvgVectorTextObject(const QByteArray &svgContents, float width = -1, float height = -1, QObject *parent = 0);
 
     bool isValid() const;
+    QSizeF size() const;
+
+    void setDraft(bool draft);
 
     QSizeF intrinsicSize(QTextDocument *doc, int posInDocument,
                          const QTextFormat &format);
@@ -43,8 +47,11 @@ signals:
 public slots:
 
 private:
+    static QSharedPointer<QSvgRenderer> renderer(const QByteArray &svgContents);
+
     QSizeF size_;
-    QSvgRenderer *renderer_;
+    QSharedPointer<QSvgRenderer> renderer_;
+    bool draft_;
 };
 
 #endif // SVGTEXTOBJECT_H
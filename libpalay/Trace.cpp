@@ -0,0 +1,163 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Trace.h"
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThread>
+#include <QVector>
+#include <QHash>
+#include <QFile>
+#include <stdio.h>
+
+/*!
+    \class Trace
+    \brief The Trace class records timed events in the Chrome trace event format.
+
+    Tracing is off until start() is called. Events are kept in memory and
+    written to the file by stop(), which can be loaded into chrome://tracing
+    or Perfetto to see how the script, layout, painting and image decodes
+    on the worker threads overlap.
+
+    Use PALAY_TRACE_SCOPE to time a scope. When tracing is off it costs one
+    test of a flag; building with PALAY_NO_TRACE defined removes it entirely.
+ */
+
+QAtomicInt Trace::enabled_(0);
+
+namespace {
+
+    struct Event {
+        const char *category;
+        const char *name;
+        qint64 start;
+        qint64 duration;
+        int thread;
+        int page;
+    };
+
+    QElapsedTimer clock;
+    QMutex mutex;
+    QString traceFilename;
+    QVector<Event> events;
+    QHash<Qt::HANDLE, int> threadIds;
+
+    // Small thread ids in the order threads first record an event, 1 is
+    // the thread that started the trace. Must hold the mutex.
+    int threadId()
+    {
+        Qt::HANDLE handle = QThread::currentThreadId();
+        QHash<Qt::HANDLE, int>::const_iterator i = threadIds.constFind(handle);
+        if (i != threadIds.constEnd())
+            return i.value();
+        int id = threadIds.size() + 1;
+        threadIds.insert(handle, id);
+        return id;
+    }
+
+}
+
+/*!
+    Starts recording events to write to \a filename when tracing stops.
+ */
+bool Trace::start(const QString &filename)
+{
+    QMutexLocker locker(&mutex);
+    traceFilename = filename;
+    events.clear();
+    threadIds.clear();
+    threadId();
+    clock.start();
+    enabled_.fetchAndStoreOrdered(1);
+    return true;
+}
+
+/*!
+    Stops tracing and writes the events recorded since start(). Returns false
+    if the file can't be written.
+ */
+bool Trace::stop()
+{
+    QMutexLocker locker(&mutex);
+    if (!isEnabled())
+        return true;
+    enabled_.fetchAndStoreOrdered(0);
+
+    QFile file(traceFilename);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate)) {
+        fprintf(stderr, "Error writing trace %s: %s\n", qPrintable(traceFilename), qPrintable(file.errorString()));
+        return false;
+    }
+
+    // Each entry but the first is preceded by its separator, so the list
+    // is valid JSON whatever was recorded
+    const char *separator = "";
+    file.write("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (QHash<Qt::HANDLE, int>::const_iterator i = threadIds.constBegin(); i != threadIds.constEnd(); ++i) {
+        QByteArray threadName = i.value() == 1 ? QByteArray("main") : "worker " + QByteArray::number(i.value() - 1);
+        file.write(separator);
+        file.write(QString("{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %1, \"args\": {\"name\": \"%2\"}}")
+                   .arg(i.value()).arg(QString::fromLatin1(threadName)).toUtf8());
+        separator = ",\n";
+    }
+    for (int i = 0; i < events.size(); ++i) {
+        const Event &e = events.at(i);
+        QByteArray line = "{\"name\": \"" + QByteArray(e.name) +
+                "\", \"cat\": \"" + QByteArray(e.category) +
+                "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " + QByteArray::number(e.thread) +
+                ", \"ts\": " + QByteArray::number(e.start / 1000.0, 'f', 3) +
+                ", \"dur\": " + QByteArray::number(e.duration / 1000.0, 'f', 3);
+        if (e.page >= 0)
+            line += ", \"args\": {\"page\": " + QByteArray::number(e.page) + "}";
+        line += "}";
+        file.write(separator);
+        file.write(line);
+        separator = ",\n";
+    }
+    file.write("\n]}\n");
+    events.clear();
+    return true;
+}
+
+/*!
+    Returns the time since tracing started in nanoseconds.
+ */
+qint64 Trace::now()
+{
+    return clock.nsecsElapsed();
+}
+
+/*!
+    Records an event from \a start until now on the calling thread.
+    \a category and \a name must stay valid until the trace is written.
+    \a page is added as an argument if it isn't negative.
+ */
+void Trace::complete(const char *category, const char *name, qint64 start, int page)
+{
+    qint64 end = now();
+    QMutexLocker locker(&mutex);
+    if (!isEnabled())
+        return;
+    Event e;
+    e.category = category;
+    e.name = name;
+    e.start = start;
+    e.duration = end - start;
+    e.thread = threadId();
+    e.page = page;
+    events.append(e);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2014 LKC Technologies, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "libpalay_global.h"
+#include <QString>
+#include <QAtomicInt>
+
+class LIBPALAYSHARED_EXPORT Trace
+{
+public:
+    static bool start(const QString &filename);
+    static bool stop();
+
+    static bool isEnabled()
+    {
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 0, 0))
+        return enabled_.loadAcquire() != 0;
+#else
+        return enabled_ != 0;
+#endif
+    }
+    static qint64 now();
+    static void complete(const char *category, const char *name, qint64 start, int page = -1);
+
+    class Scope
+    {
+    public:
+        Scope(const char *category, const char *name, int page = -1) :
+            category_(category), name_(name), page_(page), start_(isEnabled() ? now() : -1) {}
+        ~Scope() { if (start_ >= 0) complete(category_, name_, start_, page_); }
+
+    private:
+        const char *category_;
+        const char *name_;
+        int page_;
+        qint64 start_;
+    };
+
+private:
+    // Read by every scope on every thread, so set and read atomically
+    static QAtomicInt enabled_;
+};
+
+#define PALAY_TRACE_CONCAT2(a, b) a##b
+#define PALAY_TRACE_CONCAT(a, b) PALAY_TRACE_CONCAT2(a, b)
+
+// Traces the rest of the enclosing scope. The arguments are those of
+// Trace::Scope; category and name must be string literals.
+#ifdef PALAY_NO_TRACE
+#define PALAY_TRACE_SCOPE(...)
+#else
+#define PALAY_TRACE_SCOPE(...) Trace::Scope PALAY_TRACE_CONCAT(traceScope, __LINE__)(__VA_ARGS__)
+#endif
+
+#endif // TRACE_H
@@ -23,8 +23,16 @@ extern "C"
     #include <lualib.h>
 }
 #include "PalayDocument.h"
+#include "Trace.h"
+#include "JsonParser.h"
 #include <QApplication>
 #include <QSharedPointer>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QFile>
+#include <new>
+#include <stdio.h>
 
 static int argc = 0;
 static char *argv[] = {};
@@ -49,141 +57,862 @@ static PalayDocument* checkDocument(lua_State *L, int index)
     return *docPtr;
 }
 
+static void debugStackDump(lua_State *L)
+{
+    int top = lua_gettop(L);
+    for (int i = 1; i <= top; i++) {  /* repeat for each level */
+        int t = lua_type(L, i);
+        switch (t) {
+        case LUA_TSTRING:  /* strings */
+            qDebug("%d: `%s'", i, lua_tostring(L, i));
+            break;
+
+        case LUA_TBOOLEAN:  /* booleans */
+            qDebug("%d: %s", i, lua_toboolean(L, i) ? "true" : "false");
+            break;
+
+        case LUA_TNUMBER:  /* numbers */
+            qDebug("%d: %g", i, lua_tonumber(L, i));
+            break;
+
+        default:  /* other values */
+            qDebug("%d: %s %p", i, lua_typename(L, t), lua_topointer(L, i));
+            break;
+        }
+    }
+}
+
+/*!
+ * Raises the document's last error as a Lua error, with the location
+ * of the calling Lua line like luaL_error().
+ */
+static int raiseError(lua_State *L, PalayDocument *doc)
+{
+    luaL_where(L, 1);
+    lua_pushstring(L, doc->errorString().toUtf8().constData());
+    lua_concat(L, 2);
+    return lua_error(L);
+}
+
+static QString checkString(lua_State *L, int index)
+{
+    return QString::fromUtf8(luaL_checkstring(L, index));
+}
+
+/*!
+ * Converts the Lua value at \a index for PalayDocument: numbers, strings
+ * and booleans become the matching QVariant and tables become a
+ * QVariantList of their array part (e.g. {255, 0, 0} for a color).
+ */
+static QVariant toVariant(lua_State *L, int index)
+{
+    index = index > 0 ? index : lua_gettop(L) + index + 1;
+    switch (lua_type(L, index)) {
+    case LUA_TNUMBER:
+        return QVariant(double(lua_tonumber(L, index)));
+    case LUA_TBOOLEAN:
+        return QVariant(bool(lua_toboolean(L, index)));
+    case LUA_TSTRING:
+        return QVariant(QString::fromUtf8(lua_tostring(L, index)));
+    case LUA_TTABLE: {
+        QVariantList list;
+        size_t len = lua_rawlen(L, index);
+        for (size_t i = 1; i <= len; ++i) {
+            lua_rawgeti(L, index, i);
+            list << toVariant(L, -1);
+            lua_pop(L, 1);
+        }
+        return list;
+    }
+    default:
+        return QVariant();
+    }
+}
+
+static void pushVariant(lua_State *L, const QVariant &value)
+{
+    switch (value.type()) {
+    case QVariant::Int:
+    case QVariant::LongLong:
+        lua_pushinteger(L, value.toLongLong());
+        break;
+    case QVariant::Double:
+        lua_pushnumber(L, value.toDouble());
+        break;
+    case QVariant::Bool:
+        lua_pushboolean(L, value.toBool());
+        break;
+    case QVariant::String:
+        lua_pushstring(L, value.toString().toUtf8().constData());
+        break;
+    default:
+        lua_pushnil(L);
+        break;
+    }
+}
+
+/*!
+ * Converts a table of named values like a style table at \a index to a
+ * QVariantMap. \a what names the kind of table in the error for a key that
+ * is not a string.
+ */
+static QVariantMap checkMap(lua_State *L, int index, const char *what)
+{
+    luaL_checktype(L, index, LUA_TTABLE);
+    QVariantMap map;
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+        // Not lua_isstring(), lua_tostring() on a number key would break lua_next()
+        if (lua_type(L, -2) != LUA_TSTRING)
+            luaL_error(L, "Invalid key in %s table. All %s keys must be strings.", what, what);
+        map[QString::fromUtf8(lua_tostring(L, -2))] = toVariant(L, -1);
+        lua_pop(L, 1);
+    }
+    return map;
+}
+
+static QVariantMap checkStyle(lua_State *L, int index)
+{
+    return checkMap(L, index, "style");
+}
+
+static Qt::Corner checkCorner(lua_State *L, int index)
+{
+    const char *cornerString = luaL_checkstring(L, index);
+    if (qstricmp(cornerString, "TopLeft") == 0)
+        return Qt::TopLeftCorner;
+    else if (qstricmp(cornerString, "TopRight") == 0)
+        return Qt::TopRightCorner;
+    else if (qstricmp(cornerString, "BottomLeft") == 0)
+        return Qt::BottomLeftCorner;
+    else if (qstricmp(cornerString, "BottomRight") == 0)
+        return Qt::BottomRightCorner;
+    else
+        return (Qt::Corner) luaL_error(L, "%s is not a valid corner. Try \"TopLeft\", \"TopRight\", \"BottomLeft\" or \"BottomRight\"", cornerString);
+}
+
 static int paragraph(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->paragraph(L);
+    doc->paragraph(checkString(L, 2));
+    return 0;
 }
 
 static int text(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->text(L);
+    doc->text(checkString(L, 2));
+    return 0;
 }
 
 static int style(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->style(L);
+    if (!doc->style(checkStyle(L, 2)))
+        return raiseError(L, doc);
+    return 0;
 }
 
 static int pushStyle(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->pushStyle(L);
+    if (!doc->pushStyle(checkStyle(L, 2)))
+        return raiseError(L, doc);
+    return 0;
 }
 
 static int popStyle(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->popStyle(L);
+    if (!doc->popStyle())
+        return raiseError(L, doc);
+    return 0;
 }
 
 static int startTable(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->startTable(L);
+    if (!doc->startTable(luaL_checkinteger(L, 2), luaL_checkinteger(L, 3)))
+        return raiseError(L, doc);
+    return 0;
 }
 
 static int cell(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->cell(L);
+    int row = luaL_checkinteger(L, 2);
+    int col = luaL_checkinteger(L, 3);
+    int rowspan = 1;
+    int colspan = 1;
+    if (lua_gettop(L) >= 4)
+        rowspan = luaL_checkinteger(L, 4);
+    if (lua_gettop(L) >= 5)
+        colspan = luaL_checkinteger(L, 5);
+    if (!doc->cell(row, col, rowspan, colspan))
+        return raiseError(L, doc);
+    return 0;
 }
 
 static int endTable(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->endTable(L);
+    if (!doc->endTable())
+        return raiseError(L, doc);
+    return 0;
+}
+
+static int tableFromCsv(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    QString filename = checkString(L, 2);
+    QVariantMap options;
+    if (!lua_isnoneornil(L, 3))
+        options = checkMap(L, 3, "options");
+    if (!doc->tableFromCsv(filename, options))
+        return raiseError(L, doc);
+    return 0;
 }
 
 static int image(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->image(L);
+    QString name = checkString(L, 2);
+    float widthPts = -1;
+    float heightPts = -1;
+    if (lua_gettop(L) >= 3)
+        widthPts = luaL_checkinteger(L, 3);
+    if (lua_gettop(L) >= 4)
+        heightPts = luaL_checkinteger(L, 4);
+
+    QSizeF size;
+    if (!doc->image(name, widthPts, heightPts, &size))
+        return raiseError(L, doc);
+
+    // Return the size the image is placed at
+    lua_pushnumber(L, size.width());
+    lua_pushnumber(L, size.height());
+    return 2;
 }
 
 static int svg(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->svg(L);
+    QByteArray svgContents = luaL_checkstring(L, 2);
+    float widthPts = -1;
+    float heightPts = -1;
+    if (lua_gettop(L) >= 3)
+        widthPts = luaL_checkinteger(L, 3);
+    if (lua_gettop(L) >= 4)
+        heightPts = luaL_checkinteger(L, 4);
+
+    if (!doc->svg(svgContents, widthPts, heightPts))
+        return raiseError(L, doc);
+    return 0;
 }
 
 static int html(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->html(L);
+    doc->html(checkString(L, 2));
+    return 0;
 }
 
 static int saveAs(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->saveAs(L);
+    if (!doc->saveAs(checkString(L, 2)))
+        return raiseError(L, doc);
+    return 0;
+}
+
+static int saveSnapshot(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    if (!doc->saveSnapshot(checkString(L, 2)))
+        return raiseError(L, doc);
+    return 0;
+}
+
+static int loadSnapshot(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    if (!doc->loadSnapshot(checkString(L, 2)))
+        return raiseError(L, doc);
+    return 0;
+}
+
+static int creationDate(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    QDateTime date;
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        date = QDateTime::fromTime_t(lua_tointeger(L, 2)).toUTC();
+    } else {
+        const char *dateString = luaL_checkstring(L, 2);
+        date = QDateTime::fromString(QString::fromUtf8(dateString), Qt::ISODate);
+        if (!date.isValid())
+            luaL_error(L, "\"%s\" is not a valid date. Try seconds since 1970 or ISO 8601 like \"2014-09-01T12:00:00Z\"", dateString);
+    }
+    doc->setCreationDate(date);
+    return 0;
+}
+
+static int documentId(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    doc->setDocumentId(luaL_checkstring(L, 2));
+    return 0;
+}
+
+static int getReferencedFiles(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    const QStringList files = doc->referencedFiles();
+    lua_createtable(L, files.size(), 0);
+    for (int i = 0; i < files.size(); ++i) {
+        lua_pushstring(L, files.at(i).toUtf8().constData());
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
 }
 
 static int pageSize(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->pageSize(L);
+    if (!doc->setPageSize(checkString(L, 2)))
+        return raiseError(L, doc);
+    return 0;
 }
 
 static int pageMargins(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->pageMargins(L);
+    doc->setPageMargins(luaL_checkinteger(L, 2),
+                        luaL_checkinteger(L, 3),
+                        luaL_checkinteger(L, 4),
+                        luaL_checkinteger(L, 5));
+    return 0;
 }
 
 static int getPageWidth(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->getPageWidth(L);
+    lua_pushnumber(L, doc->pageWidth());
+    return 1;
 }
 
 static int getPageHeight(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->getPageHeight(L);
+    lua_pushnumber(L, doc->pageHeight());
+    return 1;
 }
 
 static int getPageMargins(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->getPageMargins(L);
+    qreal left, top, right, bottom;
+    doc->pageMargins(&left, &top, &right, &bottom);
+    lua_pushnumber(L, left);
+    lua_pushnumber(L, top);
+    lua_pushnumber(L, right);
+    lua_pushnumber(L, bottom);
+    return 4;
 }
 
 static int getPageCount(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->getPageCount(L);
+    lua_pushinteger(L, doc->pageCount());
+    return 1;
+}
+
+static int getFirstPageNumber(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    lua_pushinteger(L, doc->firstPageNumber());
+    return 1;
+}
+
+static int pageRange(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    if (!doc->setPageRange(luaL_checkinteger(L, 2), luaL_optinteger(L, 3, 0)))
+        return raiseError(L, doc);
+    return 0;
+}
+
+static int draftMode(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    luaL_checktype(L, 2, LUA_TBOOLEAN);
+    doc->setDraftMode(lua_toboolean(L, 2));
+    return 0;
+}
+
+static int imageResolution(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    if (!doc->setImageResolution(luaL_checkinteger(L, 2)))
+        return raiseError(L, doc);
+    return 0;
+}
+
+static int getStats(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    const QVariantMap stats = doc->statistics();
+    lua_newtable(L);
+    for (QVariantMap::const_iterator i = stats.constBegin(); i != stats.constEnd(); ++i) {
+        pushVariant(L, i.value());
+        lua_setfield(L, -2, i.key().toUtf8().constData());
+    }
+    return 1;
+}
+
+static int buildMode(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    luaL_checktype(L, 2, LUA_TBOOLEAN);
+    doc->setBuildMode(lua_toboolean(L, 2));
+    return 0;
+}
+
+static int layoutThreads(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    if (!doc->setLayoutThreads(luaL_checkinteger(L, 2)))
+        return raiseError(L, doc);
+    return 0;
+}
+
+static int pipelined(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    luaL_checktype(L, 2, LUA_TBOOLEAN);
+    doc->setPipelined(lua_toboolean(L, 2));
+    return 0;
+}
+
+static int compression(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    if (!doc->setCompression(checkString(L, 2)))
+        return raiseError(L, doc);
+    return 0;
+}
+
+static int directPdf(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    luaL_checktype(L, 2, LUA_TBOOLEAN);
+    doc->setDirectPdf(lua_toboolean(L, 2));
+    return 0;
 }
 
 static int pageBreak(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->pageBreak(L);
+    doc->pageBreak();
+    return 0;
+}
+
+static int section(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    if (!doc->section(lua_toboolean(L, 2)))
+        return raiseError(L, doc);
+    return 0;
 }
 
 static int startBlock(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->startBlock(L);
+    Qt::Corner corner = checkCorner(L, 2);
+    if (!doc->startBlock(corner, luaL_checkinteger(L, 3), luaL_checkinteger(L, 4)))
+        return raiseError(L, doc);
+    return 0;
 }
 
 static int endBlock(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
-    return doc->endBlock(L);
+    if (!doc->endBlock())
+        return raiseError(L, doc);
+    return 0;
+}
+
+static int startFragment(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    if (!doc->startFragment())
+        return raiseError(L, doc);
+    return 0;
+}
+
+static int endFragment(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    int handle = doc->endFragment();
+    if (handle == 0)
+        return raiseError(L, doc);
+    lua_pushinteger(L, handle);
+    return 1;
+}
+
+static int insertFragment(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    int handle = luaL_checkinteger(L, 2);
+    QMap<QString, QString> substitutions;
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        lua_pushnil(L);
+        while (lua_next(L, 3) != 0) {
+            if (lua_type(L, -2) != LUA_TSTRING || !lua_isstring(L, -1))
+                luaL_error(L, "Invalid substitution. Keys and values must be strings.");
+            substitutions[QString::fromUtf8(lua_tostring(L, -2))] = QString::fromUtf8(lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+    if (!doc->insertFragment(handle, substitutions))
+        return raiseError(L, doc);
+    return 0;
+}
+
+static const char* dataMetatableName = "palay.data";
+
+/*!
+ * Pushes a value from parsed JSON. Objects and arrays are pushed as
+ * palay.data userdata that convert their members to Lua values only
+ * when they are indexed, so a large array costs nothing until the
+ * script reads it.
+ */
+static void pushData(lua_State *L, const QVariant &value)
+{
+    if (value.type() == QVariant::Map || value.type() == QVariant::List) {
+        void *ud = lua_newuserdata(L, sizeof(QVariant));
+        new (ud) QVariant(value);
+        luaL_getmetatable(L, dataMetatableName);
+        lua_setmetatable(L, -2);
+    } else {
+        pushVariant(L, value);
+    }
+}
+
+static QVariant *checkData(lua_State *L, int index)
+{
+    return (QVariant *) luaL_checkudata(L, index, dataMetatableName);
+}
+
+/*!
+ * Pushes the member of the data at \a index named by the key at the top
+ * of the stack, or nil. Objects and arrays are cached in the userdata's
+ * user value so that indexing them again returns the same userdata.
+ */
+static void pushDataMember(lua_State *L, int index)
+{
+    const QVariant *data = checkData(L, index);
+    const int key = lua_gettop(L);
+
+    lua_getuservalue(L, index);
+    if (lua_istable(L, -1)) {
+        lua_pushvalue(L, key);
+        lua_rawget(L, -2);
+        if (!lua_isnil(L, -1)) {
+            lua_remove(L, -2);
+            return;
+        }
+        lua_pop(L, 2);
+    } else {
+        lua_pop(L, 1);
+    }
+
+    QVariant member;
+    if (data->type() == QVariant::Map && lua_type(L, key) == LUA_TSTRING) {
+        member = data->toMap().value(QString::fromUtf8(lua_tostring(L, key)));
+    } else if (data->type() == QVariant::List && lua_type(L, key) == LUA_TNUMBER) {
+        const int i = lua_tointeger(L, key);
+        const QVariantList list = data->toList();
+        if (i >= 1 && i <= list.size())
+            member = list.at(i - 1);
+    }
+    pushData(L, member);
+
+    if (lua_isuserdata(L, -1)) {
+        lua_getuservalue(L, index);
+        if (!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_setuservalue(L, index);
+        }
+        lua_pushvalue(L, key);
+        lua_pushvalue(L, -3);
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+    }
+}
+
+static int dataIndex(lua_State *L)
+{
+    lua_settop(L, 2);
+    pushDataMember(L, 1);
+    return 1;
+}
+
+static int dataLen(lua_State *L)
+{
+    const QVariant *data = checkData(L, 1);
+    lua_pushinteger(L, data->type() == QVariant::Map ? data->toMap().size() : data->toList().size());
+    return 1;
+}
+
+/*!
+ * Iterator for pairs(): returns the key after the one at index 2 (nil
+ * for the first) and its value.
+ */
+static int dataNext(lua_State *L)
+{
+    const QVariant *data = checkData(L, 1);
+    lua_settop(L, 2);
+    if (data->type() == QVariant::Map) {
+        const QVariantMap map = data->toMap();
+        QVariantMap::const_iterator i = lua_isnil(L, 2) ? map.constBegin()
+                : map.upperBound(QString::fromUtf8(luaL_checkstring(L, 2)));
+        if (i == map.constEnd())
+            return 0;
+        lua_pushstring(L, i.key().toUtf8().constData());
+    } else {
+        const int next = lua_isnil(L, 2) ? 1 : luaL_checkinteger(L, 2) + 1;
+        if (next > data->toList().size())
+            return 0;
+        lua_pushinteger(L, next);
+    }
+    pushDataMember(L, 1);
+    return 2;
+}
+
+static int dataPairs(lua_State *L)
+{
+    checkData(L, 1);
+    lua_pushcfunction(L, dataNext);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+static int dataIpairsNext(lua_State *L)
+{
+    const QVariant *data = checkData(L, 1);
+    const int next = luaL_checkinteger(L, 2) + 1;
+    if (data->type() != QVariant::List || next > data->toList().size())
+        return 0;
+    lua_settop(L, 1);
+    lua_pushinteger(L, next);
+    pushDataMember(L, 1);
+    return 2;
+}
+
+static int dataIpairs(lua_State *L)
+{
+    checkData(L, 1);
+    lua_pushcfunction(L, dataIpairsNext);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+    return 3;
+}
+
+static int dataGc(lua_State *L)
+{
+    QVariant *data = checkData(L, 1);
+    data->~QVariant();
+    return 0;
+}
+
+static const struct luaL_Reg palaydata_methods[] = {
+    {"__index", dataIndex},
+    {"__len", dataLen},
+    {"__pairs", dataPairs},
+    {"__ipairs", dataIpairs},
+    {"__gc", dataGc},
+    {NULL, NULL}
+};
+
+/*!
+ * libpalay.parseJson(text) returns the JSON value in \a text. Objects
+ * and arrays are returned as read-only userdata that can be indexed,
+ * iterated with pairs() and ipairs() and measured with # like tables.
+ */
+static int parseJson(lua_State *L)
+{
+    size_t length;
+    const char *text = luaL_checklstring(L, 1, &length);
+    QString errorString;
+    QVariant value = JsonParser::parse(QByteArray::fromRawData(text, length), &errorString);
+    if (!errorString.isEmpty())
+        luaL_error(L, "Invalid JSON: %s", errorString.toUtf8().constData());
+    pushData(L, value);
+    return 1;
+}
+
+/*!
+ * libpalay.readJson(filename) returns the JSON value in the file like
+ * parseJson().
+ */
+static int readJson(lua_State *L)
+{
+    const QString filename = checkString(L, 1);
+    QFile file(filename);
+    if (!file.open(QFile::ReadOnly))
+        luaL_error(L, "Failed to open %s: %s", filename.toUtf8().constData(), file.errorString().toUtf8().constData());
+    QString errorString;
+    QVariant value = JsonParser::parse(file.readAll(), &errorString);
+    if (!errorString.isEmpty())
+        luaL_error(L, "Invalid JSON in %s: %s", filename.toUtf8().constData(), errorString.toUtf8().constData());
+    pushData(L, value);
+    return 1;
+}
+
+// Calls to a document method from one line of Lua
+struct CallSite {
+    const char *method;
+    const void *source;  // interned by Lua, only used to tell sources apart
+    int line;
+
+    bool operator==(const CallSite &other) const
+    {
+        return method == other.method && source == other.source && line == other.line;
+    }
+};
+
+static uint qHash(const CallSite &site)
+{
+    return qHash(site.method) ^ qHash(site.source) ^ uint(site.line);
+}
+
+struct CallProfile {
+    const char *method;
+    QByteArray location;
+    qint64 calls;
+    qint64 nsecs;
+};
+
+static int profileTop = 0;  // number of call sites to report, 0 if not profiling
+static QElapsedTimer profileClock;
+static QHash<CallSite, CallProfile> profile;
+
+static bool longerThan(const CallProfile &a, const CallProfile &b)
+{
+    return a.nsecs > b.nsecs;
+}
+
+/*!
+ * Charges a call to \a method that took \a nsecs to the Lua line
+ * that made it. C functions between the method and Lua such as the
+ * closures palay installs as globals are skipped.
+ */
+static void recordCall(lua_State *L, const char *method, qint64 nsecs)
+{
+    lua_Debug ar;
+    CallSite site = {method, 0, 0};
+    for (int level = 1; lua_getstack(L, level, &ar); ++level) {
+        lua_getinfo(L, "Sl", &ar);
+        if (ar.currentline > 0) {
+            site.source = ar.source;
+            site.line = ar.currentline;
+            break;
+        }
+    }
+
+    QHash<CallSite, CallProfile>::iterator i = profile.find(site);
+    if (i == profile.end()) {
+        CallProfile p;
+        p.method = method;
+        p.location = site.line > 0 ? QByteArray(ar.short_src) + ":" + QByteArray::number(site.line) : QByteArray("?");
+        p.calls = 0;
+        p.nsecs = 0;
+        i = profile.insert(site, p);
+    }
+    ++i->calls;
+    i->nsecs += nsecs;
+}
+
+static void printProfileLine(const CallProfile &p)
+{
+    fprintf(stderr, "%10lld %12.3f %10.3f  %-16s %s\n", p.calls, p.nsecs / 1e6,
+            p.nsecs / 1e3 / p.calls, p.method, p.location.constData());
+}
+
+/*!
+ * Prints the time spent in each document method and the profileTop
+ * Lua lines whose calls took the longest to stderr.
+ */
+static void printProfile()
+{
+    QList<CallProfile> sites = profile.values();
+    QHash<const char*, CallProfile> methods;
+    qint64 totalCalls = 0;
+    qint64 totalNsecs = 0;
+    foreach (const CallProfile &site, sites) {
+        QHash<const char*, CallProfile>::iterator m = methods.find(site.method);
+        if (m == methods.end()) {
+            CallProfile p = {site.method, QByteArray(), 0, 0};
+            m = methods.insert(site.method, p);
+        }
+        m->calls += site.calls;
+        m->nsecs += site.nsecs;
+        totalCalls += site.calls;
+        totalNsecs += site.nsecs;
+    }
+    QList<CallProfile> byMethod = methods.values();
+    qSort(byMethod.begin(), byMethod.end(), longerThan);
+    qSort(sites.begin(), sites.end(), longerThan);
+
+    fprintf(stderr, "Lua API profile: %lld calls, %.3f ms in document methods\n", totalCalls, totalNsecs / 1e6);
+    fprintf(stderr, "%10s %12s %10s  %-16s %s\n", "calls", "total ms", "avg us", "method", "");
+    foreach (const CallProfile &m, byMethod)
+        printProfileLine(m);
+
+    fprintf(stderr, "\nTop %d lines:\n", profileTop);
+    fprintf(stderr, "%10s %12s %10s  %-16s %s\n", "calls", "total ms", "avg us", "method", "line");
+    for (int i = 0; i < sites.size() && i < profileTop; ++i)
+        printProfileLine(sites.at(i));
+}
+
+/*!
+ * libpalay.profile([top]) starts counting and timing calls to document
+ * methods. When a document is collected the time per method and the \a top
+ * (default 20) Lua lines that spent the most time in document methods are
+ * printed to stderr. profile(0) turns profiling off.
+ */
+static int startProfile(lua_State *L)
+{
+    int top = luaL_optinteger(L, 1, 20);
+    if (top < 0)
+        luaL_error(L, "Invalid number of lines %d for profile.", top);
+    profileTop = top;
+    profile.clear();
+    profileClock.start();
+    return 0;
 }
 
 static int gc(lua_State *L)
 {
     PalayDocument *doc = checkDocument(L, 1);
+    if (profileTop > 0) {
+        printProfile();
+        profile.clear();
+    }
     delete doc;
     return 0;
 }
 
 static const struct luaL_Reg palaylib_functions[] = {
     {"newDocument", newDocument},
+    {"profile", startProfile},
+    {"parseJson", parseJson},
+    {"readJson", readJson},
     {NULL, NULL}
 };
 
@@ -196,23 +925,74 @@ static const struct luaL_Reg palaydoc_methods[] = {
     {"startTable", startTable},
     {"cell", cell},
     {"endTable", endTable},
+    {"tableFromCsv", tableFromCsv},
     {"image", image},
     {"svg", svg},
     {"html", html},
     {"saveAs", saveAs},
+    {"saveSnapshot", saveSnapshot},
+    {"loadSnapshot", loadSnapshot},
+    {"creationDate", creationDate},
+    {"documentId", documentId},
+    {"getReferencedFiles", getReferencedFiles},
     {"getPageWidth", getPageWidth},
     {"getPageHeight", getPageHeight},
     {"getPageMargins", getPageMargins},
     {"getPageCount", getPageCount},
+    {"getFirstPageNumber", getFirstPageNumber},
+    {"pageRange", pageRange},
+    {"draftMode", draftMode},
+    {"imageResolution", imageResolution},
+    {"getStats", getStats},
+    {"buildMode", buildMode},
+    {"layoutThreads", layoutThreads},
+    {"pipelined", pipelined},
+    {"compression", compression},
+    {"directPdf", directPdf},
     {"pageSize", pageSize},
     {"pageMargins", pageMargins},
     {"pageBreak", pageBreak},
+    {"section", section},
     {"startBlock", startBlock},
     {"endBlock", endBlock},
+    {"startFragment", startFragment},
+    {"endFragment", endFragment},
+    {"insertFragment", insertFragment},
     {"__gc", gc},
     {NULL, NULL}
 };
 
+/*!
+ * Calls the document method at index upvalue 1 in palaydoc_methods
+ * and charges the time it takes to the edit phase (or whatever phases
+ * the method enters itself).
+ */
+static int dispatch(lua_State *L)
+{
+    PalayDocument *doc = checkDocument(L, 1);
+    RenderStats &stats = doc->stats();
+
+    // Back to the script phase in case a Lua error in the last call
+    // skipped leaving its phases.
+    stats.unwindTo(1);
+    stats.enter(RenderStats::Edit);
+    const luaL_Reg &method = palaydoc_methods[lua_tointeger(L, lua_upvalueindex(1))];
+#ifndef PALAY_NO_TRACE
+    // Not a trace scope: a Lua error would skip its destructor
+    const qint64 traceStart = Trace::isEnabled() ? Trace::now() : -1;
+#endif
+    const qint64 profileStart = profileTop > 0 ? profileClock.nsecsElapsed() : -1;
+    int nret = method.func(L);
+    if (profileStart >= 0)
+        recordCall(L, method.name, profileClock.nsecsElapsed() - profileStart);
+#ifndef PALAY_NO_TRACE
+    if (traceStart >= 0)
+        Trace::complete("api", method.name, traceStart);
+#endif
+    stats.leave();
+    return nret;
+}
+
 extern "C" {
     /* This function is called when the module is loaded from Lua
      * via require() e.g. require("libpalay").
@@ -233,7 +1013,21 @@ extern "C" {
         lua_pushstring(L, "__index");
         lua_pushvalue(L, -2);  // pushes the metatable
         lua_settable(L, -3);  // metatable.__index = metatable
-        luaL_setfuncs(L, palaydoc_methods, 0);
+        for (int i = 0; palaydoc_methods[i].name; ++i) {
+            if (palaydoc_methods[i].func == gc) {
+                // The document is gone after this, so don't time it
+                lua_pushcfunction(L, gc);
+            } else {
+                lua_pushinteger(L, i);
+                lua_pushcclosure(L, dispatch, 1);
+            }
+            lua_setfield(L, -2, palaydoc_methods[i].name);
+        }
+
+        luaL_newmetatable(L, dataMetatableName);
+        luaL_setfuncs(L, palaydata_methods, 0);
+        lua_pop(L, 1);
+
         luaL_newlib(L, palaylib_functions);
 
         return 1;
@@ -5,7 +5,7 @@
 #-------------------------------------------------
 
 QT       += core gui svg
-greaterThan(QT_MAJOR_VERSION, 4): QT += printsupport
+greaterThan(QT_MAJOR_VERSION, 4): QT += printsupport concurrent
 
 win32 {
     TARGET = libpalay
@@ -22,7 +22,17 @@ SOURCES += PalayDocument.cpp \
            libpalay.cpp \
     AbsoluteBlock.cpp \
     SvgVectorTextObject.cpp \
-    BitmapTextObject.cpp
+    BitmapTextObject.cpp \
+    ImagePreprocessor.cpp \
+    RenderStats.cpp \
+    Trace.cpp \
+    HtmlImporter.cpp \
+    CsvReader.cpp \
+    JsonParser.cpp \
+    PdfMetadata.cpp \
+    PdfCompressor.cpp \
+    PdfWriter.cpp \
+    DocumentSerializer.cpp
 
 
 HEADERS +=\
@@ -31,7 +41,17 @@ HEADERS +=\
         libpalay.h \
     AbsoluteBlock.h \
     SvgVectorTextObject.h \
-    BitmapTextObject.h
+    BitmapTextObject.h \
+    ImagePreprocessor.h \
+    RenderStats.h \
+    Trace.h \
+    HtmlImporter.h \
+    CsvReader.h \
+    JsonParser.h \
+    PdfMetadata.h \
+    PdfCompressor.h \
+    PdfWriter.h \
+    DocumentSerializer.h
 
 unix:cross_compile {
     LIBS += -llua -ldl
@@ -44,11 +64,16 @@ unix:!cross_compile {
 }
 
 win32 {
-    LIBS += -llua52
+    LIBS += -llua52 -lpsapi
 }
 
 
 unix {
     target.path = /usr/lib
     INSTALLS += target
+
+    # For C++ applications that use PalayDocument directly
+    headers.path = /usr/include/palay
+    headers.files = libpalay_global.h PalayDocument.h RenderStats.h
+    INSTALLS += headers
 }
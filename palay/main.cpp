@@ -23,17 +23,98 @@ extern "C"
 
 #include <QApplication>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include <QFile>
 #include "libpalay.h"
+#include "PalayDocument.h"
+#include "Trace.h"
 #include <QTextStream>
+#include <QStringList>
+#include <QElapsedTimer>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QTemporaryFile>
 
 static void usage(const char *argv0)
 {
     fprintf(stderr, "Usage: %s [args] <script>\n", argv0);
     fprintf(stderr, "  -o Output file name\n");
-    fprintf(stderr, "  -p Page size (Letter|A4)\n");
+    fprintf(stderr, "  -p Page size (Letter|A4), Letter or the snapshot's size if not given\n");
     fprintf(stderr, "  -f Output format (pdf|ps|odf|html|txt)\n");
+    fprintf(stderr, "  -r, --pages <first>[-[last]] Only paint the given page range\n");
+    fprintf(stderr, "  -d, --draft Draft output: low resolution, image proxies and SVG placeholders\n");
+    fprintf(stderr, "  -i, --image-dpi <dpi> Downsample images to this resolution at their placed size\n");
+    fprintf(stderr, "  -s, --stats[=json] Print time spent in each phase, peak memory and document size to stderr\n");
+    fprintf(stderr, "  -t, --trace <file> Write a Chrome trace event file of the rendering\n");
+    fprintf(stderr, "  -j, --threads <n> Lay out up to n sections at the same time\n");
+    fprintf(stderr, "  --pipeline Compress and write each page in the background while the next one is painted (with --direct-pdf)\n");
+    fprintf(stderr, "  --compression <level> Compression of PDF streams (fast|default|max), fast and max need --direct-pdf\n");
+    fprintf(stderr, "  --direct-pdf Write the PDF with palay's own writer: smaller files with object streams\n");
+    fprintf(stderr, "  --build-mode Drop undo history and only update the layout once the document is built\n");
+    fprintf(stderr, "  -D, --data <file> Parse a JSON file and pass it to the script as the global data\n");
+    fprintf(stderr, "  -m, --merge <file> Run the script once per line of a JSON lines file with the line as data.\n");
+    fprintf(stderr, "                     Writes one file per record if the output file name has %%d in it.\n");
+    fprintf(stderr, "  --creation-date <date> Creation date for the PDF, ISO 8601 or seconds since 1970, for reproducible output\n");
+    fprintf(stderr, "  -c, --cache <dir> Reuse the PDF from an earlier run with the same script, data, files and options\n");
+    fprintf(stderr, "  --snapshot <file> Also save the built document so it can be rendered again without the script\n");
+    fprintf(stderr, "  --from-snapshot <file> Render a saved document instead of running a script\n");
+    fprintf(stderr, "  -P, --profile[=N] Print calls and time per document method and the N (default 20) slowest Lua lines to stderr\n");
+}
+
+struct PalayOptions {
+    PalayOptions() : outputFormat("pdf"), firstPage(1), lastPage(0), draft(false), imageDpi(0), stats(false), statsJson(false), profileTop(0), layoutThreads(1), pipelined(false), compression("default"), directPdf(false), buildMode(false) {}
+
+    QString outputFilename;
+    QString pageSize;       // empty means the document's own page size
+    QString outputFormat;
+    int firstPage;
+    int lastPage;   // 0 means to the end of the document
+    bool draft;
+    int imageDpi;   // 0 means full resolution
+    bool stats;
+    bool statsJson;
+    QString traceFilename;
+    int profileTop;     // 0 means no profiling
+    QString dataFilename;
+    QString mergeFilename;  // JSON lines file of records to merge
+    QString creationDate;   // empty means the current time
+    QString cacheDir;
+    QString snapshotFilename;       // written after the script runs
+    QString fromSnapshotFilename;   // rendered instead of a script
+    int layoutThreads;
+    bool pipelined;
+    QString compression;
+    bool directPdf;
+    bool buildMode;
+};
+
+/*!
+ * Parses a page range of the form "3", "1-3" or "2-" (to the end
+ * of the document).
+ */
+static bool parsePageRange(const QString &range, int *firstPage, int *lastPage)
+{
+    QStringList parts = range.split('-');
+    if (parts.size() > 2)
+        return false;
+
+    bool ok;
+    *firstPage = parts.at(0).toInt(&ok);
+    if (!ok || *firstPage < 1)
+        return false;
+
+    if (parts.size() == 1) {
+        *lastPage = *firstPage;
+    } else if (parts.at(1).isEmpty()) {
+        *lastPage = 0;
+    } else {
+        *lastPage = parts.at(1).toInt(&ok);
+        if (!ok || *lastPage < *firstPage)
+            return false;
+    }
+    return true;
 }
 
 /*!
@@ -49,24 +130,33 @@ static int pushLuaStackTrace(lua_State *L)
     return 1;
 }
 
-static bool runLuaScript(lua_State *L, const QByteArray &script, const QString &scriptFilename)
+/*!
+ * Calls the function on top of the stack with a stack trace for errors.
+ */
+static bool callLuaFunction(lua_State *L, const QString &scriptFilename)
 {
     lua_pushcfunction(L, pushLuaStackTrace);
-    int errhandlerIndex = lua_gettop(L);
+    lua_insert(L, -2);
+    int errhandlerIndex = lua_gettop(L) - 1;
 
-    if (luaL_loadbuffer(L, script, script.count(), scriptFilename.toUtf8().constData())) {
+    if (lua_pcall(L, 0, 0, errhandlerIndex)) {
         fprintf(stderr, "Error executing %s.\n%s", qPrintable(scriptFilename), lua_tostring(L, -1));
         return false;
     }
 
-    if (lua_pcall(L, 0, LUA_MULTRET, errhandlerIndex)) {
+    lua_remove(L, errhandlerIndex); // clear error handler from stack
+
+    return true;
+}
+
+static bool runLuaScript(lua_State *L, const QByteArray &script, const QString &scriptFilename)
+{
+    if (luaL_loadbuffer(L, script, script.count(), scriptFilename.toUtf8().constData())) {
         fprintf(stderr, "Error executing %s.\n%s", qPrintable(scriptFilename), lua_tostring(L, -1));
         return false;
     }
 
-    lua_remove(L, errhandlerIndex); // clear error handler from stack
-
-    return true;
+    return callLuaFunction(L, scriptFilename);
 }
 
 static int savePalayDocument(lua_State *L)
@@ -104,9 +194,66 @@ static int callWithDoc(lua_State *L)
     return nret;
 }
 
-static int runPalayScript(const QByteArray &script, const QString &scriptFilename,
-                          const QString &outputFilename, const QString &outputFormat,
-                          const QString &pageSize)
+static const char *statisticNames[] = {
+    "script_seconds", "edit_seconds", "layout_seconds", "register_seconds",
+    "paint_seconds", "write_seconds", "total_seconds",
+    "peak_rss_kb", "pages", "blocks", "formats", "frames",
+    "absolute_blocks", "images", "svgs"
+};
+
+/*!
+ * Prints document statistics to stderr as text or JSON.
+ */
+static void printStatistics(const QVariantMap &statistics, bool json)
+{
+    const size_t count = sizeof(statisticNames) / sizeof(statisticNames[0]);
+
+    if (json)
+        fprintf(stderr, "{");
+    for (size_t i = 0; i < count; ++i) {
+        const char *name = statisticNames[i];
+        double value = statistics.value(name).toDouble();
+
+        const bool seconds = strstr(name, "_seconds") != 0;
+        if (json) {
+            fprintf(stderr, seconds ? "%s\"%s\": %.6f" : "%s\"%s\": %.0f", i == 0 ? "" : ", ", name, value);
+        } else {
+            fprintf(stderr, seconds ? "%-18s %10.3f\n" : "%-18s %10.0f\n", name, value);
+        }
+    }
+    if (json)
+        fprintf(stderr, "}\n");
+}
+
+/*!
+ * Prints the table returned by the document's getStats() method
+ * to stderr as text or JSON.
+ */
+static bool printStats(lua_State *L, bool json)
+{
+    lua_getglobal(L, "getStats");
+    if (lua_pcall(L, 0, 1, 0)) {
+        fprintf(stderr, "Error getting statistics.\n%s", lua_tostring(L, -1));
+        return false;
+    }
+
+    QVariantMap statistics;
+    for (size_t i = 0; i < sizeof(statisticNames) / sizeof(statisticNames[0]); ++i) {
+        lua_getfield(L, -1, statisticNames[i]);
+        statistics[statisticNames[i]] = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    printStatistics(statistics, json);
+    return true;
+}
+
+/*!
+ * Creates a Lua state with libpalay loaded at index 1 of the stack and
+ * its constants set as globals.
+ */
+static lua_State *newPalayState(const PalayOptions &options)
 {
     lua_State *L = luaL_newstate();
     luaL_openlibs(L);
@@ -114,6 +261,23 @@ static int runPalayScript(const QByteArray &script, const QString &scriptFilenam
     // require "libpalay"
     luaL_requiref(L, "libpalay", luaopen_libpalay, 0);
 
+    if (options.profileTop > 0) {
+        lua_getfield(L, 1, "profile");
+        lua_pushinteger(L, options.profileTop);
+        lua_call(L, 1, 0);
+    }
+
+    if (!options.dataFilename.isEmpty()) {
+        lua_getfield(L, 1, "readJson");
+        lua_pushstring(L, options.dataFilename.toUtf8());
+        if (lua_pcall(L, 1, 1, 0)) {
+            fprintf(stderr, "Error reading data.\n%s", lua_tostring(L, -1));
+            lua_close(L);
+            return 0;
+        }
+        lua_setglobal(L, "data");
+    }
+
     // Set constants defined in libpalay in global environment
     // Anything the libpalay table that isn't function we treat
     // as a constant.
@@ -125,62 +289,493 @@ static int runPalayScript(const QByteArray &script, const QString &scriptFilenam
             lua_pop(L, 1);
         }
     }
+    return L;
+}
 
+/*!
+ * Creates a document with libpalay.newDocument (libpalay is at index 1),
+ * exposes its methods as global functions and applies the options.
+ * Calling this again replaces the document the globals use.
+ */
+static bool newPalayDocument(lua_State *L, const PalayOptions &options)
+{
     // Call libpalay.newDocument
     lua_getfield(L, 1, "newDocument");
     lua_call(L, 0, 1);
 
     // Expose all the methods in the document
     // as global functions (closures with the document as an upvalue).
+    int docIndex = lua_gettop(L);
     lua_getmetatable(L, -1);
     lua_pushnil(L);
     while (lua_next(L, -2) != 0) {
         if (lua_isfunction(L, -1)) {
-            lua_pushvalue(L, 2); // palaydocument
+            lua_pushvalue(L, docIndex); // palaydocument
             lua_pushcclosure(L, callWithDoc, 2);
             lua_setglobal(L, lua_tostring(L, -2)); // _G[key] = closure
         } else {
             lua_pop(L, 1);
         }
     }
-    lua_pop(L, 3);
+    lua_pop(L, 2);
 
     // Set the page size
-    lua_getglobal(L, "pageSize");
-    lua_pushstring(L, pageSize.toUtf8());
+    if (!options.pageSize.isEmpty()) {
+        lua_getglobal(L, "pageSize");
+        lua_pushstring(L, options.pageSize.toUtf8());
+        if (lua_pcall(L, 1, 0, 0)) {
+            fprintf(stderr, "Error setting page size.\n%s", lua_tostring(L, -1));
+            return false;
+        }
+    }
+
+    // Set the range of pages to paint
+    lua_getglobal(L, "pageRange");
+    lua_pushinteger(L, options.firstPage);
+    lua_pushinteger(L, options.lastPage);
+    if (lua_pcall(L, 2, 0, 0)) {
+        fprintf(stderr, "Error setting page range.\n%s", lua_tostring(L, -1));
+        return false;
+    }
+
+    lua_getglobal(L, "draftMode");
+    lua_pushboolean(L, options.draft);
     if (lua_pcall(L, 1, 0, 0)) {
-        fprintf(stderr, "Error setting page size.\n%s", lua_tostring(L, -1));
-        lua_close(L);
-        return -1;
+        fprintf(stderr, "Error setting draft mode.\n%s", lua_tostring(L, -1));
+        return false;
+    }
+
+    lua_getglobal(L, "imageResolution");
+    lua_pushinteger(L, options.imageDpi);
+    if (lua_pcall(L, 1, 0, 0)) {
+        fprintf(stderr, "Error setting image resolution.\n%s", lua_tostring(L, -1));
+        return false;
+    }
+
+    lua_getglobal(L, "buildMode");
+    lua_pushboolean(L, options.buildMode);
+    if (lua_pcall(L, 1, 0, 0)) {
+        fprintf(stderr, "Error setting build mode.\n%s", lua_tostring(L, -1));
+        return false;
+    }
+
+    lua_getglobal(L, "layoutThreads");
+    lua_pushinteger(L, options.layoutThreads);
+    if (lua_pcall(L, 1, 0, 0)) {
+        fprintf(stderr, "Error setting layout threads.\n%s", lua_tostring(L, -1));
+        return false;
     }
 
-    // Run the init script
+    lua_getglobal(L, "pipelined");
+    lua_pushboolean(L, options.pipelined);
+    if (lua_pcall(L, 1, 0, 0)) {
+        fprintf(stderr, "Error setting pipelined writing.\n%s", lua_tostring(L, -1));
+        return false;
+    }
+
+    lua_getglobal(L, "compression");
+    lua_pushstring(L, options.compression.toUtf8());
+    if (lua_pcall(L, 1, 0, 0)) {
+        fprintf(stderr, "Error setting compression.\n%s", lua_tostring(L, -1));
+        return false;
+    }
+
+    lua_getglobal(L, "directPdf");
+    lua_pushboolean(L, options.directPdf);
+    if (lua_pcall(L, 1, 0, 0)) {
+        fprintf(stderr, "Error setting the direct PDF writer.\n%s", lua_tostring(L, -1));
+        return false;
+    }
+
+    if (!options.creationDate.isEmpty()) {
+        lua_getglobal(L, "creationDate");
+        bool isSeconds;
+        uint seconds = options.creationDate.toUInt(&isSeconds);
+        if (isSeconds)
+            lua_pushinteger(L, seconds);
+        else
+            lua_pushstring(L, options.creationDate.toUtf8());
+        if (lua_pcall(L, 1, 0, 0)) {
+            fprintf(stderr, "Error setting creation date.\n%s", lua_tostring(L, -1));
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool runInitScript(lua_State *L)
+{
     QFile initScriptFile(":/resources/scripts/init.lua");
     if (!initScriptFile.open(QFile::ReadOnly)) {
         fprintf(stderr, "Error in init script.\n%s", lua_tostring(L, -1));
+        return false;
+    }
+    PALAY_TRACE_SCOPE("script", "init.lua");
+    return runLuaScript(L, initScriptFile.readAll(), "init.lua");
+}
+
+static bool saveDocument(lua_State *L, const QString &filename)
+{
+    lua_pushcfunction(L, savePalayDocument);
+    lua_pushstring(L, filename.toUtf8());
+    if (lua_pcall(L, 1, 0, 0)) {
+        fprintf(stderr, "Error writing file %s.\n%s", qPrintable(filename), lua_tostring(L, -1));
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * Runs the script and saves the document. If \a referencedFiles isn't null
+ * it is set to the files that the document was built from.
+ */
+static int runPalayScript(const QByteArray &script, const QString &scriptFilename,
+                          const PalayOptions &options, QStringList *referencedFiles = 0)
+{
+    lua_State *L = newPalayState(options);
+    if (!L)
+        return -1;
+
+    if (!newPalayDocument(L, options) || !runInitScript(L)) {
         lua_close(L);
         return -1;
     }
-    if (!runLuaScript(L, initScriptFile.readAll(), "init.lua")) {
+
+    // Run the Lua script
+    {
+        PALAY_TRACE_SCOPE("script", "script");
+        if (!runLuaScript(L, script, scriptFilename)) {
+            lua_close(L);
+            return -1;
+        }
+    }
+
+    // Before saving, which inserts the images into the document
+    if (!options.snapshotFilename.isEmpty()) {
+        lua_getglobal(L, "saveSnapshot");
+        lua_pushstring(L, options.snapshotFilename.toUtf8());
+        if (lua_pcall(L, 1, 0, 0)) {
+            fprintf(stderr, "Error writing snapshot.\n%s", lua_tostring(L, -1));
+            lua_close(L);
+            return -1;
+        }
+    }
+
+    if (!saveDocument(L, options.outputFilename))
+        return -1;
+
+    if (options.stats && !printStats(L, options.statsJson)) {
         lua_close(L);
         return -1;
     }
 
-    // Run the Lua script
-    if (!runLuaScript(L, script, scriptFilename)) {
+    if (referencedFiles) {
+        lua_getglobal(L, "getReferencedFiles");
+        lua_call(L, 0, 1);
+        size_t count = lua_rawlen(L, -1);
+        for (size_t i = 1; i <= count; ++i) {
+            lua_rawgeti(L, -1, i);
+            *referencedFiles << QString::fromUtf8(lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_close(L);
+
+    return 0;
+}
+
+/*!
+ * Renders a document saved with --snapshot with the page size, page range
+ * and other rendering options, without Lua.
+ */
+static int renderSnapshot(const PalayOptions &options)
+{
+    PalayDocument doc;
+    if (!doc.loadSnapshot(options.fromSnapshotFilename) ||
+            (!options.pageSize.isEmpty() && !doc.setPageSize(options.pageSize)) ||
+            !doc.setPageRange(options.firstPage, options.lastPage) ||
+            !doc.setImageResolution(options.imageDpi) ||
+            !doc.setCompression(options.compression)) {
+        fprintf(stderr, "%s\n", qPrintable(doc.errorString()));
+        return -1;
+    }
+    doc.setDraftMode(options.draft);
+    doc.setPipelined(options.pipelined);
+    doc.setDirectPdf(options.directPdf);
+
+    if (!options.creationDate.isEmpty()) {
+        bool isSeconds;
+        uint seconds = options.creationDate.toUInt(&isSeconds);
+        QDateTime date = isSeconds ? QDateTime::fromTime_t(seconds).toUTC() : QDateTime::fromString(options.creationDate, Qt::ISODate);
+        if (!date.isValid()) {
+            fprintf(stderr, "\"%s\" is not a valid date\n", qPrintable(options.creationDate));
+            return -1;
+        }
+        doc.setCreationDate(date);
+    }
+
+    if (!doc.saveAs(options.outputFilename)) {
+        fprintf(stderr, "%s\n", qPrintable(doc.errorString()));
+        return -1;
+    }
+
+    if (options.stats)
+        printStatistics(doc.statistics(), options.statsJson);
+    return 0;
+}
+
+/*!
+ * Returns the options that change the output, for the cache key. Options
+ * that change the output have to be added here when they are added to
+ * PalayOptions.
+ */
+static QByteArray outputOptionsKey(const PalayOptions &options)
+{
+    QStringList values;
+    values << options.pageSize << options.outputFormat
+           << QString::number(options.firstPage) << QString::number(options.lastPage)
+           << QString::number(options.draft) << QString::number(options.imageDpi)
+           << QString::number(options.buildMode) << options.creationDate
+           << options.compression << QString::number(options.directPdf)
+           << QString::number(options.pipelined);
+    return values.join("|").toUtf8();
+}
+
+/*!
+ * Adds the SHA-1 of the contents of \a filename to \a hash. The file is
+ * read in chunks so large images and data files are never all in memory.
+ * Returns false if the file can't be read.
+ */
+static bool addFileHash(QCryptographicHash *hash, const QString &filename)
+{
+    QFile file(filename);
+    if (!file.open(QFile::ReadOnly))
+        return false;
+    QCryptographicHash contents(QCryptographicHash::Sha1);
+    while (!file.atEnd()) {
+        const QByteArray chunk = file.read(1 << 20);
+        if (chunk.isEmpty())
+            return false;
+        contents.addData(chunk);
+    }
+    hash->addData(contents.result());
+    return true;
+}
+
+/*!
+ * Returns the key of the files that a cached document was built from:
+ * \a baseKey combined with the names and contents of \a files.
+ */
+static QByteArray filesKey(const QByteArray &baseKey, const QStringList &files)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(baseKey);
+    foreach (const QString &filename, files) {
+        hash.addData(filename.toUtf8());
+        if (!addFileHash(&hash, filename))
+            hash.addData("missing");
+    }
+    return hash.result().toHex();
+}
+
+/*!
+ * Runs the script unless the same script, data, options and referenced
+ * files were rendered before, in which case the earlier PDF is copied
+ * from options.cacheDir.
+ *
+ * Which files a script uses is only known once it has run, so the cache
+ * works in two steps. The hash of the script, the data file, the options
+ * and the libpalay build names a list of the files used last time, and the
+ * hash of that together with the contents of those files names the PDF.
+ * Scripts that read other files themselves or depend on the time are
+ * not cached correctly.
+ */
+static int runCached(const QByteArray &script, const QString &scriptFilename,
+                     const PalayOptions &options)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(qVersion());
+    hash.addData(PalayDocument::buildId());
+    hash.addData(outputOptionsKey(options));
+    hash.addData(QCryptographicHash::hash(script, QCryptographicHash::Sha1));
+    if (!options.dataFilename.isEmpty())
+        addFileHash(&hash, options.dataFilename);
+    const QByteArray baseKey = hash.result().toHex();
+
+    QDir cacheDir(options.cacheDir);
+    if (!cacheDir.mkpath(".")) {
+        fprintf(stderr, "Error creating cache directory %s\n", qPrintable(options.cacheDir));
+        return -1;
+    }
+
+    QFile manifest(cacheDir.filePath(baseKey + ".files"));
+    if (manifest.open(QFile::ReadOnly)) {
+        QStringList files = QString::fromUtf8(manifest.readAll()).split('\n', QString::SkipEmptyParts);
+        QString cached = cacheDir.filePath(filesKey(baseKey, files) + ".pdf");
+        if (QFile::exists(cached)) {
+            QFile::remove(options.outputFilename);
+            if (QFile::copy(cached, options.outputFilename)) {
+                // Nothing was rendered, so there are no other statistics
+                if (options.stats && options.statsJson)
+                    fprintf(stderr, "{\"cache_hit\": 1}\n");
+                else if (options.stats)
+                    fprintf(stderr, "%-18s %10d\n", "cache_hit", 1);
+                return 0;
+            }
+        }
+        manifest.close();
+    }
+
+    QStringList files;
+    int result = runPalayScript(script, scriptFilename, options, &files);
+    if (result != 0)
+        return result;
+
+    // Failing to add to the cache isn't an error, the PDF was written.
+    // The list is written to a temporary file and renamed so another
+    // palay using the cache never reads half of it.
+    QTemporaryFile newManifest(manifest.fileName() + "-XXXXXX");
+    newManifest.setAutoRemove(false);
+    if (newManifest.open()) {
+        const bool written = newManifest.write(files.join("\n").toUtf8()) >= 0;
+        newManifest.close();
+        QFile::remove(manifest.fileName());
+        if (!written || !QFile::rename(newManifest.fileName(), manifest.fileName())) {
+            QFile::remove(newManifest.fileName());
+            return 0;
+        }
+        QString cached = cacheDir.filePath(filesKey(baseKey, files) + ".pdf");
+        QString temporary = cached + ".tmp";
+        QFile::remove(temporary);
+        if (QFile::copy(options.outputFilename, temporary)) {
+            QFile::remove(cached);
+            QFile::rename(temporary, cached);
+        }
+    }
+    return 0;
+}
+
+/*!
+ * Runs the script once for each record in options.mergeFilename, a file
+ * with one JSON value per line, with the record as the global data and
+ * its number as the global record. If the output file name has %d in it
+ * each record is written to its own file with %d replaced by the record
+ * number, otherwise the records are written to one file, each in its own
+ * section so it starts on a new page and its headers, footers and page
+ * numbers only cover its own pages.
+ *
+ * Everything that doesn't depend on the record is done once: the script
+ * is compiled once, init.lua and anything else global persist in the one
+ * Lua state, and images and SVGs are read, decoded and parsed once by
+ * libpalay's caches.
+ */
+static int runMerge(const QByteArray &script, const QString &scriptFilename,
+                    const PalayOptions &options)
+{
+    QFile records(options.mergeFilename);
+    if (!records.open(QFile::ReadOnly)) {
+        fprintf(stderr, "Error opening file %s: %s\n", qPrintable(options.mergeFilename), qPrintable(records.errorString()));
+        return -1;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    lua_State *L = newPalayState(options);
+    if (!L)
+        return -1;
+
+    if (!newPalayDocument(L, options) || !runInitScript(L)) {
         lua_close(L);
         return -1;
     }
 
-    lua_pushcfunction(L, savePalayDocument);
-    lua_pushstring(L, outputFilename.toUtf8());
-    if (lua_pcall(L, 1, 0, 0)) {
-        fprintf(stderr, "Error writing file %s.\n%s", qPrintable(outputFilename), lua_tostring(L, -1));
+    if (luaL_loadbuffer(L, script, script.count(), scriptFilename.toUtf8().constData())) {
+        fprintf(stderr, "Error executing %s.\n%s", qPrintable(scriptFilename), lua_tostring(L, -1));
+        lua_close(L);
+        return -1;
+    }
+    int scriptRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    const bool separate = options.outputFilename.contains("%d");
+    int count = 0;
+    int lineNumber = 0;
+    while (!records.atEnd()) {
+        QByteArray line = records.readLine().trimmed();
+        ++lineNumber;
+        if (line.isEmpty())
+            continue;
+        ++count;
+
+        if (count > 1) {
+            if (separate) {
+                if (!newPalayDocument(L, options)) {
+                    lua_close(L);
+                    return -1;
+                }
+                // Lua doesn't know how big the replaced document is,
+                // so free it now rather than when Lua gets around to it
+                lua_gc(L, LUA_GCCOLLECT, 0);
+            } else {
+                lua_getglobal(L, "section");
+                lua_pushboolean(L, true);
+                if (lua_pcall(L, 1, 0, 0)) {
+                    fprintf(stderr, "Error in record on line %d of %s.\n%s\n", lineNumber, qPrintable(options.mergeFilename), lua_tostring(L, -1));
+                    lua_close(L);
+                    return -1;
+                }
+            }
+        }
+
+        lua_getfield(L, 1, "parseJson");
+        lua_pushlstring(L, line.constData(), line.size());
+        if (lua_pcall(L, 1, 1, 0)) {
+            fprintf(stderr, "Error in record on line %d of %s.\n%s\n", lineNumber, qPrintable(options.mergeFilename), lua_tostring(L, -1));
+            lua_close(L);
+            return -1;
+        }
+        lua_setglobal(L, "data");
+        lua_pushinteger(L, count);
+        lua_setglobal(L, "record");
+
+        {
+            PALAY_TRACE_SCOPE("script", "script");
+            lua_rawgeti(L, LUA_REGISTRYINDEX, scriptRef);
+            if (!callLuaFunction(L, scriptFilename)) {
+                fprintf(stderr, "In record on line %d of %s.\n", lineNumber, qPrintable(options.mergeFilename));
+                lua_close(L);
+                return -1;
+            }
+        }
+
+        if (separate && !saveDocument(L, QString(options.outputFilename).replace("%d", QString::number(count)))) {
+            lua_close(L);
+            return -1;
+        }
+    }
+
+    if (count == 0) {
+        fprintf(stderr, "No records in %s\n", qPrintable(options.mergeFilename));
+        lua_close(L);
+        return -1;
+    }
+    if (!separate && !saveDocument(L, options.outputFilename)) {
+        lua_close(L);
         return -1;
     }
 
+    if (options.stats && !printStats(L, options.statsJson)) {
+        lua_close(L);
+        return -1;
+    }
     lua_close(L);
 
+    const double seconds = timer.elapsed() / 1000.0;
+    fprintf(stderr, "Merged %d records into %d file%s in %.3f s (%.1f documents/s)\n",
+            count, separate ? count : 1, separate && count > 1 ? "s" : "",
+            seconds, seconds > 0 ? count / seconds : 0.0);
     return 0;
 }
 
@@ -192,18 +787,109 @@ int main(int argc, char *argv[])
     QApplication a(argc, argv, false);
 #endif
 
-    QString outputFilename;
-    QString pageSize = "Letter";
-    QString outputFormat("pdf");
+    PalayOptions options;
+
+    static const struct option longOptions[] = {
+        {"pages", required_argument, 0, 'r'},
+        {"draft", no_argument, 0, 'd'},
+        {"image-dpi", required_argument, 0, 'i'},
+        {"stats", optional_argument, 0, 's'},
+        {"trace", required_argument, 0, 't'},
+        {"profile", optional_argument, 0, 'P'},
+        {"build-mode", no_argument, 0, 'B'},
+        {"data", required_argument, 0, 'D'},
+        {"merge", required_argument, 0, 'm'},
+        {"creation-date", required_argument, 0, 'C'},
+        {"cache", required_argument, 0, 'c'},
+        {"snapshot", required_argument, 0, 'S'},
+        {"from-snapshot", required_argument, 0, 'F'},
+        {"threads", required_argument, 0, 'j'},
+        {"pipeline", no_argument, 0, 'L'},
+        {"compression", required_argument, 0, 'Z'},
+        {"direct-pdf", no_argument, 0, 'W'},
+        {0, 0, 0, 0}
+    };
 
     int opt;
-    while ((opt = getopt(argc, argv, "o:p:f:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "o:p:f:r:di:s::t:P::D:m:c:j:", longOptions, 0)) != -1) {
         switch (opt) {
         case 'o':
-            outputFilename = optarg;
+            options.outputFilename = optarg;
             break;
         case 'p':
-            pageSize = optarg;
+            options.pageSize = optarg;
+            break;
+        case 'r':
+            if (!parsePageRange(optarg, &options.firstPage, &options.lastPage)) {
+                fprintf(stderr, "Invalid page range %s. Try something like 1-3, 2 or 4-\n", optarg);
+                return -1;
+            }
+            break;
+        case 'd':
+            options.draft = true;
+            break;
+        case 'i':
+            options.imageDpi = atoi(optarg);
+            if (options.imageDpi <= 0) {
+                fprintf(stderr, "Invalid image resolution %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 's':
+            options.stats = true;
+            if (optarg && strcmp(optarg, "json") == 0) {
+                options.statsJson = true;
+            } else if (optarg && strcmp(optarg, "text") != 0) {
+                fprintf(stderr, "Unsupported statistics format %s. Try text or json\n", optarg);
+                return -1;
+            }
+            break;
+        case 't':
+            options.traceFilename = optarg;
+            break;
+        case 'P':
+            options.profileTop = optarg ? atoi(optarg) : 20;
+            if (options.profileTop <= 0) {
+                fprintf(stderr, "Invalid number of lines to profile %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'B':
+            options.buildMode = true;
+            break;
+        case 'D':
+            options.dataFilename = optarg;
+            break;
+        case 'm':
+            options.mergeFilename = optarg;
+            break;
+        case 'C':
+            options.creationDate = optarg;
+            break;
+        case 'c':
+            options.cacheDir = optarg;
+            break;
+        case 'S':
+            options.snapshotFilename = optarg;
+            break;
+        case 'F':
+            options.fromSnapshotFilename = optarg;
+            break;
+        case 'L':
+            options.pipelined = true;
+            break;
+        case 'Z':
+            options.compression = optarg;
+            break;
+        case 'W':
+            options.directPdf = true;
+            break;
+        case 'j':
+            options.layoutThreads = atoi(optarg);
+            if (options.layoutThreads <= 0) {
+                fprintf(stderr, "Invalid number of threads %s\n", optarg);
+                return -1;
+            }
             break;
         case 'f':
             if (strcmp(optarg, "pdf") == 0 ||
@@ -211,7 +897,7 @@ int main(int argc, char *argv[])
                 strcmp(optarg, "odf") == 0 ||
                 strcmp(optarg, "html") == 0 ||
                 strcmp(optarg, "txt"))
-                outputFormat = optarg;
+                options.outputFormat = optarg;
             else {
                 fprintf(stderr, "Unsupported output format\n");
                 return -1;
@@ -223,11 +909,30 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (outputFilename.isNull()) {
+    if (options.outputFilename.isNull()) {
         usage(argv[0]);
         return -1;
     }
 
+    // A cache hit doesn't run the script, so there would be no snapshot
+    if (!options.cacheDir.isNull() && !options.snapshotFilename.isEmpty()) {
+        fprintf(stderr, "--snapshot can't be used with --cache\n");
+        return -1;
+    }
+
+    if (!options.fromSnapshotFilename.isNull()) {
+        if (optind != argc) {
+            usage(argv[0]);
+            return -1;
+        }
+        if (!options.traceFilename.isNull())
+            Trace::start(options.traceFilename);
+        int result = renderSnapshot(options);
+        if (!options.traceFilename.isNull() && !Trace::stop())
+            result = -1;
+        return result;
+    }
+
     QByteArray script;
     QString scriptFilename;
 
@@ -252,5 +957,24 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    return runPalayScript(script, scriptFilename, outputFilename, outputFormat, pageSize);
+    if (!options.traceFilename.isNull())
+        Trace::start(options.traceFilename);
+
+    int result;
+    if (!options.mergeFilename.isNull()) {
+        result = runMerge(script, scriptFilename, options);
+    } else if (!options.cacheDir.isNull()) {
+        // Cached PDFs have to be the same as the ones they replace
+        if (options.creationDate.isEmpty()) {
+            QByteArray epoch = qgetenv("SOURCE_DATE_EPOCH");
+            options.creationDate = epoch.isEmpty() ? QString("0") : QString(epoch);
+        }
+        result = runCached(script, scriptFilename, options);
+    } else {
+        result = runPalayScript(script, scriptFilename, options);
+    }
+
+    if (!options.traceFilename.isNull() && !Trace::stop())
+        result = -1;
+    return result;
 }
@@ -20,7 +20,7 @@ function header(content)
         pushStyle({width = getPageWidth() - leftMargin - rightMargin, height = topMargin})
         startBlock("BottomLeft", leftMargin, (i - 1) * getPageHeight() + topMargin)
         if type(content) == "function" then
-          text(content(i, getPageCount()))
+          text(content(getFirstPageNumber() + i - 1, getPageCount()))
         else
           text(content)
         end
@@ -37,7 +37,7 @@ function footer(content)
         pushStyle({width = getPageWidth() - leftMargin - rightMargin, height = bottomMargin})
         startBlock("TopLeft", leftMargin, i * getPageHeight() - bottomMargin)
         if type(content) == "function" then
-          text(content(i, getPageCount()))
+          text(content(getFirstPageNumber() + i - 1, getPageCount()))
         else
           text(content)
         end
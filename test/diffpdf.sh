@@ -18,8 +18,21 @@ if [ "$1" = "-w" ]; then
     shift
 fi
 
-PDF1=$1
-PDF2=$2
+# run_tests.sh -e compares with expected-name.pdf where a test has one
+variant() {
+    case $(basename $1) in
+        expected*.pdf)
+            if [ -n "$EXPECTED_VARIANT" ] && [ -f "${1%.pdf}-$EXPECTED_VARIANT.pdf" ]; then
+                echo "${1%.pdf}-$EXPECTED_VARIANT.pdf"
+                return
+            fi
+            ;;
+    esac
+    echo $1
+}
+
+PDF1=$(variant $1)
+PDF2=$(variant $2)
 PDFTOPPM="pdftoppm -aa no -aaVector no"
 
 PDF1_PAGE_COUNT=$(pdfinfo $PDF1 | grep "Pages:")
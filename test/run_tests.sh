@@ -1,7 +1,26 @@
 #!/bin/bash
+#
+# Usage: run_tests.sh [-a args] [-e name] [test...]
+#
+#   -a args   extra arguments for palay, e.g. -a --direct-pdf to check the
+#             direct PDF writer against the expected files
+#   -e name   compare with expected-name.pdf instead of expected.pdf in the
+#             tests that have one, for output that genuinely differs, e.g.
+#             -a --direct-pdf -e direct
 
 SCRIPT_NAME=$0
 TEST_DIR=$(dirname $(readlink -f $0))
+PALAY_ARGS=
+EXPECTED_VARIANT=
+
+while getopts "a:e:" opt; do
+    case $opt in
+        a) PALAY_ARGS=$OPTARG ;;
+        e) EXPECTED_VARIANT=$OPTARG ;;
+        *) echo "Usage: $SCRIPT_NAME [-a args] [-e name] [test...]" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
 TESTS=$*
 
 red='\E[31m'
@@ -14,8 +33,12 @@ COMPAREPDF=$TEST_DIR/diffpdf.sh
 command -v $COMPAREPDF >/dev/null 2>&1 || { echo "$SCRIPT_NAME: comparepdf required. Install by 'sudo apt-get install comparepdf' or similar" >&2; exit 1; }
 command -v $PALAY_BIN >/dev/null 2>&1 || { echo "$SCRIPT_NAME: palay not found. Build it first." >&2; exit 1; }
 
+# The tests run $PALAY unquoted, so the arguments split
+[ -n "$PALAY_ARGS" ] && PALAY="$PALAY $PALAY_ARGS"
+
 export PALAY
 export COMPAREPDF
+export EXPECTED_VARIANT
 
 # point to libpalay.so
 export LD_LIBRARY_PATH=$TEST_DIR/../libpalay